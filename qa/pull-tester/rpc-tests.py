@@ -129,6 +129,7 @@ testScripts = [
     'txn_doublespend.py --mineblock',
     'txn_clone.py',
     'getchaintips.py',
+    'getblocktemplate_delta.py',
     'rest.py',
     'mempool_spendcoinbase.py',
     'mempool_reorg.py',
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+# Copyright (c) 2017 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+
+import time
+
+class GetBlockTemplateDeltaTest(BitcoinTestFramework):
+    '''
+    Test the per-template longpollid, the cached "transactions" array and
+    the "since" delta of getblocktemplate.
+    '''
+
+    def __init__(self):
+        super().__init__()
+        self.num_nodes = 2
+        self.setup_clean_chain = True
+
+    def setup_network(self):
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir)
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def run_test(self):
+        node = self.nodes[0]
+        node.generate(101)
+        self.sync_all()
+        # The template follows the mempool at most every five seconds
+        self.mocktime = int(time.time())
+        node.setmocktime(self.mocktime)
+
+        tmpl = node.getblocktemplate()
+        longpollid = tmpl['longpollid']
+        # <tip><transactions updated>-<template sequence>
+        assert_equal(longpollid[:64], node.getbestblockhash())
+        assert('-' in longpollid[64:])
+        assert_equal(tmpl['transactions'], [])
+
+        # The cached template is served as long as nothing changes
+        tmpl2 = node.getblocktemplate()
+        assert_equal(tmpl2['longpollid'], longpollid)
+        assert_equal(tmpl2['transactions'], tmpl['transactions'])
+
+        # Templates for callers with and without segwit support share the tip
+        # and mempool but still get different longpollids
+        tmpl_segwit = node.getblocktemplate({'rules': ['segwit']})
+        assert(tmpl_segwit['longpollid'] != longpollid)
+        assert_equal(tmpl_segwit['longpollid'][:64], longpollid[:64])
+        tmpl = node.getblocktemplate()
+        longpollid = tmpl['longpollid']
+
+        txid1 = node.sendtoaddress(node.getnewaddress(), 1)
+        # Still within five seconds of the last template, which is served again
+        assert_equal(node.getblocktemplate()['longpollid'], longpollid)
+
+        self.bump_time()
+        tmpl1 = node.getblocktemplate()
+        longpollid1 = tmpl1['longpollid']
+        assert(longpollid1 != longpollid)
+        assert_equal([tx['txid'] for tx in tmpl1['transactions']], [txid1])
+
+        # A delta against the empty template only lists the new transaction
+        tmpl_delta = node.getblocktemplate({'since': longpollid})
+        assert('transactions' not in tmpl_delta)
+        assert_equal(tmpl_delta['longpollid'], longpollid1)
+        delta = tmpl_delta['delta']
+        assert_equal(delta['since'], longpollid)
+        assert_equal(delta['removed'], [])
+        assert_equal(delta['added'], tmpl1['transactions'])
+
+        txid2 = node.sendtoaddress(node.getnewaddress(), 1)
+        self.bump_time()
+        tmpl2 = node.getblocktemplate()
+        assert_equal(set(tx['txid'] for tx in tmpl2['transactions']), set([txid1, txid2]))
+
+        # Deltas can be asked for against any recent template
+        for since, base in [(longpollid, []), (longpollid1, tmpl1['transactions'])]:
+            tmpl_delta = node.getblocktemplate({'since': since})
+            if 'delta' not in tmpl_delta:
+                # The template was reordered, the full list is sent instead
+                assert_equal(tmpl_delta['transactions'], tmpl2['transactions'])
+                continue
+            delta = tmpl_delta['delta']
+            assert_equal(delta['since'], since)
+            kept = [tx for tx in base if tx['txid'] not in delta['removed']]
+            assert_equal(kept + delta['added'], tmpl2['transactions'])
+
+        # Unknown longpollids, and ones for a template of the other kind, get the full list
+        for since in ['00' * 32 + '0-0', tmpl_segwit['longpollid']]:
+            tmpl_full = node.getblocktemplate({'since': since})
+            assert('delta' not in tmpl_full)
+            assert_equal(tmpl_full['transactions'], tmpl2['transactions'])
+        assert_raises_jsonrpc(-3, "since must be a longpollid string", node.getblocktemplate, {'since': 1})
+
+        # Nothing carries over to the next block
+        node.generate(1)
+        tmpl3 = node.getblocktemplate({'since': tmpl2['longpollid']})
+        assert('delta' not in tmpl3)
+        assert_equal(tmpl3['transactions'], [])
+        assert_equal(tmpl3['longpollid'][:64], node.getbestblockhash())
+
+    def bump_time(self):
+        self.mocktime += 6
+        self.nodes[0].setmocktime(self.mocktime)
+
+if __name__ == '__main__':
+    GetBlockTemplateDeltaTest().main()
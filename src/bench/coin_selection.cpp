@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "bench.h"
+#include "random.h"
 #include "wallet/wallet.h"
 
 #include <boost/foreach.hpp>
@@ -57,4 +58,33 @@ static void CoinSelection(benchmark::State& state)
     }
 }
 
+// Selection from pools the size of a busy payout wallet: many coins of
+// scattered values, a target needing several of them.
+static void CoinSelectionLargePool(benchmark::State& state, int nCoins)
+{
+    const CWallet wallet;
+    std::vector<COutput> vCoins;
+    LOCK(wallet.cs_wallet);
+
+    FastRandomContext rand(true);
+    for (int i = 0; i < nCoins; i++)
+        addCoin(COIN / 100 + (rand.rand32() % (10 * COIN)), wallet, vCoins);
+
+    while (state.KeepRunning()) {
+        std::set<std::pair<const CWalletTx*, unsigned int> > setCoinsRet;
+        CAmount nValueRet;
+        bool success = wallet.SelectCoinsMinConf(250 * COIN, 1, 6, 0, vCoins, setCoinsRet, nValueRet);
+        assert(success);
+        assert(nValueRet >= 250 * COIN);
+    }
+
+    BOOST_FOREACH (COutput output, vCoins)
+        delete output.tx;
+}
+
+static void CoinSelection10k(benchmark::State& state) { CoinSelectionLargePool(state, 10000); }
+static void CoinSelection100k(benchmark::State& state) { CoinSelectionLargePool(state, 100000); }
+
 BENCHMARK(CoinSelection);
+BENCHMARK(CoinSelection10k);
+BENCHMARK(CoinSelection100k);
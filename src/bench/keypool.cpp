@@ -0,0 +1,45 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainparams.h"
+#include "pubkey.h"
+#include "random.h"
+#include "util.h"
+#include "utiltime.h"
+#include "wallet/db.h"
+#include "wallet/wallet.h"
+
+#include <boost/filesystem.hpp>
+
+// Fill the keypool of a new HD wallet, as creating a wallet with a large
+// -keypool does.
+static void KeypoolTopUp(benchmark::State& state)
+{
+    ECCVerifyHandle verifyHandle;
+
+    // The database is in memory, but opening it still resolves the datadir
+    SelectParams(CBaseChainParams::REGTEST);
+    ClearDatadirCache();
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / strprintf("bench_umrcoin_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+    boost::filesystem::create_directories(pathTemp);
+    ForceSetArg("-datadir", pathTemp.string());
+    bitdb.MakeMock();
+
+    int nWallet = 0;
+    while (state.KeepRunning()) {
+        bool fFirstRun;
+        CWallet wallet(strprintf("keypool_bench%d.dat", nWallet++));
+        wallet.LoadWallet(fFirstRun);
+        wallet.SetHDMasterKey(wallet.GenerateNewHDMasterKey());
+        LOCK(wallet.cs_wallet);
+        wallet.TopUpKeyPool(1000);
+    }
+
+    bitdb.Flush(true);
+    bitdb.Reset();
+    boost::filesystem::remove_all(pathTemp);
+}
+
+BENCHMARK(KeypoolTopUp);
@@ -112,4 +112,47 @@ static void MempoolEviction(benchmark::State& state)
     }
 }
 
+
+// Evict from a mempool filled to the default 300MB limit of upstream nodes
+// with unique transactions, some of them in chains. Each iteration adds
+// higher fee transactions and trims back to the limit.
+static void MempoolEvictionFull(benchmark::State& state)
+{
+    const size_t nSizeLimit = 300 * 1000000;
+    const int nBatch = 1000;
+
+    CTxMemPool pool(CFeeRate(1000));
+    int64_t nCount = 0;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(2);
+    tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx.vout[0].nValue = 10 * COIN;
+    tx.vout[1].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    tx.vout[1].nValue = 10 * COIN;
+    while (pool.DynamicMemoryUsage() < nSizeLimit) {
+        // Every fourth transaction spends its predecessor, the rest are independent
+        if (nCount % 4 == 0) {
+            tx.vin[0].prevout.SetNull();
+            tx.vin[0].scriptSig = CScript() << nCount;
+        } else {
+            tx.vin[0].prevout = COutPoint(tx.GetHash(), 0);
+            tx.vin[0].scriptSig = CScript() << OP_1;
+        }
+        AddTx(tx, 1000 + (nCount * 7919) % 10000, pool);
+        nCount++;
+    }
+
+    while (state.KeepRunning()) {
+        for (int i = 0; i < nBatch; i++) {
+            tx.vin[0].prevout.SetNull();
+            tx.vin[0].scriptSig = CScript() << nCount;
+            AddTx(tx, 20000 + nCount % 10000, pool);
+            nCount++;
+        }
+        pool.TrimToSize(nSizeLimit);
+    }
+}
+
 BENCHMARK(MempoolEviction);
+BENCHMARK(MempoolEvictionFull);
@@ -0,0 +1,78 @@
+// Copyright (c) 2011-2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "policy/policy.h"
+#include "txmempool.h"
+
+#include <vector>
+
+static void AddTx(const CTransaction& tx, const CAmount& nFee, CTxMemPool& pool)
+{
+    int64_t nTime = 0;
+    double dPriority = 10.0;
+    unsigned int nHeight = 1;
+    bool spendsCoinbase = false;
+    unsigned int sigOpCost = 4;
+    LockPoints lp;
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(
+                                        MakeTransactionRef(tx), nFee, nTime, dPriority, nHeight,
+                                        tx.GetValueOut(), spendsCoinbase, sigOpCost, lp));
+}
+
+// Simulate disconnecting a block whose transactions start long chains of
+// unconfirmed transactions: the descendants are in the mempool first, then
+// the block's transactions are re-added and UpdateTransactionsFromBlock has
+// to link up and account for every chain.
+static void MempoolReorgUpdate(benchmark::State& state)
+{
+    const int nChains = 100;
+    const int nInBlock = 5;
+    const int nChainLength = 25;
+
+    std::vector<std::vector<CTransaction> > vChains(nChains);
+    for (int c = 0; c < nChains; c++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << c;
+        tx.vout.resize(2);
+        tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        tx.vout[1].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+        tx.vout[1].nValue = 10 * COIN;
+        for (int i = 0; i < nChainLength; i++) {
+            vChains[c].push_back(CTransaction(tx));
+            // Spend both outputs, so every link is found twice through mapNextTx
+            tx.vin.resize(2);
+            tx.vin[0].prevout = COutPoint(tx.GetHash(), 0);
+            tx.vin[1].prevout = COutPoint(tx.GetHash(), 1);
+        }
+    }
+
+    std::vector<uint256> vHashesToUpdate;
+    for (int i = 0; i < nInBlock; i++) {
+        for (int c = 0; c < nChains; c++) {
+            vHashesToUpdate.push_back(vChains[c][i].GetHash());
+        }
+    }
+
+    CTxMemPool pool(CFeeRate(1000));
+
+    while (state.KeepRunning()) {
+        for (int c = 0; c < nChains; c++) {
+            for (int i = nInBlock; i < nChainLength; i++) {
+                AddTx(vChains[c][i], 1000LL, pool);
+            }
+        }
+        for (int i = 0; i < nInBlock; i++) {
+            for (int c = 0; c < nChains; c++) {
+                AddTx(vChains[c][i], 1000LL, pool);
+            }
+        }
+        pool.UpdateTransactionsFromBlock(vHashesToUpdate);
+        pool.clear();
+    }
+}
+
+BENCHMARK(MempoolReorgUpdate);
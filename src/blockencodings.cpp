@@ -12,11 +12,17 @@
 #include "txmempool.h"
 #include "validation.h"
 #include "util.h"
+#include "utiltime.h"
 
 #include <unordered_map>
 
 #define MIN_TRANSACTION_BASE_SIZE (::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS))
 
+/** Mempool size below which short IDs are computed on the calling thread only */
+static const size_t MIN_SHORTIDS_PER_THREAD = 10000;
+/** Maximum number of threads used to compute mempool short IDs */
+static const int MAX_SHORTID_THREADS = 4;
+
 CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block, bool fUseWTXID) :
         nonce(GetRand(std::numeric_limits<uint64_t>::max())),
         shorttxids(block.vtx.size() - 1), prefilledtxn(1), header(block) {
@@ -45,6 +51,27 @@ uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const {
     return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
 }
 
+/** Compute the salted short IDs of a list of hashes, splitting the work over
+ *  a few threads when the list is large. */
+static void GetShortIDs(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<uint256>& vHashes, std::vector<uint64_t>& vShortIDs)
+{
+    vShortIDs.resize(vHashes.size());
+    auto worker = [&cmpctblock, &vHashes, &vShortIDs](size_t nBegin, size_t nEnd) {
+        for (size_t i = nBegin; i < nEnd; i++)
+            vShortIDs[i] = cmpctblock.GetShortID(vHashes[i]);
+    };
+
+    size_t nThreads = std::min<size_t>(std::max(1, std::min(GetNumCores(), MAX_SHORTID_THREADS)), vHashes.size() / MIN_SHORTIDS_PER_THREAD);
+    if (nThreads <= 1) {
+        worker(0, vHashes.size());
+        return;
+    }
+    // One chunk per thread, so ParallelFor starts no more than nThreads
+    size_t nChunk = (vHashes.size() + nThreads - 1) / nThreads;
+    ParallelFor(nThreads, [&worker, &vHashes, nChunk](size_t t) {
+        worker(std::min(vHashes.size(), t * nChunk), std::min(vHashes.size(), (t + 1) * nChunk));
+    });
+}
 
 
 ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<std::pair<uint256, CTransactionRef>>& extra_txn) {
@@ -53,6 +80,7 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     if (cmpctblock.shorttxids.size() + cmpctblock.prefilledtxn.size() > MAX_BLOCK_BASE_SIZE / MIN_TRANSACTION_BASE_SIZE)
         return READ_STATUS_INVALID;
 
+    int64_t nTimeStart = GetTimeMicros();
     assert(header.IsNull() && txn_available.empty());
     header = cmpctblock.header;
     txn_available.resize(cmpctblock.BlockTxCount());
@@ -104,23 +132,36 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
         return READ_STATUS_FAILED; // Short ID collision
 
     std::vector<bool> have_txn(txn_available.size());
+
+    // Snapshot the mempool's witness hashes and compute their short IDs without
+    // holding pool->cs; the salt differs per cmpctblock, so nothing can be reused.
+    std::vector<uint256> vMempoolHashes;
     {
     LOCK(pool->cs);
-    const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
-    for (size_t i = 0; i < vTxHashes.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(vTxHashes[i].first);
-        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
+    vMempoolHashes.reserve(pool->vTxHashes.size());
+    for (const auto& entry : pool->vTxHashes)
+        vMempoolHashes.push_back(entry.first);
+    }
+    std::vector<uint64_t> vMempoolShortIDs;
+    GetShortIDs(cmpctblock, vMempoolHashes, vMempoolShortIDs);
+    int64_t nTimeHashed = GetTimeMicros();
+
+    // Position in vMempoolHashes of the transaction matched for each block index
+    static const size_t NO_MATCH = std::numeric_limits<size_t>::max();
+    std::vector<size_t> mempool_match(txn_available.size(), NO_MATCH);
+    for (size_t i = 0; i < vMempoolShortIDs.size(); i++) {
+        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(vMempoolShortIDs[i]);
         if (idit != shorttxids.end()) {
             if (!have_txn[idit->second]) {
-                txn_available[idit->second] = vTxHashes[i].second->GetSharedTx();
+                mempool_match[idit->second] = i;
                 have_txn[idit->second]  = true;
                 mempool_count++;
             } else {
                 // If we find two mempool txn that match the short id, just request it.
                 // This should be rare enough that the extra bandwidth doesn't matter,
                 // but eating a round-trip due to FillBlock failure would be annoying
-                if (txn_available[idit->second]) {
-                    txn_available[idit->second].reset();
+                if (mempool_match[idit->second] != NO_MATCH) {
+                    mempool_match[idit->second] = NO_MATCH;
                     mempool_count--;
                 }
             }
@@ -131,6 +172,22 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
         if (mempool_count == shorttxids.size())
             break;
     }
+
+    {
+    LOCK(pool->cs);
+    const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
+    for (size_t i = 0; i < mempool_match.size(); i++) {
+        size_t pos = mempool_match[i];
+        if (pos == NO_MATCH)
+            continue;
+        if (pos < vTxHashes.size() && vTxHashes[pos].first == vMempoolHashes[pos]) {
+            txn_available[i] = vTxHashes[pos].second->GetSharedTx();
+        } else {
+            // The transaction left the mempool while we were hashing; request it
+            have_txn[i] = false;
+            mempool_count--;
+        }
+    }
     }
 
     for (size_t i = 0; i < extra_txn.size(); i++) {
@@ -164,7 +221,8 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
             break;
     }
 
-    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n", cmpctblock.header.GetHash().ToString(), GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+    int64_t nTimeEnd = GetTimeMicros();
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu in %.2fms (%lu mempool txn hashed in %.2fms)\n", cmpctblock.header.GetHash().ToString(), GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION), (nTimeEnd - nTimeStart) * 0.001, vMempoolHashes.size(), (nTimeHashed - nTimeStart) * 0.001);
 
     return READ_STATUS_OK;
 }
@@ -5,7 +5,10 @@
 #ifndef BITCOIN_CHECKQUEUE_H
 #define BITCOIN_CHECKQUEUE_H
 
+#include "sync.h"
+
 #include <algorithm>
+#include <atomic>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -127,8 +130,14 @@ private:
     }
 
 public:
+    //! Mutex to ensure only one concurrent CCheckQueueControl
+    boost::mutex ControlMutex;
+
+    //! Number of CCheckQueueControls waiting for ControlMutex that may not be kept waiting
+    std::atomic<int> nControlWaiting;
+
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn), nControlWaiting(0) {}
 
     //! Worker thread
     void Thread()
@@ -181,10 +190,23 @@ private:
     bool fDone;
 
 public:
-    CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
+    CCheckQueueControl() = delete;
+    CCheckQueueControl(const CCheckQueueControl&) = delete;
+    CCheckQueueControl& operator=(const CCheckQueueControl&) = delete;
+    /**
+     * A preemptible control does not announce that it is waiting for the
+     * queue; it is expected to add its checks in small portions and stop as
+     * soon as IsPreempted() returns true.
+     */
+    CCheckQueueControl(CCheckQueue<T>* pqueueIn, bool fPreemptibleIn = false) : pqueue(pqueueIn), fDone(false)
     {
         // passed queue is supposed to be unused, or NULL
         if (pqueue != NULL) {
+            if (!fPreemptibleIn)
+                pqueue->nControlWaiting++;
+            ENTER_CRITICAL_SECTION(pqueue->ControlMutex);
+            if (!fPreemptibleIn)
+                pqueue->nControlWaiting--;
             bool isIdle = pqueue->IsIdle();
             assert(isIdle);
         }
@@ -205,10 +227,19 @@ public:
             pqueue->Add(vChecks);
     }
 
+    //! Whether a non-preemptible control is waiting for the queue
+    bool IsPreempted() const
+    {
+        return pqueue != NULL && pqueue->nControlWaiting > 0;
+    }
+
     ~CCheckQueueControl()
     {
         if (!fDone)
             Wait();
+        if (pqueue != NULL) {
+            LEAVE_CRITICAL_SECTION(pqueue->ControlMutex);
+        }
     }
 };
 
@@ -136,6 +136,13 @@ static const char* FEE_ESTIMATES_FILENAME="fee_estimates.dat";
 std::atomic<bool> fRequestShutdown(false);
 std::atomic<bool> fDumpMempoolLater(false);
 
+static void PeriodicDumpMempool()
+{
+    // Not before the mempool was loaded from disk, or the dump would lose what is left to load
+    if (fDumpMempoolLater)
+        DumpMempool();
+}
+
 void StartShutdown()
 {
     fRequestShutdown = true;
@@ -350,6 +357,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
     strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
+    strUsage += HelpMessageOpt("-dumpmempoolinterval=<n>", strprintf(_("Also save the mempool to disk every <n> minutes, not only at shutdown (0 to disable, default: %u)"), DEFAULT_DUMP_MEMPOOL_INTERVAL));
     strUsage += HelpMessageOpt("-blockreconstructionextratxn=<n>", strprintf(_("Extra transactions to keep in memory for compact block reconstructions (default: %u)"), DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
@@ -918,6 +926,7 @@ bool AppInitParameterInteraction()
         if (GetBoolArg("-nodebug", false) || find(categories.begin(), categories.end(), std::string("0")) != categories.end())
             fDebug = false;
     }
+    fTrackLockWait = LogAcceptCategory("lock");
 
     // Check for -debugnet
     if (GetBoolArg("-debugnet", false))
@@ -1631,6 +1640,8 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (!est_filein.IsNull())
         mempool.ReadFeeEstimates(est_filein);
     fFeeEstimatesInitialized = true;
+    // Keep fee estimator updates off the validation thread from here on
+    mempool.StartFeeEstimatorProcessing(scheduler);
 
     // ********************************************************* Step 8: load wallet
 #ifdef ENABLE_WALLET
@@ -1690,6 +1701,10 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
+    int64_t nDumpMempoolInterval = GetArg("-dumpmempoolinterval", DEFAULT_DUMP_MEMPOOL_INTERVAL);
+    if (nDumpMempoolInterval > 0)
+        scheduler.scheduleEvery(&PeriodicDumpMempool, nDumpMempoolInterval * 60);
+
     // Wait for genesis block to be processed
     {
         boost::unique_lock<boost::mutex> lock(cs_GenesisWait);
@@ -27,6 +27,7 @@
 #include "validationinterface.h"
 
 #include <algorithm>
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <queue>
@@ -181,17 +182,7 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     nLastBlockSize = nBlockSize;
     nLastBlockWeight = nBlockWeight;
 
-    // Create coinbase transaction.
-    CMutableTransaction coinbaseTx;
-    coinbaseTx.vin.resize(1);
-    coinbaseTx.vin[0].prevout.SetNull();
-    coinbaseTx.vout.resize(1);
-    coinbaseTx.vout[0].scriptPubKey = scriptPubKeyIn;
-    coinbaseTx.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
-    coinbaseTx.vin[0].scriptSig = CScript() << nHeight << OP_0;
-    pblock->vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
-    pblocktemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(*pblock, pindexPrev, chainparams.GetConsensus());
-    pblocktemplate->vTxFees[0] = -nFees;
+    CreateCoinbase(scriptPubKeyIn, pindexPrev);
 
     uint64_t nSerializeSize = GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
     LogPrintf("CreateNewBlock(): total size: %u block weight: %u txs: %u fees: %ld sigops %d\n", nSerializeSize, GetBlockWeight(*pblock), nBlockTx, nFees, nBlockSigOpsCost);
@@ -201,7 +192,6 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
     pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
     pblock->nNonce         = 0;
-    pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(*pblock->vtx[0]);
 
     CValidationState state;
     if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
@@ -214,6 +204,21 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     return std::move(pblocktemplate);
 }
 
+void BlockAssembler::CreateCoinbase(const CScript& scriptPubKeyIn, const CBlockIndex* pindexPrev)
+{
+    CMutableTransaction coinbaseTx;
+    coinbaseTx.vin.resize(1);
+    coinbaseTx.vin[0].prevout.SetNull();
+    coinbaseTx.vout.resize(1);
+    coinbaseTx.vout[0].scriptPubKey = scriptPubKeyIn;
+    coinbaseTx.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
+    coinbaseTx.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    pblock->vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
+    pblocktemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(*pblock, pindexPrev, chainparams.GetConsensus());
+    pblocktemplate->vTxFees[0] = -nFees;
+    pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(*pblock->vtx[0]);
+}
+
 bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
 {
     BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
@@ -627,6 +632,192 @@ void BlockAssembler::addPriorityTxs()
     fNeedSizeAccounting = fSizeAccounting;
 }
 
+IncrementalBlockAssembler::IncrementalBlockAssembler(const CChainParams& _chainparams)
+    : BlockAssembler(_chainparams), pindexPrev(NULL), fMineWitnessTxLast(false), fNeedRebuild(true), nLastRebuild(0), fPendingOverflow(false)
+{
+    mempool.NotifyEntryAdded.connect(boost::bind(&IncrementalBlockAssembler::TransactionAddedToMempool, this, _1));
+    mempool.NotifyEntryRemoved.connect(boost::bind(&IncrementalBlockAssembler::TransactionRemovedFromMempool, this, _1, _2));
+    mempool.NotifyEntryPrioritised.connect(boost::bind(&IncrementalBlockAssembler::TransactionPrioritised, this, _1));
+}
+
+IncrementalBlockAssembler::~IncrementalBlockAssembler()
+{
+    mempool.NotifyEntryAdded.disconnect(boost::bind(&IncrementalBlockAssembler::TransactionAddedToMempool, this, _1));
+    mempool.NotifyEntryRemoved.disconnect(boost::bind(&IncrementalBlockAssembler::TransactionRemovedFromMempool, this, _1, _2));
+    mempool.NotifyEntryPrioritised.disconnect(boost::bind(&IncrementalBlockAssembler::TransactionPrioritised, this, _1));
+}
+
+void IncrementalBlockAssembler::TransactionAddedToMempool(CTransactionRef tx)
+{
+    LOCK(cs_pending);
+    if (vPendingAdded.size() >= BLOCK_TEMPLATE_MAX_PENDING) {
+        fPendingOverflow = true;
+        return;
+    }
+    vPendingAdded.push_back(tx);
+}
+
+void IncrementalBlockAssembler::TransactionRemovedFromMempool(CTransactionRef tx, MemPoolRemovalReason reason)
+{
+    LOCK(cs_pending);
+    if (setPendingRemoved.size() >= BLOCK_TEMPLATE_MAX_PENDING) {
+        fPendingOverflow = true;
+        return;
+    }
+    setPendingRemoved.insert(tx->GetHash());
+}
+
+void IncrementalBlockAssembler::TransactionPrioritised(const uint256& hash)
+{
+    // Fee deltas change the package ordering, which incremental updates keep
+    Invalidate();
+}
+
+void IncrementalBlockAssembler::Invalidate()
+{
+    LOCK(cs_pending);
+    fPendingOverflow = true;
+}
+
+void IncrementalBlockAssembler::RemoveTxs(const std::set<uint256>& setRemoved)
+{
+    std::vector<CTransactionRef> vtx;
+    std::vector<CAmount> vTxFees;
+    std::vector<int64_t> vTxSigOpsCost;
+    vtx.reserve(pblock->vtx.size());
+    vTxFees.reserve(pblock->vtx.size());
+    vTxSigOpsCost.reserve(pblock->vtx.size());
+    for (size_t i = 0; i < pblock->vtx.size(); i++) {
+        const CTransaction& tx = *pblock->vtx[i];
+        if (i == 0 || !setRemoved.count(tx.GetHash())) {
+            vtx.push_back(std::move(pblock->vtx[i]));
+            vTxFees.push_back(pblocktemplate->vTxFees[i]);
+            vTxSigOpsCost.push_back(pblocktemplate->vTxSigOpsCost[i]);
+            continue;
+        }
+        // Descendants of a removed transaction are removed from the mempool as well
+        setSelected.erase(tx.GetHash());
+        if (fNeedSizeAccounting) {
+            nBlockSize -= ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        }
+        nBlockWeight -= GetTransactionWeight(tx);
+        --nBlockTx;
+        nBlockSigOpsCost -= pblocktemplate->vTxSigOpsCost[i];
+        nFees -= pblocktemplate->vTxFees[i];
+    }
+    pblock->vtx.swap(vtx);
+    pblocktemplate->vTxFees.swap(vTxFees);
+    pblocktemplate->vTxSigOpsCost.swap(vTxSigOpsCost);
+}
+
+void IncrementalBlockAssembler::AddTxs(const std::vector<CTransactionRef>& vAdded)
+{
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    std::vector<CTxMemPool::txiter> sortedEntries;
+    for (const CTransactionRef& tx : vAdded) {
+        CTxMemPool::txiter it = mempool.mapTx.find(tx->GetHash());
+        if (it == mempool.mapTx.end() || setSelected.count(tx->GetHash()))
+            continue;
+
+        // The package is the transaction with its ancestors not in the template yet
+        CTxMemPool::setEntries ancestors;
+        mempool.CalculateMemPoolAncestors(*it, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        CTxMemPool::setEntries package;
+        package.insert(it);
+        BOOST_FOREACH(CTxMemPool::txiter anc, ancestors) {
+            if (!setSelected.count(anc->GetTx().GetHash()))
+                package.insert(anc);
+        }
+        uint64_t packageSize = 0;
+        CAmount packageFees = 0;
+        int64_t packageSigOpsCost = 0;
+        BOOST_FOREACH(CTxMemPool::txiter entry, package) {
+            packageSize += entry->GetTxSize();
+            packageFees += entry->GetModifiedFee();
+            packageSigOpsCost += entry->GetSigOpCost();
+        }
+
+        // A low fee package may still be picked up later by a child paying for it
+        if (packageFees < blockMinFeeRate.GetFee(packageSize))
+            continue;
+        if (!TestPackage(packageSize, packageSigOpsCost)) {
+            // The template is full; only a rebuild can tell whether this package should displace others
+            fNeedRebuild = true;
+            continue;
+        }
+        if (!TestPackageTransactions(package))
+            continue;
+
+        SortForBlock(package, it, sortedEntries);
+        for (CTxMemPool::txiter entry : sortedEntries) {
+            AddToBlock(entry);
+            setSelected.insert(entry->GetTx().GetHash());
+        }
+    }
+    // Iterators into mapTx are not kept across calls, entries may be removed in between
+    inBlock.clear();
+}
+
+std::unique_ptr<CBlockTemplate> IncrementalBlockAssembler::GetBlockTemplate(const CScript& scriptPubKeyIn, bool fMineWitnessTx)
+{
+    LOCK2(cs_main, mempool.cs);
+
+    std::vector<CTransactionRef> vAdded;
+    std::set<uint256> setRemoved;
+    bool fOverflow;
+    {
+        LOCK(cs_pending);
+        vAdded.swap(vPendingAdded);
+        setRemoved.swap(setPendingRemoved);
+        fOverflow = fPendingOverflow;
+        fPendingOverflow = false;
+    }
+
+    CBlockIndex* pindexTip = chainActive.Tip();
+    bool fChanged = !vAdded.empty() || !setRemoved.empty();
+    // Priority selection depends on coin age, which incremental updates do not track
+    bool fPrioritySelection = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE) > 0;
+    int64_t nNow = GetTime();
+    bool fRebuild = !pblocktemplate || pindexTip != pindexPrev || fMineWitnessTx != fMineWitnessTxLast || fOverflow ||
+        (fChanged && fPrioritySelection) ||
+        (fNeedRebuild && nNow - nLastRebuild >= BLOCK_TEMPLATE_REBUILD_INTERVAL);
+    if (!fRebuild) {
+        int64_t nTimeStart = GetTimeMicros();
+        if (!setRemoved.empty())
+            RemoveTxs(setRemoved);
+        if (!vAdded.empty())
+            AddTxs(vAdded);
+        CreateCoinbase(scriptPubKeyIn, pindexPrev);
+        UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
+        pblock->nBits = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
+        int64_t nTime1 = GetTimeMicros();
+
+        // Check what CreateNewBlock would have, whenever the transactions changed
+        CValidationState state;
+        if (fChanged && !TestBlockValidity(state, chainparams, *pblock, pindexTip, false, false)) {
+            LogPrintf("IncrementalBlockAssembler: TestBlockValidity failed: %s, rebuilding template\n", FormatStateMessage(state));
+            fRebuild = true;
+        }
+        LogPrint("bench", "IncrementalBlockAssembler: %u added, %u removed, %u txs: %.2fms, validity: %.2fms\n", vAdded.size(), setRemoved.size(), nBlockTx, 0.001 * (nTime1 - nTimeStart), 0.001 * (GetTimeMicros() - nTime1));
+    }
+    if (fRebuild) {
+        pindexPrev = NULL;
+        pblocktemplate = BlockAssembler::CreateNewBlock(scriptPubKeyIn, fMineWitnessTx);
+        pblock = &pblocktemplate->block;
+        inBlock.clear();
+        setSelected.clear();
+        for (size_t i = 1; i < pblock->vtx.size(); i++)
+            setSelected.insert(pblock->vtx[i]->GetHash());
+        pindexPrev = pindexTip;
+        fMineWitnessTxLast = fMineWitnessTx;
+        fNeedRebuild = false;
+        nLastRebuild = nNow;
+    }
+
+    return std::unique_ptr<CBlockTemplate>(new CBlockTemplate(*pblocktemplate));
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -23,6 +23,10 @@ class CWallet;
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Minimum seconds between full rebuilds of an incrementally maintained block template that is missing better paying transactions */
+static const int64_t BLOCK_TEMPLATE_REBUILD_INTERVAL = 5;
+/** Maximum number of mempool changes queued for an incrementally maintained block template before it is rebuilt instead */
+static const size_t BLOCK_TEMPLATE_MAX_PENDING = 100000;
 
 struct CBlockTemplate
 {
@@ -133,7 +137,7 @@ struct update_for_parent_inclusion
 /** Generate a new block, without valid proof-of-work */
 class BlockAssembler
 {
-private:
+protected:
     // The constructed block template
     std::unique_ptr<CBlockTemplate> pblocktemplate;
     // A convenience pointer that always refers to the CBlock in pblocktemplate
@@ -167,10 +171,12 @@ public:
     /** Construct a new block template with coinbase to scriptPubKeyIn */
     std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn, bool fMineWitnessTx=true);
 
-private:
+protected:
     // utility functions
     /** Clear the block's state and prepare for assembling a new block */
     void resetBlock();
+    /** Set the coinbase paying nFees plus the block subsidy to scriptPubKeyIn, with its witness commitment */
+    void CreateCoinbase(const CScript& scriptPubKeyIn, const CBlockIndex* pindexPrev);
     /** Add a tx to the block */
     void AddToBlock(CTxMemPool::txiter iter);
 
@@ -209,6 +215,54 @@ private:
     int UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
 };
 
+/**
+ * Keeps the block template for the current tip up to date as transactions
+ * enter and leave the mempool, instead of assembling it from scratch for
+ * every getblocktemplate call. Removed transactions are dropped from the
+ * template and new packages are appended while they fit, so serving a
+ * template only costs a new coinbase and header, plus a TestBlockValidity
+ * check when its transactions changed.
+ *
+ * The template is assembled from scratch when the tip changes, when a fee
+ * delta changes, when an updated template fails its validity check, and at
+ * most every BLOCK_TEMPLATE_REBUILD_INTERVAL seconds when a new package did
+ * not fit.
+ */
+class IncrementalBlockAssembler : public BlockAssembler
+{
+private:
+    const CBlockIndex* pindexPrev;
+    bool fMineWitnessTxLast;
+    bool fNeedRebuild;
+    int64_t nLastRebuild;
+    //! Transactions in the current template, except the coinbase
+    std::set<uint256> setSelected;
+
+    //! Mempool changes since the template was last updated
+    CCriticalSection cs_pending;
+    std::vector<CTransactionRef> vPendingAdded;
+    std::set<uint256> setPendingRemoved;
+    bool fPendingOverflow;
+
+    void TransactionAddedToMempool(CTransactionRef tx);
+    void TransactionRemovedFromMempool(CTransactionRef tx, MemPoolRemovalReason reason);
+    void TransactionPrioritised(const uint256& hash);
+
+    /** Drop removed transactions (and their accounting) from the template */
+    void RemoveTxs(const std::set<uint256>& setRemoved);
+    /** Append the packages of added transactions that fit */
+    void AddTxs(const std::vector<CTransactionRef>& vAdded);
+
+public:
+    IncrementalBlockAssembler(const CChainParams& chainparams);
+    ~IncrementalBlockAssembler();
+
+    /** Return a template for the current tip with coinbase to scriptPubKeyIn */
+    std::unique_ptr<CBlockTemplate> GetBlockTemplate(const CScript& scriptPubKeyIn, bool fMineWitnessTx=true);
+    /** Force the next template to be assembled from scratch */
+    void Invalidate();
+};
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
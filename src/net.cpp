@@ -623,6 +623,68 @@ void CNode::SetAddrLocal(const CService& addrLocalIn) {
 
 #undef X
 #define X(name) stats.name = name
+CLog2Histogram::CLog2Histogram() : nCount(0), nSum(0), nMax(0)
+{
+    memset(vBuckets, 0, sizeof(vBuckets));
+}
+
+void CLog2Histogram::Add(uint64_t nValue)
+{
+    int nBucket = 0;
+    for (uint64_t n = nValue; n != 0 && nBucket < BUCKETS - 1; n >>= 1)
+        nBucket++;
+    vBuckets[nBucket]++;
+    nCount++;
+    nSum += nValue;
+    nMax = std::max(nMax, nValue);
+}
+
+CLog2Histogram& CLog2Histogram::operator+=(const CLog2Histogram& other)
+{
+    for (int i = 0; i < BUCKETS; i++)
+        vBuckets[i] += other.vBuckets[i];
+    nCount += other.nCount;
+    nSum += other.nSum;
+    nMax = std::max(nMax, other.nMax);
+    return *this;
+}
+
+CMsgCmdStats& CMsgCmdStats::operator+=(const CMsgCmdStats& other)
+{
+    size += other.size;
+    queueTime += other.queueTime;
+    procTime += other.procTime;
+    lockWait += other.lockWait;
+    return *this;
+}
+
+void CNode::RecordRecvMsg(const std::string& strCommand, uint64_t nSize, int64_t nQueueTime, int64_t nProcTime, int64_t nLockWait)
+{
+    // to prevent a memory DOS, only keep separate statistics for valid commands
+    static const std::set<std::string> setKnownCommands(getAllNetMessageTypes().begin(), getAllNetMessageTypes().end());
+
+    LOCK(cs_vProcessMsg);
+    CMsgCmdStats& stats = mapRecvStatsPerMsgCmd[setKnownCommands.count(strCommand) ? strCommand : NET_MESSAGE_COMMAND_OTHER];
+    stats.size.Add(nSize);
+    stats.queueTime.Add(std::max(nQueueTime, (int64_t)0));
+    stats.procTime.Add(std::max(nProcTime, (int64_t)0));
+    stats.lockWait.Add(std::max(nLockWait, (int64_t)0));
+}
+
+void CNode::copyMsgStats(CNodeMsgStats &stats)
+{
+    stats.nodeid = GetId();
+    stats.addrName = GetAddrName();
+    {
+        LOCK(cs_vProcessMsg);
+        stats.mapRecv = mapRecvStatsPerMsgCmd;
+    }
+    {
+        LOCK(cs_vSend);
+        stats.mapSend = mapSendStatsPerMsgCmd;
+    }
+}
+
 void CNode::copyStats(CNodeStats &stats)
 {
     stats.nodeid = this->GetId();
@@ -826,6 +888,7 @@ const uint256& CNetMessage::GetMessageHash() const
 size_t CConnman::SocketSendData(CNode *pnode) const
 {
     auto it = pnode->vSendMsg.begin();
+    auto itTiming = pnode->vSendMsgTiming.begin();
     size_t nSentSize = 0;
 
     while (it != pnode->vSendMsg.end()) {
@@ -847,7 +910,10 @@ size_t CConnman::SocketSendData(CNode *pnode) const
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
                 pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
+                if (itTiming->second)
+                    itTiming->second->queueTime.Add(std::max(GetTimeMicros() - itTiming->first, (int64_t)0));
                 it++;
+                itTiming++;
             } else {
                 // could not send full message; stop sending more
                 break;
@@ -872,6 +938,7 @@ size_t CConnman::SocketSendData(CNode *pnode) const
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+    pnode->vSendMsgTiming.erase(pnode->vSendMsgTiming.begin(), itTiming);
     return nSentSize;
 }
 
@@ -2495,6 +2562,17 @@ void CConnman::GetNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+void CConnman::GetNodeMsgStats(std::vector<CNodeMsgStats>& vstats)
+{
+    vstats.clear();
+    LOCK(cs_vNodes);
+    vstats.reserve(vNodes.size());
+    for (CNode* pnode : vNodes) {
+        vstats.emplace_back();
+        pnode->copyMsgStats(vstats.back());
+    }
+}
+
 bool CConnman::DisconnectNode(const std::string& strNode)
 {
     LOCK(cs_vNodes);
@@ -2782,12 +2860,18 @@ void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
         //log total amount of bytes per command
         pnode->mapSendBytesPerMsgCmd[msg.command] += nTotalSize;
         pnode->nSendSize += nTotalSize;
+        CMsgCmdStats* pstats = &pnode->mapSendStatsPerMsgCmd[msg.command];
+        pstats->size.Add(nTotalSize);
 
         if (pnode->nSendSize > nSendBufferMaxSize)
             pnode->fPauseSend = true;
+        int64_t nNow = GetTimeMicros();
         pnode->vSendMsg.push_back(std::move(serializedHeader));
-        if (nMessageSize)
+        pnode->vSendMsgTiming.emplace_back(nNow, nMessageSize ? NULL : pstats);
+        if (nMessageSize) {
             pnode->vSendMsg.push_back(std::move(msg.data));
+            pnode->vSendMsgTiming.emplace_back(nNow, pstats);
+        }
 
         // If write queue empty, attempt "optimistic write"
         if (optimisticSend == true)
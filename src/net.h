@@ -14,6 +14,7 @@
 #include "hash.h"
 #include "limitedmap.h"
 #include "netaddress.h"
+#include "primitives/transaction.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
@@ -104,6 +105,7 @@ struct AddedNodeInfo
 
 class CTransaction;
 class CNodeStats;
+class CNodeMsgStats;
 class CClientUIInterface;
 
 struct CSerializedNetMsg
@@ -244,6 +246,7 @@ public:
 
     size_t GetNodeCount(NumConnections num);
     void GetNodeStats(std::vector<CNodeStats>& vstats);
+    void GetNodeMsgStats(std::vector<CNodeMsgStats>& vstats);
     bool DisconnectNode(const std::string& node);
     bool DisconnectNode(NodeId id);
 
@@ -483,6 +486,46 @@ extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 typedef std::map<std::string, uint64_t> mapMsgCmdSize; //command, total bytes
 
+/**
+ * Histogram with power-of-two buckets: bucket 0 counts zero values and
+ * bucket i counts values in [2^(i-1), 2^i). The last bucket is open-ended.
+ */
+class CLog2Histogram
+{
+public:
+    static const int BUCKETS = 32;
+
+    uint64_t nCount;
+    uint64_t nSum;
+    uint64_t nMax;
+    uint64_t vBuckets[BUCKETS];
+
+    CLog2Histogram();
+    void Add(uint64_t nValue);
+    CLog2Histogram& operator+=(const CLog2Histogram& other);
+};
+
+/** Per message type statistics of one direction of a connection */
+struct CMsgCmdStats
+{
+    CLog2Histogram size;      //!< Message size in bytes, including the header
+    CLog2Histogram queueTime; //!< Microseconds queued: in vProcessMsg when receiving, in vSendMsg until written to the socket when sending
+    CLog2Histogram procTime;  //!< Microseconds spent in ProcessMessage (received messages only)
+    CLog2Histogram lockWait;  //!< Microseconds of procTime spent blocked on contended locks, mostly cs_main (received messages only, with -debug=lock)
+
+    CMsgCmdStats& operator+=(const CMsgCmdStats& other);
+};
+typedef std::map<std::string, CMsgCmdStats> mapMsgCmdStats;
+
+class CNodeMsgStats
+{
+public:
+    NodeId nodeid;
+    std::string addrName;
+    mapMsgCmdStats mapRecv;
+    mapMsgCmdStats mapSend;
+};
+
 class CNodeStats
 {
 public:
@@ -530,6 +573,8 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
+    CTransactionRef ptxReadAhead;   // transaction in a tx message, if already deserialized
+
     CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
@@ -571,6 +616,8 @@ public:
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
     std::deque<std::vector<unsigned char>> vSendMsg;
+    //! Enqueue time and send statistics for each vSendMsg entry; NULL for entries that do not end a message
+    std::deque<std::pair<int64_t, CMsgCmdStats*>> vSendMsgTiming;
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
     CCriticalSection cs_vRecv;
@@ -625,6 +672,9 @@ protected:
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
 
+    mapMsgCmdStats mapSendStatsPerMsgCmd; // protected by cs_vSend
+    mapMsgCmdStats mapRecvStatsPerMsgCmd; // protected by cs_vProcessMsg
+
 public:
     uint256 hashContinue;
     std::atomic<int> nStartingHeight;
@@ -801,6 +851,10 @@ public:
     void CloseSocketDisconnect();
 
     void copyStats(CNodeStats &stats);
+    void copyMsgStats(CNodeMsgStats &stats);
+
+    //! Record a received message of nSize bytes that waited nQueueTime and took nProcTime to process
+    void RecordRecvMsg(const std::string& strCommand, uint64_t nSize, int64_t nQueueTime, int64_t nProcTime, int64_t nLockWait);
 
     ServiceFlags GetLocalServices() const
     {
@@ -25,12 +25,15 @@
 #include "random.h"
 #include "tinyformat.h"
 #include "txmempool.h"
+#include "txorphanage.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "utilstrencodings.h"
 #include "validationinterface.h"
 
+#include <algorithm>
+
 #include <boost/thread.hpp>
 
 #if defined(NDEBUG)
@@ -39,24 +42,7 @@
 
 std::atomic<int64_t> nTimeBestReceived(0); // Used only to inform the wallet of when we last received a block
 
-struct IteratorComparator
-{
-    template<typename I>
-    bool operator()(const I& a, const I& b)
-    {
-        return &(*a) < &(*b);
-    }
-};
-
-struct COrphanTx {
-    // When modifying, adapt the copy of this definition in tests/DoS_tests.
-    CTransactionRef tx;
-    NodeId fromPeer;
-    int64_t nTimeExpire;
-};
-std::map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
-std::map<COutPoint, std::set<std::map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
-void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+static CTxOrphanage orphanage;
 
 static size_t vExtraTxnForCompactIt = 0;
 static std::vector<std::pair<uint256, CTransactionRef>> vExtraTxnForCompact GUARDED_BY(cs_main);
@@ -175,6 +161,8 @@ struct CNodeState {
     //! When the first entry in vBlocksInFlight started downloading. Don't care when vBlocksInFlight is empty.
     int64_t nDownloadingSince;
     int nBlocksInFlight;
+    //! Moving average of the time (in microseconds) this peer takes to deliver a requested block, or 0 if unknown.
+    int64_t nBlockDeliveryTimeAvg;
     int nBlocksInFlightValidHeaders;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
@@ -211,6 +199,7 @@ struct CNodeState {
         nStallingSince = 0;
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
+        nBlockDeliveryTimeAvg = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
@@ -290,7 +279,7 @@ void FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTime) {
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight) {
         mapBlocksInFlight.erase(entry.hash);
     }
-    EraseOrphansFor(nodeid);
+    orphanage.EraseForPeer(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
     nPeersWithValidatedDownloads -= (state->nBlocksInFlightValidHeaders != 0);
     assert(nPeersWithValidatedDownloads >= 0);
@@ -305,26 +294,43 @@ void FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTime) {
     }
 }
 
+// Requires cs_main.
+// Forget a block in flight without touching the download timers of the peer it was requested from.
+void RemoveBlockInFlight(std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight) {
+    CNodeState *state = State(itInFlight->second.first);
+    state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
+    if (state->nBlocksInFlightValidHeaders == 0 && itInFlight->second.second->fValidatedHeaders) {
+        // Last validated block on the queue was received.
+        nPeersWithValidatedDownloads--;
+    }
+    state->vBlocksInFlight.erase(itInFlight->second.second);
+    state->nBlocksInFlight--;
+    mapBlocksInFlight.erase(itInFlight);
+}
+
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
 // Also used if a block was /not/ received and timed out or started with another peer
-bool MarkBlockAsReceived(const uint256& hash) {
+// nodeFrom is the peer that delivered the block, if any, and is used to measure its delivery rate.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1) {
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
-        state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
-        if (state->nBlocksInFlightValidHeaders == 0 && itInFlight->second.second->fValidatedHeaders) {
-            // Last validated block on the queue was received.
-            nPeersWithValidatedDownloads--;
-        }
         if (state->vBlocksInFlight.begin() == itInFlight->second.second) {
             // First block on the queue was received, update the start download time for the next one
-            state->nDownloadingSince = std::max(state->nDownloadingSince, GetTimeMicros());
+            int64_t nNow = GetTimeMicros();
+            if (nodeFrom == itInFlight->second.first && nNow > state->nDownloadingSince) {
+                // Blocks are served in order, so this is how long the peer took to deliver this one.
+                int64_t nDeliveryTime = nNow - state->nDownloadingSince;
+                if (state->nBlockDeliveryTimeAvg == 0)
+                    state->nBlockDeliveryTimeAvg = nDeliveryTime;
+                else
+                    state->nBlockDeliveryTimeAvg = (state->nBlockDeliveryTimeAvg * 7 + nDeliveryTime) / 8;
+            }
+            state->nDownloadingSince = std::max(state->nDownloadingSince, nNow);
         }
-        state->vBlocksInFlight.erase(itInFlight->second.second);
-        state->nBlocksInFlight--;
         state->nStallingSince = 0;
-        mapBlocksInFlight.erase(itInFlight);
+        RemoveBlockInFlight(itInFlight);
         return true;
     }
     return false;
@@ -364,6 +370,16 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     return true;
 }
 
+// Requires cs_main.
+/** Number of blocks we want in flight from a peer, sized to keep BLOCK_DOWNLOAD_TARGET_BACKLOG worth of
+ *  downloads queued at the rate it has been delivering blocks. */
+int GetMaxBlocksInFlight(const CNodeState* state) {
+    if (state->nBlockDeliveryTimeAvg == 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nBlocks = BLOCK_DOWNLOAD_TARGET_BACKLOG / state->nBlockDeliveryTimeAvg;
+    return std::max<int64_t>(MIN_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER, nBlocks));
+}
+
 /** Check whether the last unknown block a peer advertised is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
@@ -468,8 +484,9 @@ const CBlockIndex* LastCommonAncestor(const CBlockIndex* pa, const CBlockIndex*
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const Consensus::Params& consensusParams) {
+ *  at most count entries. If nothing can be fetched because the download window is held up by another
+ *  peer, that peer and the in-flight block it is holding the window up with are returned. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const CBlockIndex*& pindexStaller, const Consensus::Params& consensusParams) {
     if (count == 0)
         return;
 
@@ -505,6 +522,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    const CBlockIndex* pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -540,6 +558,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStaller = pindexWaitingFor;
                     }
                     return;
                 }
@@ -550,6 +569,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -565,6 +585,8 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     stats.nMisbehavior = state->nMisbehavior;
     stats.nSyncHeight = state->pindexBestKnownBlock ? state->pindexBestKnownBlock->nHeight : -1;
     stats.nCommonHeight = state->pindexLastCommonBlock ? state->pindexLastCommonBlock->nHeight : -1;
+    stats.nMaxBlocksInFlight = GetMaxBlocksInFlight(state);
+    stats.nBlockDeliveryTimeAvg = state->nBlockDeliveryTimeAvg;
     BOOST_FOREACH(const QueuedBlock& queue, state->vBlocksInFlight) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
@@ -590,7 +612,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// mapOrphanTransactions
+// orphan transactions
 //
 
 void AddToCompactExtraTransactions(const CTransactionRef& tx)
@@ -604,109 +626,6 @@ void AddToCompactExtraTransactions(const CTransactionRef& tx)
     vExtraTxnForCompactIt = (vExtraTxnForCompactIt + 1) % max_extra_txn;
 }
 
-bool AddOrphanTx(const CTransactionRef& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
-    const uint256& hash = tx->GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return false;
-
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 100 orphans, each of which is at most 99,999 bytes big is
-    // at most 10 megabytes of orphans and somewhat more byprev index (in the worst case):
-    unsigned int sz = GetTransactionWeight(*tx);
-    if (sz >= MAX_STANDARD_TX_WEIGHT)
-    {
-        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
-        return false;
-    }
-
-    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME});
-    assert(ret.second);
-    BOOST_FOREACH(const CTxIn& txin, tx->vin) {
-        mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
-    }
-
-    AddToCompactExtraTransactions(tx);
-
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
-    return true;
-}
-
-int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
-    std::map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
-        return 0;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx->vin)
-    {
-        auto itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(it);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
-    mapOrphanTransactions.erase(it);
-    return 1;
-}
-
-void EraseOrphansFor(NodeId peer)
-{
-    int nErased = 0;
-    std::map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        std::map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            nErased += EraseOrphanTx(maybeErase->second.tx->GetHash());
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer=%d\n", nErased, peer);
-}
-
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
-    unsigned int nEvicted = 0;
-    static int64_t nNextSweep;
-    int64_t nNow = GetTime();
-    if (nNextSweep <= nNow) {
-        // Sweep out expired orphan pool entries:
-        int nErased = 0;
-        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
-        std::map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-        while (iter != mapOrphanTransactions.end())
-        {
-            std::map<uint256, COrphanTx>::iterator maybeErase = iter++;
-            if (maybeErase->second.nTimeExpire <= nNow) {
-                nErased += EraseOrphanTx(maybeErase->second.tx->GetHash());
-            } else {
-                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
-            }
-        }
-        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
-        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
-        if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
-    }
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        std::map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-        ++nEvicted;
-    }
-    return nEvicted;
-}
-
 // Requires cs_main.
 void Misbehaving(NodeId pnode, int howmuch)
 {
@@ -748,28 +667,10 @@ void PeerLogicValidation::SyncTransaction(const CTransaction& tx, const CBlockIn
     if (nPosInBlock == CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK)
         return;
 
-    LOCK(cs_main);
-
-    std::vector<uint256> vOrphanErase;
-    // Which orphan pool entries must we evict?
-    for (size_t j = 0; j < tx.vin.size(); j++) {
-        auto itByPrev = mapOrphanTransactionsByPrev.find(tx.vin[j].prevout);
-        if (itByPrev == mapOrphanTransactionsByPrev.end()) continue;
-        for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
-            const CTransaction& orphanTx = *(*mi)->second.tx;
-            const uint256& orphanHash = orphanTx.GetHash();
-            vOrphanErase.push_back(orphanHash);
-        }
-    }
-
-    // Erase orphan transactions include or precluded by this block
-    if (vOrphanErase.size()) {
-        int nErased = 0;
-        BOOST_FOREACH(uint256 &orphanHash, vOrphanErase) {
-            nErased += EraseOrphanTx(orphanHash);
-        }
+    // Erase orphan transactions included or precluded by this block
+    int nErased = orphanage.EraseForTx(tx);
+    if (nErased > 0)
         LogPrint("mempool", "Erased %d orphan tx included or conflicted by block\n", nErased);
-    }
 }
 
 static CCriticalSection cs_most_recent_block;
@@ -909,7 +810,7 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
             // requesting or processing some txs which have already been included in a block
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
-                   mapOrphanTransactions.count(inv.hash) ||
+                   orphanage.HaveTx(inv.hash) ||
                    pcoinsTip->HaveCoinsInCache(inv.hash);
         }
     case MSG_BLOCK:
@@ -1167,7 +1068,47 @@ inline void static SendBlockTransactions(const CBlock& block, const BlockTransac
     connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCKTXN, resp));
 }
 
-bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman& connman, const std::atomic<bool>& interruptMsgProc)
+/**
+ * Verify the scripts of ptx, and of the tx messages queued behind it, on the
+ * script checking threads before taking cs_main to accept them one by one, so
+ * that bursts of transactions find their signatures in the cache. The queued
+ * messages keep their deserialized transaction for when they are processed.
+ */
+void static WarmTxMessages(CNode* pfrom, const CTransactionRef& ptx)
+{
+    if (!nScriptCheckThreads)
+        return;
+
+    std::vector<CNetMessage*> vQueued;
+    {
+        LOCK(pfrom->cs_vProcessMsg);
+        for (CNetMessage& msg : pfrom->vProcessMsg) {
+            if (vQueued.size() + 1 >= MAX_TX_MSGS_WARM_BATCH || msg.hdr.GetCommand() != NetMsgType::TX)
+                break;
+            vQueued.push_back(&msg);
+        }
+    }
+
+    // Only this thread takes messages off vProcessMsg, so the queued ones
+    // stay put while they are read outside the lock.
+    std::vector<CTransactionRef> vtx(1, ptx);
+    for (CNetMessage* pmsg : vQueued) {
+        try {
+            CSpanReader stream(pmsg->vRecv.GetType(), pfrom->GetRecvVersion(), pmsg->vRecv.data(), pmsg->vRecv.data() + pmsg->vRecv.size());
+            stream >> pmsg->ptxReadAhead;
+            vtx.push_back(pmsg->ptxReadAhead);
+        } catch (const std::exception&) {
+            // Reported when the message itself is processed
+            pmsg->ptxReadAhead.reset();
+        }
+    }
+    // Transactions rejected before are not worth verifying again
+    WarmSignatureCache(vtx, [](const CTransaction& tx) {
+        return AlreadyHave(CInv(MSG_TX, tx.GetHash()));
+    });
+}
+
+bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman& connman, const std::atomic<bool>& interruptMsgProc, const CTransactionRef& ptxReadAhead = CTransactionRef())
 {
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
     if (IsArgSet("-dropmessagestest") && GetRand(GetArg("-dropmessagestest", 0)) == 0)
@@ -1781,8 +1722,12 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
 
         std::deque<COutPoint> vWorkQueue;
         std::vector<uint256> vEraseQueue;
-        CTransactionRef ptx;
-        vRecv >> ptx;
+        CTransactionRef ptx = ptxReadAhead;
+        if (!ptx) {
+            vRecv >> ptx;
+            // Messages read ahead were verified together with an earlier one
+            WarmTxMessages(pfrom, ptx);
+        }
         const CTransaction& tx = *ptx;
 
         CInv inv(MSG_TX, tx.GetHash());
@@ -1815,18 +1760,14 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             // Recursively process any orphan transactions that depended on this one
             std::set<NodeId> setMisbehaving;
             while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
+                std::vector<std::pair<CTransactionRef, NodeId>> vChildren = orphanage.GetChildren(vWorkQueue.front());
                 vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
+                for (const auto& child : vChildren)
                 {
-                    const CTransactionRef& porphanTx = (*mi)->second.tx;
+                    const CTransactionRef& porphanTx = child.first;
                     const CTransaction& orphanTx = *porphanTx;
                     const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
+                    NodeId fromPeer = child.second;
                     bool fMissingInputs2 = false;
                     // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
                     // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
@@ -1871,7 +1812,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             }
 
             BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+                orphanage.EraseTx(hash);
         }
         else if (fMissingInputs)
         {
@@ -1889,11 +1830,14 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                     pfrom->AddInventoryKnown(_inv);
                     if (!AlreadyHave(_inv)) pfrom->AskFor(_inv);
                 }
-                AddOrphanTx(ptx, pfrom->GetId());
+                int64_t nNow = GetTime();
+                if (orphanage.AddTx(ptx, pfrom->GetId(), nNow + ORPHAN_TX_EXPIRE_TIME))
+                    AddToCompactExtraTransactions(ptx);
 
-                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+                // DoS prevention: do not allow the orphanage to grow unbounded
+                orphanage.EraseExpired(nNow);
                 unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+                unsigned int nEvicted = orphanage.LimitOrphans(nMaxOrphanTx);
                 if (nEvicted > 0)
                     LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
             } else {
@@ -2384,7 +2328,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             LOCK(cs_main);
             // Also always process if we requested the block explicitly, as we may
             // need it even though it is not a candidate for a new best tip.
-            forceProcessing |= MarkBlockAsReceived(hash);
+            forceProcessing |= MarkBlockAsReceived(hash, pfrom->GetId());
             // mapBlockSource is only used for sending reject messages and DoS scores,
             // so the race between here and cs_main in ProcessNewBlock is fine.
             mapBlockSource.emplace(hash, std::make_pair(pfrom->GetId(), true));
@@ -2740,9 +2684,11 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& i
 
         // Process message
         bool fRet = false;
+        int64_t nProcessStart = GetTimeMicros();
+        int64_t nLockWaitStart = GetThreadLockWaitMicros();
         try
         {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, chainparams, connman, interruptMsgProc);
+            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, chainparams, connman, interruptMsgProc, msg.ptxReadAhead);
             if (interruptMsgProc)
                 return false;
             if (!pfrom->vRecvGetData.empty())
@@ -2777,6 +2723,9 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& i
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        pfrom->RecordRecvMsg(strCommand, nMessageSize + CMessageHeader::HEADER_SIZE, nProcessStart - msg.nTime,
+                             GetTimeMicros() - nProcessStart, GetThreadLockWaitMicros() - nLockWaitStart);
+
         if (!fRet) {
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
         }
@@ -2787,23 +2736,6 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman, const std::atomic<bool>& i
     return fMoreWork;
 }
 
-class CompareInvMempoolOrder
-{
-    CTxMemPool *mp;
-public:
-    CompareInvMempoolOrder(CTxMemPool *_mempool)
-    {
-        mp = _mempool;
-    }
-
-    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b)
-    {
-        /* As std::make_heap produces a max-heap, we want the entries with the
-         * fewest ancestors/highest fee to sort later. */
-        return mp->CompareDepthAndScore(*b, *a);
-    }
-};
-
 bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interruptMsgProc)
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -3127,47 +3059,34 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
             }
 
             // Determine transactions to relay
-            if (fSendTrickle) {
-                // Produce a vector with all candidates for sending
-                std::vector<std::set<uint256>::iterator> vInvTx;
-                vInvTx.reserve(pto->setInventoryTxToSend.size());
-                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
-                    vInvTx.push_back(it);
-                }
+            if (fSendTrickle && !pto->setInventoryTxToSend.empty()) {
                 CAmount filterrate = 0;
                 {
                     LOCK(pto->cs_feeFilter);
                     filterrate = pto->minFeeFilter;
                 }
+                LOCK(pto->cs_filter);
+                // Take all candidates out of the to-be-sent set, dropping the ones
+                // the peer already knows about before touching the mempool.
+                std::vector<uint256> vInvTx;
+                vInvTx.reserve(pto->setInventoryTxToSend.size());
+                for (const uint256& hash : pto->setInventoryTxToSend) {
+                    if (!pto->filterInventoryKnown.contains(hash)) {
+                        vInvTx.push_back(hash);
+                    }
+                }
+                pto->setInventoryTxToSend.clear();
                 // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
-                // A heap is used so that not all items need sorting if only a few are being sent.
-                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
-                std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                // All candidates are looked up in one pass over the mempool and only the head of
+                // the list is ordered, unless a bloom filter may reject an unknown number of them.
                 // No reason to drain out at many times the network's capacity,
                 // especially since we have many peers and some will draw much shorter delays.
+                std::vector<TxMempoolInfo> vInvInfo = mempool.infoForRelay(vInvTx, filterrate, pto->pfilter ? vInvTx.size() : INVENTORY_BROADCAST_MAX);
                 unsigned int nRelayedTransactions = 0;
-                LOCK(pto->cs_filter);
-                while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
-                    // Fetch the top element from the heap
-                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                    std::set<uint256>::iterator it = vInvTx.back();
-                    vInvTx.pop_back();
-                    uint256 hash = *it;
-                    // Remove it from the to-be-sent set
-                    pto->setInventoryTxToSend.erase(it);
-                    // Check if not in the filter already
-                    if (pto->filterInventoryKnown.contains(hash)) {
-                        continue;
-                    }
-                    // Not in the mempool anymore? don't bother sending it.
-                    auto txinfo = mempool.info(hash);
-                    if (!txinfo.tx) {
-                        continue;
-                    }
-                    if (filterrate && txinfo.feeRate.GetFeePerK() < filterrate) {
-                        continue;
-                    }
-                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*txinfo.tx)) continue;
+                std::vector<TxMempoolInfo>::iterator it = vInvInfo.begin();
+                for (; it != vInvInfo.end() && nRelayedTransactions < INVENTORY_BROADCAST_MAX; it++) {
+                    uint256 hash = it->tx->GetHash();
+                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*it->tx)) continue;
                     // Send
                     vInv.push_back(CInv(MSG_TX, hash));
                     nRelayedTransactions++;
@@ -3179,7 +3098,7 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
                             vRelayExpiration.pop_front();
                         }
 
-                        auto ret = mapRelay.insert(std::make_pair(hash, std::move(txinfo.tx)));
+                        auto ret = mapRelay.insert(std::make_pair(hash, std::move(it->tx)));
                         if (ret.second) {
                             vRelayExpiration.push_back(std::make_pair(nNow + 15 * 60 * 1000000, ret.first));
                         }
@@ -3190,6 +3109,10 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
                     }
                     pto->filterInventoryKnown.insert(hash);
                 }
+                // Whatever did not fit in this trickle is announced next time.
+                for (; it != vInvInfo.end(); it++) {
+                    pto->setInventoryTxToSend.insert(it->tx->GetHash());
+                }
             }
         }
         if (!vInv.empty())
@@ -3224,10 +3147,12 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
         // Message: getdata (blocks)
         //
         std::vector<CInv> vGetData;
-        if (!pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        int nMaxBlocksInFlight = GetMaxBlocksInFlight(&state);
+        if (!pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nMaxBlocksInFlight) {
             std::vector<const CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller, consensusParams);
+            const CBlockIndex* pindexStaller = NULL;
+            FindNextBlocksToDownload(pto->GetId(), nMaxBlocksInFlight - state.nBlocksInFlight, vToDownload, staller, pindexStaller, consensusParams);
             BOOST_FOREACH(const CBlockIndex *pindex, vToDownload) {
                 uint32_t nFetchFlags = GetFetchFlags(pto, pindex->pprev, consensusParams);
                 vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindex->GetBlockHash()));
@@ -3236,8 +3161,19 @@ bool SendMessages(CNode* pto, CConnman& connman, const std::atomic<bool>& interr
                     pindex->nHeight, pto->id);
             }
             if (state.nBlocksInFlight == 0 && staller != -1) {
-                if (State(staller)->nStallingSince == 0) {
-                    State(staller)->nStallingSince = nNow;
+                CNodeState *stallerState = State(staller);
+                if (state.nBlockDeliveryTimeAvg != 0 && stallerState->nBlockDeliveryTimeAvg > state.nBlockDeliveryTimeAvg * BLOCK_DOWNLOAD_SLOW_PEER_RATIO) {
+                    // The window is held up by a peer that is much slower than this one; rather than
+                    // waiting for it to stall out, fetch the block it is holding us up with from here.
+                    uint32_t nFetchFlags = GetFetchFlags(pto, pindexStaller->pprev, consensusParams);
+                    vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindexStaller->GetBlockHash()));
+                    // The slow peer did not deliver it, so its download and stall timers keep running.
+                    RemoveBlockInFlight(mapBlocksInFlight.find(pindexStaller->GetBlockHash()));
+                    MarkBlockAsInFlight(pto->GetId(), pindexStaller->GetBlockHash(), consensusParams, pindexStaller);
+                    LogPrint("net", "Requesting block %s (%d) peer=%d instead of slow peer=%d\n", pindexStaller->GetBlockHash().ToString(),
+                        pindexStaller->nHeight, pto->id, staller);
+                } else if (stallerState->nStallingSince == 0) {
+                    stallerState->nStallingSince = nNow;
                     LogPrint("net", "Stall started peer=%d\n", staller);
                 }
             }
@@ -3306,7 +3242,6 @@ public:
     CNetProcessingCleanup() {}
     ~CNetProcessingCleanup() {
         // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        orphanage.Clear();
     }
 } instance_of_cnetprocessingcleanup;
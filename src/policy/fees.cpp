@@ -9,10 +9,13 @@
 #include "amount.h"
 #include "primitives/transaction.h"
 #include "random.h"
+#include "scheduler.h"
 #include "streams.h"
 #include "txmempool.h"
 #include "util.h"
 
+#include <boost/bind.hpp>
+
 void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
                                 unsigned int maxConfirms, double _decay)
 {
@@ -281,17 +284,113 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
     }
 }
 
+CBlockPolicyEstimator::EstimatorTx::EstimatorTx(const CTxMemPoolEntry& entry)
+    : hash(entry.GetTx().GetHash()), nHeight(entry.GetHeight()),
+      // Feerates are stored and reported as BTC-per-kb:
+      feeRate(entry.GetFee(), entry.GetTxSize())
+{
+}
+
+void CBlockPolicyEstimator::StartBackgroundProcessing(CScheduler& _scheduler)
+{
+    LOCK(cs_queue);
+    scheduler = &_scheduler;
+}
+
+void CBlockPolicyEstimator::QueueEvent(EstimatorEvent& event)
+{
+    {
+        LOCK(cs_queue);
+        queue.push_back(EstimatorEvent());
+        std::swap(queue.back(), event);
+        if (scheduler) {
+            if (!fProcessingScheduled) {
+                fProcessingScheduled = true;
+                scheduler->scheduleFromNow(boost::bind(&CBlockPolicyEstimator::ProcessQueue, this), 0);
+            }
+            return;
+        }
+    }
+    ProcessQueue();
+}
+
+void CBlockPolicyEstimator::FlushQueue()
+{
+    ProcessQueue();
+}
+
+void CBlockPolicyEstimator::ProcessQueue()
+{
+    // Hold cs_feeEstimator while taking the queue, so that two threads
+    // draining at once still apply the events in the order they were queued.
+    LOCK(cs_feeEstimator);
+    std::deque<EstimatorEvent> events;
+    {
+        LOCK(cs_queue);
+        events.swap(queue);
+        fProcessingScheduled = false;
+    }
+
+    if (events.empty())
+        return;
+    bool fBlockProcessed = false;
+    for (const EstimatorEvent& event : events) {
+        switch (event.type) {
+        case EstimatorEvent::NEW_TX:
+            _processTransaction(event.vTxs[0], event.validFeeEstimate);
+            break;
+        case EstimatorEvent::REMOVE_TX:
+            _removeTx(event.hash);
+            break;
+        case EstimatorEvent::BLOCK:
+            _processBlock(event.nBlockHeight, event.vTxs);
+            fBlockProcessed = true;
+            break;
+        }
+    }
+    // Estimates also move with unconfirmed transactions, but a busy mempool
+    // would have them recomputed all the time: only blocks update them at
+    // once, mempool changes are picked up every few seconds. Without a
+    // scheduler nothing refreshes them, so queries do it when they are dirty.
+    if (fBlockProcessed) {
+        UpdateCachedEstimates();
+    } else {
+        fEstimatesDirty = true;
+        LOCK(cs_queue);
+        if (scheduler && !fRefreshScheduled) {
+            fRefreshScheduled = true;
+            scheduler->scheduleFromNow(boost::bind(&CBlockPolicyEstimator::RefreshEstimates, this), FEE_ESTIMATES_REFRESH_INTERVAL);
+        }
+    }
+}
+
+void CBlockPolicyEstimator::RefreshEstimates()
+{
+    LOCK(cs_feeEstimator);
+    fRefreshScheduled = false;
+    if (fEstimatesDirty)
+        UpdateCachedEstimates();
+}
+
 // This function is called from CTxMemPool::removeUnchecked to ensure
 // txs removed from the mempool for any reason are no longer
 // tracked. Txs that were part of a block have already been removed in
 // processBlockTx to ensure they are never double tracked, but it is
 // of no harm to try to remove them again.
-bool CBlockPolicyEstimator::removeTx(uint256 hash)
+void CBlockPolicyEstimator::removeTx(uint256 hash)
+{
+    EstimatorEvent event;
+    event.type = EstimatorEvent::REMOVE_TX;
+    event.hash = hash;
+    QueueEvent(event);
+}
+
+bool CBlockPolicyEstimator::_removeTx(const uint256& hash)
 {
     std::map<uint256, TxStatsInfo>::iterator pos = mapMemPoolTxs.find(hash);
     if (pos != mapMemPoolTxs.end()) {
         feeStats.removeTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex);
-        mapMemPoolTxs.erase(hash);
+        mapMemPoolTxs.erase(pos);
         return true;
     } else {
         return false;
@@ -299,7 +398,7 @@ bool CBlockPolicyEstimator::removeTx(uint256 hash)
 }
 
 CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
-    : nBestSeenHeight(0), trackedTxs(0), untrackedTxs(0)
+    : scheduler(NULL), fProcessingScheduled(false), fEstimatesDirty(true), fRefreshScheduled(false), nBestSeenHeight(0), trackedTxs(0), untrackedTxs(0)
 {
     static_assert(MIN_FEERATE > 0, "Min feerate must be nonzero");
     minTrackedFee = _minRelayFee < CFeeRate(MIN_FEERATE) ? CFeeRate(MIN_FEERATE) : _minRelayFee;
@@ -309,12 +408,22 @@ CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
     }
     vfeelist.push_back(INF_FEERATE);
     feeStats.Initialize(vfeelist, MAX_BLOCK_CONFIRMS, DEFAULT_DECAY);
+    UpdateCachedEstimates();
 }
 
 void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, bool validFeeEstimate)
 {
-    unsigned int txHeight = entry.GetHeight();
-    uint256 hash = entry.GetTx().GetHash();
+    EstimatorEvent event;
+    event.type = EstimatorEvent::NEW_TX;
+    event.vTxs.push_back(EstimatorTx(entry));
+    event.validFeeEstimate = validFeeEstimate;
+    QueueEvent(event);
+}
+
+void CBlockPolicyEstimator::_processTransaction(const EstimatorTx& tx, bool validFeeEstimate)
+{
+    unsigned int txHeight = tx.nHeight;
+    const uint256& hash = tx.hash;
     if (mapMemPoolTxs.count(hash)) {
         LogPrint("estimatefee", "Blockpolicy error mempool tx %s already being tracked\n",
                  hash.ToString().c_str());
@@ -337,16 +446,13 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
     }
     trackedTxs++;
 
-    // Feerates are stored and reported as BTC-per-kb:
-    CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
-
     mapMemPoolTxs[hash].blockHeight = txHeight;
-    mapMemPoolTxs[hash].bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
+    mapMemPoolTxs[hash].bucketIndex = feeStats.NewTx(txHeight, (double)tx.feeRate.GetFeePerK());
 }
 
-bool CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry* entry)
+bool CBlockPolicyEstimator::_processBlockTx(unsigned int nBlockHeight, const EstimatorTx& tx)
 {
-    if (!removeTx(entry->GetTx().GetHash())) {
+    if (!_removeTx(tx.hash)) {
         // This transaction wasn't being tracked for fee estimation
         return false;
     }
@@ -354,7 +460,7 @@ bool CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxM
     // How many blocks did it take for miners to include this transaction?
     // blocksToConfirm is 1-based, so a transaction included in the earliest
     // possible block has confirmation count of 1
-    int blocksToConfirm = nBlockHeight - entry->GetHeight();
+    int blocksToConfirm = nBlockHeight - tx.nHeight;
     if (blocksToConfirm <= 0) {
         // This can't happen because we don't process transactions from a block with a height
         // lower than our greatest seen height
@@ -362,15 +468,23 @@ bool CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxM
         return false;
     }
 
-    // Feerates are stored and reported as BTC-per-kb:
-    CFeeRate feeRate(entry->GetFee(), entry->GetTxSize());
-
-    feeStats.Record(blocksToConfirm, (double)feeRate.GetFeePerK());
+    feeStats.Record(blocksToConfirm, (double)tx.feeRate.GetFeePerK());
     return true;
 }
 
 void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
                                          std::vector<const CTxMemPoolEntry*>& entries)
+{
+    EstimatorEvent event;
+    event.type = EstimatorEvent::BLOCK;
+    event.nBlockHeight = nBlockHeight;
+    event.vTxs.reserve(entries.size());
+    for (const CTxMemPoolEntry* entry : entries)
+        event.vTxs.push_back(EstimatorTx(*entry));
+    QueueEvent(event);
+}
+
+void CBlockPolicyEstimator::_processBlock(unsigned int nBlockHeight, const std::vector<EstimatorTx>& vTxs)
 {
     if (nBlockHeight <= nBestSeenHeight) {
         // Ignore side chains and re-orgs; assuming they are random
@@ -391,8 +505,8 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
 
     unsigned int countedTxs = 0;
     // Repopulate the current block states
-    for (unsigned int i = 0; i < entries.size(); i++) {
-        if (processBlockTx(nBlockHeight, entries[i]))
+    for (unsigned int i = 0; i < vTxs.size(); i++) {
+        if (_processBlockTx(nBlockHeight, vTxs[i]))
             countedTxs++;
     }
 
@@ -400,20 +514,47 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
     feeStats.UpdateMovingAverages();
 
     LogPrint("estimatefee", "Blockpolicy after updating estimates for %u of %u txs in block, since last block %u of %u tracked, new mempool map size %u\n",
-             countedTxs, entries.size(), trackedTxs, trackedTxs + untrackedTxs, mapMemPoolTxs.size());
+             countedTxs, vTxs.size(), trackedTxs, trackedTxs + untrackedTxs, mapMemPoolTxs.size());
 
     trackedTxs = 0;
     untrackedTxs = 0;
 }
 
+void CBlockPolicyEstimator::UpdateCachedEstimates()
+{
+    fEstimatesDirty = false;
+    const unsigned int maxConfirms = feeStats.GetMaxConfirms();
+    vCachedEstimates.assign(maxConfirms + 1, -1);
+    vCachedSmartEstimates.assign(maxConfirms + 1, std::make_pair(-1.0, (int)maxConfirms));
+
+    // It's not possible to get reasonable estimates for confTarget of 1
+    for (unsigned int confTarget = 2; confTarget <= maxConfirms; confTarget++)
+        vCachedEstimates[confTarget] = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+
+    // The smart estimate for a target is the estimate at the lowest target
+    // at or above it that has one.
+    for (unsigned int confTarget = maxConfirms; confTarget >= 2; confTarget--) {
+        if (vCachedEstimates[confTarget] >= 0)
+            vCachedSmartEstimates[confTarget] = std::make_pair(vCachedEstimates[confTarget], (int)confTarget);
+        else if (confTarget < maxConfirms)
+            vCachedSmartEstimates[confTarget] = vCachedSmartEstimates[confTarget + 1];
+    }
+    if (maxConfirms >= 2)
+        vCachedSmartEstimates[1] = vCachedSmartEstimates[2];
+}
+
 CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 {
+    LOCK(cs_feeEstimator);
     // Return failure if trying to analyze a target we're not tracking
     // It's not possible to get reasonable estimates for confTarget of 1
     if (confTarget <= 1 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
         return CFeeRate(0);
 
-    double median = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    if (fEstimatesDirty && !fRefreshScheduled)
+        UpdateCachedEstimates();
+
+    double median = vCachedEstimates[confTarget];
 
     if (median < 0)
         return CFeeRate(0);
@@ -425,22 +566,20 @@ CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoun
 {
     if (answerFoundAtTarget)
         *answerFoundAtTarget = confTarget;
-    // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
-        return CFeeRate(0);
-
-    // It's not possible to get reasonable estimates for confTarget of 1
-    if (confTarget == 1)
-        confTarget = 2;
-
-    double median = -1;
-    while (median < 0 && (unsigned int)confTarget <= feeStats.GetMaxConfirms()) {
-        median = feeStats.EstimateMedianVal(confTarget++, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    double median;
+    {
+        LOCK(cs_feeEstimator);
+        // Return failure if trying to analyze a target we're not tracking
+        if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
+            return CFeeRate(0);
+
+        if (fEstimatesDirty && !fRefreshScheduled)
+            UpdateCachedEstimates();
+        median = vCachedSmartEstimates[confTarget].first;
+        if (answerFoundAtTarget)
+            *answerFoundAtTarget = vCachedSmartEstimates[confTarget].second;
     }
 
-    if (answerFoundAtTarget)
-        *answerFoundAtTarget = confTarget - 1;
-
     // If mempool is limiting txs , return at least the min feerate from the mempool
     CAmount minPoolFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFeePerK();
     if (minPoolFee > 0 && minPoolFee > median)
@@ -472,12 +611,15 @@ double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int *answerF
 
 void CBlockPolicyEstimator::Write(CAutoFile& fileout)
 {
+    FlushQueue();
+    LOCK(cs_feeEstimator);
     fileout << nBestSeenHeight;
     feeStats.Write(fileout);
 }
 
 void CBlockPolicyEstimator::Read(CAutoFile& filein, int nFileVersion)
 {
+    LOCK(cs_feeEstimator);
     int nFileBestSeenHeight;
     filein >> nFileBestSeenHeight;
     feeStats.Read(filein);
@@ -486,6 +628,7 @@ void CBlockPolicyEstimator::Read(CAutoFile& filein, int nFileVersion)
         TxConfirmStats priStats;
         priStats.Read(filein);
     }
+    UpdateCachedEstimates();
 }
 
 FeeFilterRounder::FeeFilterRounder(const CFeeRate& minIncrementalFee)
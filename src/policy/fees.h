@@ -8,13 +8,16 @@
 #include "amount.h"
 #include "uint256.h"
 #include "random.h"
+#include "sync.h"
 
+#include <deque>
 #include <map>
 #include <string>
 #include <vector>
 
 class CAutoFile;
 class CFeeRate;
+class CScheduler;
 class CTxMemPoolEntry;
 class CTxMemPool;
 
@@ -178,6 +181,9 @@ static const double MIN_SUCCESS_PCT = .95;
 /** Require an avg of 1 tx in the combined feerate bucket per block to have stat significance */
 static const double SUFFICIENT_FEETXS = 1;
 
+/** Seconds between recomputing the estimates for mempool changes alone; blocks recompute them at once */
+static const int64_t FEE_ESTIMATES_REFRESH_INTERVAL = 10;
+
 // Minimum and Maximum values for tracking feerates
 static constexpr double MIN_FEERATE = 10;
 static const double MAX_FEERATE = 1e7;
@@ -201,18 +207,25 @@ public:
     /** Create new BlockPolicyEstimator and initialize stats tracking classes with default values */
     CBlockPolicyEstimator(const CFeeRate& minRelayFee);
 
+    /**
+     * Process queued mempool and block events on the scheduler thread from
+     * now on, instead of in the thread that reports them. Until this is
+     * called (as in tests) every event is processed as it is reported.
+     */
+    void StartBackgroundProcessing(CScheduler& scheduler);
+
+    /** Process all queued events in the calling thread */
+    void FlushQueue();
+
     /** Process all the transactions that have been included in a block */
     void processBlock(unsigned int nBlockHeight,
                       std::vector<const CTxMemPoolEntry*>& entries);
 
-    /** Process a transaction confirmed in a block*/
-    bool processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry* entry);
-
     /** Process a transaction accepted to the mempool*/
     void processTransaction(const CTxMemPoolEntry& entry, bool validFeeEstimate);
 
     /** Remove a transaction from the mempool tracking stats*/
-    bool removeTx(uint256 hash);
+    void removeTx(uint256 hash);
 
     /** Return a feerate estimate */
     CFeeRate estimateFee(int confTarget);
@@ -244,6 +257,54 @@ public:
     void Read(CAutoFile& filein, int nFileVersion);
 
 private:
+    /** What the estimator needs to know about a mempool transaction */
+    struct EstimatorTx
+    {
+        uint256 hash;
+        unsigned int nHeight; //!< chain height when the transaction entered the mempool
+        CFeeRate feeRate;
+        EstimatorTx(const CTxMemPoolEntry& entry);
+    };
+
+    /** A mempool or block event, queued until the estimator gets to it */
+    struct EstimatorEvent
+    {
+        enum Type { NEW_TX, REMOVE_TX, BLOCK } type;
+        uint256 hash;                      //!< REMOVE_TX
+        std::vector<EstimatorTx> vTxs;     //!< the new transaction, or those confirmed by the block
+        bool validFeeEstimate;             //!< NEW_TX
+        unsigned int nBlockHeight;         //!< BLOCK
+    };
+
+    //! Taken first when processing events, and when reading estimates
+    CCriticalSection cs_feeEstimator;
+    //! Guards the event queue only, so reporting an event never waits for processing
+    CCriticalSection cs_queue;
+    std::deque<EstimatorEvent> queue;
+    CScheduler* scheduler;
+    bool fProcessingScheduled;
+
+    void QueueEvent(EstimatorEvent& event);
+    void ProcessQueue();
+    void RefreshEstimates();
+    void _processTransaction(const EstimatorTx& tx, bool validFeeEstimate);
+    void _processBlock(unsigned int nBlockHeight, const std::vector<EstimatorTx>& vTxs);
+    bool _processBlockTx(unsigned int nBlockHeight, const EstimatorTx& tx);
+    bool _removeTx(const uint256& hash);
+
+    /** Recompute the estimates for every target, after the stats changed */
+    void UpdateCachedEstimates();
+
+    //! Whether events were processed since the estimates were last computed
+    bool fEstimatesDirty;
+    //! Whether RefreshEstimates is scheduled to pick up mempool changes; always
+    //! the case while the estimates are dirty, once there is a scheduler
+    bool fRefreshScheduled;
+    //! estimateFee result by target, or a negative value if there is none
+    std::vector<double> vCachedEstimates;
+    //! estimateSmartFee result (before the mempool minimum) and the target it was found at
+    std::vector<std::pair<double, int> > vCachedSmartEstimates;
+
     CFeeRate minTrackedFee;    //!< Passed to constructor to avoid dependency on main
     unsigned int nBestSeenHeight;
     struct TxStatsInfo
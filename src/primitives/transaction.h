@@ -334,6 +334,10 @@ public:
     /** Convert a CMutableTransaction into a CTransaction. */
     CTransaction(const CMutableTransaction &tx);
     CTransaction(CMutableTransaction &&tx);
+    /** Convert a CMutableTransaction whose txid is already known, skipping the
+     *  hash computation. Only for txids stored along with the transaction by
+     *  this node itself, such as mempool.dat records that passed their checksum. */
+    CTransaction(CMutableTransaction &&tx, const uint256& hashIn);
 
     template <typename Stream>
     inline void Serialize(Stream& s) const {
@@ -349,10 +349,9 @@ std::string EntryDescriptionString()
            "       ... ]\n";
 }
 
-void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
+/** Fill info from e, whose in-mempool parents are vParents. Does not need mempool.cs. */
+static void entryToJSON(UniValue &info, const CTxMemPoolEntry &e, const std::vector<uint256>& vParents)
 {
-    AssertLockHeld(mempool.cs);
-
     info.push_back(Pair("size", (int)e.GetTxSize()));
     info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
     info.push_back(Pair("modifiedfee", ValueFromAmount(e.GetModifiedFee())));
@@ -366,12 +365,10 @@ void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
     info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
     info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
     info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
-    const CTransaction& tx = e.GetTx();
     set<string> setDepends;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    BOOST_FOREACH(const uint256& parent, vParents)
     {
-        if (mempool.exists(txin.prevout.hash))
-            setDepends.insert(txin.prevout.hash.ToString());
+        setDepends.insert(parent.ToString());
     }
 
     UniValue depends(UniValue::VARR);
@@ -383,34 +380,69 @@ void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
     info.push_back(Pair("depends", depends));
 }
 
+void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
+{
+    AssertLockHeld(mempool.cs);
+
+    const CTransaction& tx = e.GetTx();
+    std::vector<uint256> vParents;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (mempool.exists(txin.prevout.hash))
+            vParents.push_back(txin.prevout.hash);
+    }
+    entryToJSON(info, e, vParents);
+}
+
 UniValue mempoolToJSON(bool fVerbose = false)
 {
+    // Work from a snapshot, so that transactions can enter the mempool
+    // while the (possibly large) result is built.
+    CTxMemPoolSnapshotRef snapshot = mempool.GetSnapshot();
     if (fVerbose)
     {
-        LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
+        for (size_t i = 0; i < snapshot->vEntries.size(); i++)
         {
+            const CTxMemPoolEntry& e = snapshot->vEntries[i];
             const uint256& hash = e.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
+            entryToJSON(info, e, snapshot->vParents[i]);
             o.push_back(Pair(hash.ToString(), info));
         }
         return o;
     }
     else
     {
-        vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
-
         UniValue a(UniValue::VARR);
-        BOOST_FOREACH(const uint256& hash, vtxid)
-            a.push_back(hash.ToString());
+        BOOST_FOREACH(const CTxMemPoolEntry& e, snapshot->vEntries)
+            a.push_back(e.GetTx().GetHash().ToString());
 
         return a;
     }
 }
 
+/**
+ * Write the verbose mempool as a JSON object to strJSON one entry at a
+ * time, instead of building a UniValue for the whole mempool first.
+ */
+void mempoolToJSONStream(std::string& strJSON)
+{
+    CTxMemPoolSnapshotRef snapshot = mempool.GetSnapshot();
+    strJSON += "{";
+    for (size_t i = 0; i < snapshot->vEntries.size(); i++)
+    {
+        const CTxMemPoolEntry& e = snapshot->vEntries[i];
+        UniValue info(UniValue::VOBJ);
+        entryToJSON(info, e, snapshot->vParents[i]);
+        if (i > 0)
+            strJSON += ",";
+        strJSON += "\"" + e.GetTx().GetHash().ToString() + "\":";
+        strJSON += info.write();
+    }
+    strJSON += "}";
+}
+
 UniValue getrawmempool(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() > 1)
@@ -1276,6 +1308,8 @@ UniValue mempoolInfoToJSON()
     size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
     ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
+    ret.push_back(Pair("loaded", IsMempoolLoaded()));
+    ret.push_back(Pair("loadprogress", GetMempoolLoadProgress()));
 
     return ret;
 }
@@ -1292,7 +1326,9 @@ UniValue getmempoolinfo(const JSONRPCRequest& request)
             "  \"bytes\": xxxxx,              (numeric) Sum of all virtual transaction sizes as defined in BIP 141. Differs from actual serialized size because witness data is discounted\n"
             "  \"usage\": xxxxx,              (numeric) Total memory usage for the mempool\n"
             "  \"maxmempool\": xxxxx,         (numeric) Maximum memory usage for the mempool\n"
-            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted\n"
+            "  \"mempoolminfee\": xxxxx,      (numeric) Minimum fee for tx to be accepted\n"
+            "  \"loaded\": true|false,        (boolean) True once the mempool saved at shutdown has been reloaded\n"
+            "  \"loadprogress\": xxxxx        (numeric) Fraction of the saved mempool processed so far, between 0 and 1\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -1302,6 +1338,59 @@ UniValue getmempoolinfo(const JSONRPCRequest& request)
     return mempoolInfoToJSON();
 }
 
+UniValue mempoolFeeHistogramToJSON()
+{
+    const std::vector<CFeeHistogramBucket> vBuckets = mempool.GetFeeHistogram();
+
+    // Highest fee rate first, so that the cumulative size of a bucket is the
+    // block space taken by it and everything paying more.
+    UniValue buckets(UniValue::VARR);
+    uint64_t nCumulativeSize = 0;
+    for (std::vector<CFeeHistogramBucket>::const_reverse_iterator it = vBuckets.rbegin(); it != vBuckets.rend(); ++it) {
+        nCumulativeSize += it->nSize;
+        UniValue bucket(UniValue::VOBJ);
+        bucket.push_back(Pair("feerate", ValueFromAmount(it->feeRate.GetFeePerK())));
+        bucket.push_back(Pair("count", (int64_t) it->nCount));
+        bucket.push_back(Pair("size", (int64_t) it->nSize));
+        bucket.push_back(Pair("fees", ValueFromAmount(it->nFees)));
+        bucket.push_back(Pair("cumulativesize", (int64_t) nCumulativeSize));
+        buckets.push_back(bucket);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("bytes", (int64_t) nCumulativeSize));
+    ret.push_back(Pair("buckets", buckets));
+    return ret;
+}
+
+UniValue getmempoolfeehistogram(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw runtime_error(
+            "getmempoolfeehistogram\n"
+            "\nReturns the TX memory pool grouped into fee rate buckets, highest fee rate first.\n"
+            "Transactions are bucketed by their own fee rate, including any fee delta from prioritisetransaction.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"bytes\": xxxxx,               (numeric) Sum of all virtual transaction sizes\n"
+            "  \"buckets\": [                  (array) One entry per bucket, highest fee rate first\n"
+            "    {\n"
+            "      \"feerate\": x.xxxx,        (numeric) Lowest fee rate in the bucket in " + CURRENCY_UNIT + "/kB\n"
+            "      \"count\": xxxxx,           (numeric) Number of transactions in the bucket\n"
+            "      \"size\": xxxxx,            (numeric) Sum of virtual sizes of the transactions in the bucket\n"
+            "      \"fees\": x.xxxx,           (numeric) Sum of fees of the transactions in the bucket in " + CURRENCY_UNIT + "\n"
+            "      \"cumulativesize\": xxxxx   (numeric) Sum of virtual sizes of this and all higher buckets\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmempoolfeehistogram", "")
+            + HelpExampleRpc("getmempoolfeehistogram", "")
+        );
+
+    return mempoolFeeHistogramToJSON();
+}
+
 UniValue preciousblock(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() != 1)
@@ -1429,6 +1518,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    true,  {"txid","verbose"} },
     { "blockchain",         "getmempooldescendants",  &getmempooldescendants,  true,  {"txid","verbose"} },
     { "blockchain",         "getmempoolentry",        &getmempoolentry,        true,  {"txid"} },
+    { "blockchain",         "getmempoolfeehistogram", &getmempoolfeehistogram, true,  {} },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true,  {} },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true,  {"verbose"} },
     { "blockchain",         "gettxout",               &gettxout,               true,  {"txid","n","include_mempool"} },
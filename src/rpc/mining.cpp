@@ -22,6 +22,8 @@
 #include "utilstrencodings.h"
 #include "validationinterface.h"
 
+#include <deque>
+#include <limits>
 #include <memory>
 #include <stdint.h>
 
@@ -256,6 +258,13 @@ UniValue getmininginfo(const JSONRPCRequest& request)
 
 
 // NOTE: Unlike wallet RPC (which use BTC values), mining RPCs follow GBT (BIP 22) in using satoshi amounts
+/** Assembler behind getblocktemplate, kept up to date with the mempool between calls */
+static IncrementalBlockAssembler& GetTemplateAssembler()
+{
+    static IncrementalBlockAssembler assembler(Params());
+    return assembler;
+}
+
 UniValue prioritisetransaction(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() != 3)
@@ -315,6 +324,124 @@ std::string gbt_vb_name(const Consensus::DeploymentPos pos) {
     return s;
 }
 
+/** Number of recently served templates getblocktemplate can send deltas against */
+static const unsigned int GBT_DELTA_HISTORY = 16;
+
+/** Transactions of a template as served by getblocktemplate, for computing deltas */
+struct GBTServedTemplate
+{
+    std::string strLongPollId;
+    bool fSupportsSegwit;
+    std::vector<uint256> vTxid; //!< Non-coinbase transactions, in template order
+};
+
+// The getblocktemplate caches below are guarded by cs_main
+/** "transactions" array of the current template, built once per template */
+static UniValue gbtTransactions(UniValue::VARR);
+/** Txids of the entries of gbtTransactions */
+static std::vector<uint256> vGBTTxid;
+/** Hex serializations of the transactions in the current template, by wtxid */
+static std::map<uint256, std::string> mapGBTTxHex;
+/** Recently served templates, oldest first */
+static std::deque<GBTServedTemplate> vGBTHistory;
+
+/**
+ * Rebuild the cached "transactions" array for a new template. Transactions
+ * that were already in the previous template reuse their hex serialization.
+ */
+static void UpdateGBTTransactions(const CBlockTemplate& blocktemplate, bool fPreSegWit)
+{
+    gbtTransactions = UniValue(UniValue::VARR);
+    vGBTTxid.clear();
+    std::map<uint256, std::string> mapTxHexNew;
+    map<uint256, int64_t> setTxIndex;
+    int i = 0;
+    for (const auto& it : blocktemplate.block.vtx) {
+        const CTransaction& tx = *it;
+        uint256 txHash = tx.GetHash();
+        setTxIndex[txHash] = i++;
+
+        if (tx.IsCoinBase())
+            continue;
+
+        UniValue entry(UniValue::VOBJ);
+
+        const uint256& wtxHash = tx.GetWitnessHash();
+        std::map<uint256, std::string>::iterator itHex = mapGBTTxHex.find(wtxHash);
+        std::string& strHex = mapTxHexNew[wtxHash];
+        if (itHex != mapGBTTxHex.end())
+            strHex.swap(itHex->second);
+        else
+            strHex = EncodeHexTx(tx);
+        entry.push_back(Pair("data", strHex));
+        entry.push_back(Pair("txid", txHash.GetHex()));
+        entry.push_back(Pair("hash", wtxHash.GetHex()));
+
+        UniValue deps(UniValue::VARR);
+        BOOST_FOREACH (const CTxIn &in, tx.vin)
+        {
+            if (setTxIndex.count(in.prevout.hash))
+                deps.push_back(setTxIndex[in.prevout.hash]);
+        }
+        entry.push_back(Pair("depends", deps));
+
+        int index_in_template = i - 1;
+        entry.push_back(Pair("fee", blocktemplate.vTxFees[index_in_template]));
+        int64_t nTxSigOps = blocktemplate.vTxSigOpsCost[index_in_template];
+        if (fPreSegWit) {
+            assert(nTxSigOps % WITNESS_SCALE_FACTOR == 0);
+            nTxSigOps /= WITNESS_SCALE_FACTOR;
+        }
+        entry.push_back(Pair("sigops", nTxSigOps));
+        entry.push_back(Pair("weight", GetTransactionWeight(tx)));
+
+        gbtTransactions.push_back(entry);
+        vGBTTxid.push_back(txHash);
+    }
+    mapGBTTxHex.swap(mapTxHexNew);
+}
+
+/**
+ * Describe the current template relative to a recently served one, if its
+ * transaction list is the earlier list minus the removed transactions
+ * followed by the added ones. Returns false if no such delta exists.
+ */
+static bool GetGBTDelta(const std::string& strSince, bool fSupportsSegwit, const uint256& hashPrevBlock, UniValue& delta)
+{
+    if (strSince.size() < 64 || strSince.substr(0, 64) != hashPrevBlock.GetHex())
+        return false;
+
+    std::deque<GBTServedTemplate>::const_reverse_iterator itBase = vGBTHistory.rbegin();
+    while (itBase != vGBTHistory.rend() && (itBase->strLongPollId != strSince || itBase->fSupportsSegwit != fSupportsSegwit))
+        ++itBase;
+    if (itBase == vGBTHistory.rend())
+        return false;
+
+    std::set<uint256> setCurrent(vGBTTxid.begin(), vGBTTxid.end());
+    UniValue removed(UniValue::VARR);
+    size_t nKept = 0;
+    for (const uint256& hash : itBase->vTxid) {
+        if (!setCurrent.count(hash)) {
+            removed.push_back(hash.GetHex());
+        } else if (nKept < vGBTTxid.size() && vGBTTxid[nKept] == hash) {
+            ++nKept;
+        } else {
+            // The template was reordered
+            return false;
+        }
+    }
+
+    UniValue added(UniValue::VARR);
+    for (size_t i = nKept; i < vGBTTxid.size(); ++i)
+        added.push_back(gbtTransactions[i]);
+
+    delta = UniValue(UniValue::VOBJ);
+    delta.push_back(Pair("since", strSince));
+    delta.push_back(Pair("removed", removed));
+    delta.push_back(Pair("added", added));
+    return true;
+}
+
 UniValue getblocktemplate(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() > 1)
@@ -339,7 +466,9 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
             "       \"rules\":[            (array, optional) A list of strings\n"
             "           \"support\"          (string) client side supported softfork deployment\n"
             "           ,...\n"
-            "       ]\n"
+            "       ],\n"
+            "       \"since\":\"xxxx\"      (string, optional) The longpollid of a recently received template. If the transactions\n"
+            "                              can be expressed relative to it, \"delta\" is returned instead of \"transactions\"\n"
             "     }\n"
             "\n"
 
@@ -369,6 +498,11 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
             "      }\n"
             "      ,...\n"
             "  ],\n"
+            "  \"delta\" : {                      (json object) only if \"since\" was given: the transactions relative to that template\n"
+            "      \"since\" : \"xxxx\",              (string) the longpollid the delta applies to\n"
+            "      \"removed\" : [ \"txid\", ... ],  (array of strings) transactions no longer in the template\n"
+            "      \"added\" : [ ... ]               (array) transactions appended to the remaining ones, formatted like \"transactions\"\n"
+            "  },\n"
             "  \"coinbaseaux\" : {                 (json object) data that should be included in the coinbase's scriptSig content\n"
             "      \"flags\" : \"xx\"                  (string) key name is to be ignored, and value included in scriptSig\n"
             "  },\n"
@@ -398,6 +532,7 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
 
     std::string strMode = "template";
     UniValue lpval = NullUniValue;
+    std::string strSince;
     std::set<std::string> setClientRules;
     int64_t nMaxVersionPreVB = -1;
     if (request.params.size() > 0)
@@ -413,6 +548,11 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
         lpval = find_value(oparam, "longpollid");
+        const UniValue& sinceval = find_value(oparam, "since");
+        if (sinceval.isStr())
+            strSince = sinceval.get_str();
+        else if (!sinceval.isNull())
+            throw JSONRPCError(RPC_TYPE_ERROR, "since must be a longpollid string");
 
         if (strMode == "proposal")
         {
@@ -482,7 +622,7 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
 
         if (lpval.isStr())
         {
-            // Format: <hashBestChain><nTransactionsUpdatedLast>
+            // Format: <hashBestChain><nTransactionsUpdatedLast>-<nTemplateSeq>
             std::string lpstr = lpval.get_str();
 
             hashWatchedChain.SetHex(lpstr.substr(0, 64));
@@ -532,6 +672,10 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
     // Cache whether the last invocation was with segwit support, to avoid returning
     // a segwit-block to a non-segwit caller.
     static bool fLastTemplateSupportsSegwit = true;
+    // Bumped for every new template, to tell when the cached JSON is stale;
+    // also part of the longpollid, which "since" names a template by
+    static unsigned int nTemplateSeq;
+    static unsigned int nTemplateSeqServed = std::numeric_limits<unsigned int>::max();
     if (pindexPrev != chainActive.Tip() ||
         (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5) ||
         fLastTemplateSupportsSegwit != fSupportsSegwit)
@@ -547,12 +691,13 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
 
         // Create new block
         CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy, fSupportsSegwit);
+        pblocktemplate = GetTemplateAssembler().GetBlockTemplate(scriptDummy, fSupportsSegwit);
         if (!pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
         // Need to update only after we know CreateNewBlock succeeded
         pindexPrev = pindexPrevNew;
+        ++nTemplateSeq;
     }
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -564,46 +709,22 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
     // NOTE: If at some point we support pre-segwit miners post-segwit-activation, this needs to take segwit support into consideration
     const bool fPreSegWit = (THRESHOLD_ACTIVE != VersionBitsState(pindexPrev, consensusParams, Consensus::DEPLOYMENT_SEGWIT, versionbitscache));
 
-    UniValue aCaps(UniValue::VARR); aCaps.push_back("proposal");
-
-    UniValue transactions(UniValue::VARR);
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    for (const auto& it : pblock->vtx) {
-        const CTransaction& tx = *it;
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
-
-        if (tx.IsCoinBase())
-            continue;
-
-        UniValue entry(UniValue::VOBJ);
-
-        entry.push_back(Pair("data", EncodeHexTx(tx)));
-        entry.push_back(Pair("txid", txHash.GetHex()));
-        entry.push_back(Pair("hash", tx.GetWitnessHash().GetHex()));
-
-        UniValue deps(UniValue::VARR);
-        BOOST_FOREACH (const CTxIn &in, tx.vin)
-        {
-            if (setTxIndex.count(in.prevout.hash))
-                deps.push_back(setTxIndex[in.prevout.hash]);
-        }
-        entry.push_back(Pair("depends", deps));
-
-        int index_in_template = i - 1;
-        entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
-        int64_t nTxSigOps = pblocktemplate->vTxSigOpsCost[index_in_template];
-        if (fPreSegWit) {
-            assert(nTxSigOps % WITNESS_SCALE_FACTOR == 0);
-            nTxSigOps /= WITNESS_SCALE_FACTOR;
-        }
-        entry.push_back(Pair("sigops", nTxSigOps));
-        entry.push_back(Pair("weight", GetTransactionWeight(tx)));
-
-        transactions.push_back(entry);
+    UniValue aCaps(UniValue::VARR); aCaps.push_back("proposal"); aCaps.push_back("delta");
+
+    // Templates built for segwit and non-segwit callers in turn share the tip
+    // and transaction count, so the sequence number tells them apart
+    std::string strLongPollId = chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast) + "-" + i64tostr(nTemplateSeq);
+    if (nTemplateSeqServed != nTemplateSeq) {
+        UpdateGBTTransactions(*pblocktemplate, fPreSegWit);
+        vGBTHistory.push_back(GBTServedTemplate{strLongPollId, fSupportsSegwit, vGBTTxid});
+        if (vGBTHistory.size() > GBT_DELTA_HISTORY)
+            vGBTHistory.pop_front();
+        nTemplateSeqServed = nTemplateSeq;
     }
 
+    UniValue delta;
+    bool fDelta = !strSince.empty() && GetGBTDelta(strSince, fSupportsSegwit, pblock->hashPrevBlock, delta);
+
     UniValue aux(UniValue::VOBJ);
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
@@ -673,10 +794,13 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
     }
 
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
-    result.push_back(Pair("transactions", transactions));
+    if (fDelta)
+        result.push_back(Pair("delta", delta));
+    else
+        result.push_back(Pair("transactions", gbtTransactions));
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0]->vout[0].nValue));
-    result.push_back(Pair("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
+    result.push_back(Pair("longpollid", strLongPollId));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
     result.push_back(Pair("mutable", aMutable));
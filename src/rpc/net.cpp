@@ -102,6 +102,8 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ],\n"
+            "    \"inflight_max\": n,         (numeric) The number of blocks we are willing to have in flight from this peer\n"
+            "    \"blockdeliverytime\": n,    (numeric) Average time in seconds the peer took to deliver a requested block, if known\n"
             "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"					
             "    \"bytessent_per_msg\": {\n"
             "       \"addr\": n,              (numeric) The total bytes sent aggregated by message type\n"
@@ -166,6 +168,9 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("inflight_max", statestats.nMaxBlocksInFlight));
+            if (statestats.nBlockDeliveryTimeAvg)
+                obj.push_back(Pair("blockdeliverytime", ((double)statestats.nBlockDeliveryTimeAvg) / 1e6));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -370,6 +375,121 @@ UniValue getnettotals(const JSONRPCRequest& request)
     return obj;
 }
 
+static UniValue HistogramToJSON(const CLog2Histogram& hist)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("count", hist.nCount));
+    obj.push_back(Pair("total", hist.nSum));
+    obj.push_back(Pair("max", hist.nMax));
+    int nLast = CLog2Histogram::BUCKETS;
+    while (nLast > 0 && hist.vBuckets[nLast - 1] == 0)
+        nLast--;
+    UniValue buckets(UniValue::VARR);
+    for (int i = 0; i < nLast; i++)
+        buckets.push_back(hist.vBuckets[i]);
+    obj.push_back(Pair("buckets", buckets));
+    return obj;
+}
+
+static UniValue MsgStatsToJSON(const mapMsgCmdStats& mapStats, bool fRecv)
+{
+    UniValue obj(UniValue::VOBJ);
+    BOOST_FOREACH(const mapMsgCmdStats::value_type &i, mapStats) {
+        if (i.second.size.nCount == 0)
+            continue;
+        UniValue cmd(UniValue::VOBJ);
+        cmd.push_back(Pair("bytes", HistogramToJSON(i.second.size)));
+        cmd.push_back(Pair("queue_us", HistogramToJSON(i.second.queueTime)));
+        if (fRecv) {
+            cmd.push_back(Pair("process_us", HistogramToJSON(i.second.procTime)));
+            if (fTrackLockWait)
+                cmd.push_back(Pair("lockwait_us", HistogramToJSON(i.second.lockWait)));
+        }
+        obj.push_back(Pair(i.first, cmd));
+    }
+    return obj;
+}
+
+UniValue getnetstats(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 1)
+        throw runtime_error(
+            "getnetstats ( peers )\n"
+            "\nReturns per message type statistics of the messages exchanged with connected peers,\n"
+            "summed over all peers and optionally broken down per peer.\n"
+            "Every statistic is a histogram with power-of-two buckets: bucket 0 counts zero values,\n"
+            "bucket i counts values from 2^(i-1) up to 2^i. Trailing empty buckets are omitted.\n"
+            "\nArguments:\n"
+            "1. peers    (boolean, optional, default=false) Also return the statistics of each peer\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"recv\": {                   (json object) Received messages\n"
+            "    \"msg\": {                  (json object) Per message type; unknown types are summed under \"*other*\"\n"
+            "      \"bytes\": {              (json object) Message size including header\n"
+            "        \"count\": n,           (numeric) Number of messages\n"
+            "        \"total\": n,           (numeric) Sum of all values\n"
+            "        \"max\": n,             (numeric) Largest value\n"
+            "        \"buckets\": [n,...]    (array) Number of values per bucket\n"
+            "      },\n"
+            "      \"queue_us\": {...},      (json object) Microseconds waiting in the receive queue before processing\n"
+            "      \"process_us\": {...},    (json object) Microseconds spent processing the message\n"
+            "      \"lockwait_us\": {...}    (json object) Microseconds of processing spent blocked on contended locks (mostly cs_main), only with -debug=lock\n"
+            "    }, ...\n"
+            "  },\n"
+            "  \"sent\": {                   (json object) Sent messages\n"
+            "    \"msg\": {\n"
+            "      \"bytes\": {...},         (json object) Message size including header\n"
+            "      \"queue_us\": {...}       (json object) Microseconds from queueing until the message was written to the socket\n"
+            "    }, ...\n"
+            "  },\n"
+            "  \"peers\": [                  (json array) Only if peers is true\n"
+            "    {\n"
+            "      \"id\": n,                (numeric) Peer index, as in getpeerinfo\n"
+            "      \"addr\": \"host:port\",    (string) The IP address and port of the peer\n"
+            "      \"recv\": {...},          (json object) As above, for this peer\n"
+            "      \"sent\": {...}           (json object) As above, for this peer\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getnetstats", "")
+            + HelpExampleCli("getnetstats", "true")
+            + HelpExampleRpc("getnetstats", "true")
+        );
+
+    if(!g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    bool fPeers = request.params.size() > 0 && request.params[0].get_bool();
+
+    vector<CNodeMsgStats> vstats;
+    g_connman->GetNodeMsgStats(vstats);
+
+    mapMsgCmdStats mapRecvTotal, mapSendTotal;
+    UniValue peers(UniValue::VARR);
+    BOOST_FOREACH(const CNodeMsgStats& stats, vstats) {
+        BOOST_FOREACH(const mapMsgCmdStats::value_type &i, stats.mapRecv)
+            mapRecvTotal[i.first] += i.second;
+        BOOST_FOREACH(const mapMsgCmdStats::value_type &i, stats.mapSend)
+            mapSendTotal[i.first] += i.second;
+        if (fPeers) {
+            UniValue obj(UniValue::VOBJ);
+            obj.push_back(Pair("id", stats.nodeid));
+            obj.push_back(Pair("addr", stats.addrName));
+            obj.push_back(Pair("recv", MsgStatsToJSON(stats.mapRecv, true)));
+            obj.push_back(Pair("sent", MsgStatsToJSON(stats.mapSend, false)));
+            peers.push_back(obj);
+        }
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("recv", MsgStatsToJSON(mapRecvTotal, true)));
+    ret.push_back(Pair("sent", MsgStatsToJSON(mapSendTotal, false)));
+    if (fPeers)
+        ret.push_back(Pair("peers", peers));
+    return ret;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -612,6 +732,7 @@ static const CRPCCommand commands[] =
     { "network",            "disconnectnode",         &disconnectnode,         true,  {"address"} },
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true,  {"node"} },
     { "network",            "getnettotals",           &getnettotals,           true,  {} },
+    { "network",            "getnetstats",            &getnetstats,            true,  {"peers"} },
     { "network",            "getnetworkinfo",         &getnetworkinfo,         true,  {} },
     { "network",            "setban",                 &setban,                 true,  {"subnet", "command", "bantime", "absolute"} },
     { "network",            "listbanned",             &listbanned,             true,  {} },
@@ -138,6 +138,61 @@ private:
     size_t nPos;
 };
 
+/* Minimal stream for reading from a byte range owned by someone else
+ *
+ * The referenced bytes must outlive the reader and are not modified, so the
+ * unread part of a CDataStream can be deserialized without copying or
+ * consuming it.
+ */
+class CSpanReader
+{
+ public:
+
+/*
+ * @param[in]  nTypeIn Serialization Type
+ * @param[in]  nVersionIn Serialization Version (including any flags)
+ * @param[in]  pbeginIn Start of the referenced bytes
+ * @param[in]  pendIn End of the referenced bytes
+*/
+    CSpanReader(int nTypeIn, int nVersionIn, const char* pbeginIn, const char* pendIn) : nType(nTypeIn), nVersion(nVersionIn), pbegin(pbeginIn), pend(pendIn) {}
+
+    void read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::read(): end of data");
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+    }
+    template<typename T>
+    CSpanReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj);
+        return (*this);
+    }
+    int GetVersion() const
+    {
+        return nVersion;
+    }
+    int GetType() const
+    {
+        return nType;
+    }
+    size_t size() const
+    {
+        return pend - pbegin;
+    }
+    bool empty() const
+    {
+        return pbegin == pend;
+    }
+private:
+    const int nType;
+    const int nVersion;
+    const char* pbegin;
+    const char* pend;
+};
+
 /** Double ended buffer combining vector and stream-like interfaces.
  *
  * >> and << read and write unformatted data using the above serialization templates.
@@ -7,6 +7,7 @@
 #define BITCOIN_SYNC_H
 
 #include "threadsafety.h"
+#include "utiltime.h"
 
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
@@ -108,6 +109,13 @@ typedef boost::condition_variable CConditionVariable;
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/** Whether CMutexLock accounts the time threads spend blocked on contended locks (-debug=lock) */
+extern bool fTrackLockWait;
+/** Account time the calling thread spent blocked acquiring a contended lock */
+void AddThreadLockWait(int64_t nMicros);
+/** Total time in microseconds the calling thread has spent blocked on contended locks */
+int64_t GetThreadLockWaitMicros();
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template <typename Mutex>
 class SCOPED_LOCKABLE CMutexLock
@@ -118,6 +126,17 @@ private:
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
+        if (fTrackLockWait) {
+            if (!lock.try_lock()) {
+#ifdef DEBUG_LOCKCONTENTION
+                PrintLockContention(pszName, pszFile, nLine);
+#endif
+                int64_t nWaitStart = GetTimeMicros();
+                lock.lock();
+                AddThreadLockWait(GetTimeMicros() - nWaitStart);
+            }
+            return;
+        }
 #ifdef DEBUG_LOCKCONTENTION
         if (!lock.try_lock()) {
             PrintLockContention(pszName, pszFile, nLine);
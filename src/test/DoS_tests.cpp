@@ -4,13 +4,18 @@
 
 // Unit tests for denial-of-service detection/prevention code
 
+#include "arith_uint256.h"
 #include "chainparams.h"
+#include "consensus/consensus.h"
+#include "consensus/merkle.h"
 #include "keystore.h"
 #include "net.h"
 #include "net_processing.h"
+#include "netmessagemaker.h"
 #include "pow.h"
 #include "script/sign.h"
 #include "serialize.h"
+#include "txorphanage.h"
 #include "util.h"
 #include "validation.h"
 
@@ -23,17 +28,6 @@
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
-// Tests these internal-to-net_processing.cpp methods:
-extern bool AddOrphanTx(const CTransactionRef& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransactionRef tx;
-    NodeId fromPeer;
-    int64_t nTimeExpire;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-
 CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -43,6 +37,55 @@ CService ip(uint32_t i)
 
 static NodeId id = 0;
 
+/** Queue a message as if it had been received from pnode */
+static void ReceiveMessage(CNode* pnode, CSerializedNetMsg&& msg)
+{
+    CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), msg.data.size());
+    uint256 hash = Hash(msg.data.begin(), msg.data.end());
+    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    std::vector<unsigned char> vHeader;
+    CVectorWriter(SER_NETWORK, INIT_PROTO_VERSION, vHeader, 0, hdr);
+
+    CNetMessage netmsg(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
+    netmsg.readHeader((const char*)vHeader.data(), vHeader.size());
+    netmsg.readData((const char*)msg.data.data(), msg.data.size());
+    LOCK(pnode->cs_vProcessMsg);
+    pnode->vProcessMsg.push_back(netmsg);
+    pnode->nProcessQueueSize += msg.data.size() + CMessageHeader::HEADER_SIZE;
+}
+
+/** Process everything queued from pnode */
+static void ProcessReceivedMessages(CNode* pnode, CConnman& connman)
+{
+    std::atomic<bool> interruptDummy(false);
+    bool fMoreWork;
+    do {
+        // Nothing is ever written to the dummy sockets
+        pnode->fPauseSend = false;
+        fMoreWork = ProcessMessages(pnode, connman, interruptDummy);
+    } while (fMoreWork);
+}
+
+/** Hashes of the transactions read ahead from the messages queued from pnode */
+static std::vector<uint256> ReadAheadTxs(CNode* pnode)
+{
+    std::vector<uint256> vHashes;
+    LOCK(pnode->cs_vProcessMsg);
+    for (const CNetMessage& msg : pnode->vProcessMsg)
+        if (msg.ptxReadAhead)
+            vHashes.push_back(msg.ptxReadAhead->GetHash());
+    return vHashes;
+}
+
+static void InitializeDummyNode(CNode* pnode, CConnman& connman)
+{
+    pnode->SetSendVersion(PROTOCOL_VERSION);
+    pnode->SetRecvVersion(PROTOCOL_VERSION);
+    GetNodeSignals().InitializeNode(pnode, connman);
+    pnode->nVersion = PROTOCOL_VERSION;
+    pnode->fSuccessfullyConnected = true;
+}
+
 BOOST_FIXTURE_TEST_SUITE(DoS_tests, TestingSetup)
 
 BOOST_AUTO_TEST_CASE(DoS_banning)
@@ -126,13 +169,9 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!connman->IsBanned(addr));
 }
 
-CTransactionRef RandomOrphan()
+CTransactionRef RandomOrphan(const std::vector<CTransactionRef>& vOrphans)
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    return vOrphans[GetRand(vOrphans.size())];
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -142,6 +181,10 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     CBasicKeyStore keystore;
     keystore.AddKey(key);
 
+    CTxOrphanage orphanage;
+    std::vector<CTransactionRef> vOrphans;
+    int64_t nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
     {
@@ -154,30 +197,38 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(MakeTransactionRef(tx), i);
+        vOrphans.push_back(MakeTransactionRef(tx));
+        BOOST_CHECK(orphanage.AddTx(vOrphans.back(), i, nTimeExpire));
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransactionRef txPrev = RandomOrphan();
+        CTransactionRef txPrev = RandomOrphan(vOrphans);
 
         CMutableTransaction tx;
         tx.vin.resize(1);
         tx.vin[0].prevout.n = 0;
         tx.vin[0].prevout.hash = txPrev->GetHash();
         tx.vout.resize(1);
-        tx.vout[0].nValue = 1*CENT;
+        tx.vout[0].nValue = (i + 1)*CENT; // distinct even when two share a parent
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, *txPrev, tx, 0, SIGHASH_ALL);
 
-        AddOrphanTx(MakeTransactionRef(tx), i);
+        vOrphans.push_back(MakeTransactionRef(tx));
+        BOOST_CHECK(orphanage.AddTx(vOrphans.back(), i, nTimeExpire + i));
+        BOOST_CHECK(!orphanage.GetChildren(COutPoint(txPrev->GetHash(), 0)).empty());
     }
+    BOOST_CHECK_EQUAL(orphanage.Size(), 100);
+    size_t nUsageFull = orphanage.DynamicMemoryUsage();
+
+    // Adding the same orphan twice fails:
+    BOOST_CHECK(!orphanage.AddTx(vOrphans[0], 0, nTimeExpire));
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransactionRef txPrev = RandomOrphan();
+        CTransactionRef txPrev = RandomOrphan(vOrphans);
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -195,24 +246,233 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(MakeTransactionRef(tx), i));
+        BOOST_CHECK(!orphanage.AddTx(MakeTransactionRef(tx), i, nTimeExpire));
     }
 
-    // Test EraseOrphansFor:
+    // Test EraseForPeer:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        size_t sizeBefore = orphanage.Size();
+        BOOST_CHECK(orphanage.EraseForPeer(i) > 0);
+        BOOST_CHECK(orphanage.Size() < sizeBefore);
+        BOOST_CHECK_EQUAL(orphanage.EraseForPeer(i), 0);
+    }
+
+    // Test EraseForTx: a transaction spending the same outpoint as an orphan evicts it
+    {
+        const CTransactionRef& orphan = vOrphans[10];
+        BOOST_CHECK(orphanage.HaveTx(orphan->GetHash()));
+        CMutableTransaction conflict;
+        conflict.vin.resize(1);
+        conflict.vin[0].prevout = orphan->vin[0].prevout;
+        BOOST_CHECK_EQUAL(orphanage.EraseForTx(conflict), 1);
+        BOOST_CHECK(!orphanage.HaveTx(orphan->GetHash()));
+    }
+
+    // Test EraseExpired: only the orphans added with the earliest expiry go
+    {
+        size_t sizeBefore = orphanage.Size();
+        orphanage.EraseExpired(nTimeExpire);
+        BOOST_CHECK(orphanage.Size() < sizeBefore);
+        for (size_t i = 0; i < 50; i++)
+            BOOST_CHECK(!orphanage.HaveTx(vOrphans[i]->GetHash()));
+    }
+
+    // Test LimitOrphans() function:
+    orphanage.LimitOrphans(40);
+    BOOST_CHECK(orphanage.Size() <= 40);
+    BOOST_CHECK(orphanage.DynamicMemoryUsage() < nUsageFull);
+    orphanage.LimitOrphans(10);
+    BOOST_CHECK(orphanage.Size() <= 10);
+    orphanage.LimitOrphans(0);
+    BOOST_CHECK_EQUAL(orphanage.Size(), 0);
+}
+
+struct RegtestingSetup : public TestingSetup {
+    RegtestingSetup() : TestingSetup(CBaseChainParams::REGTEST) {}
+};
+
+static CNodeStateStats GetStats(NodeId nodeid)
+{
+    CNodeStateStats stats;
+    BOOST_CHECK(GetNodeStateStats(nodeid, stats));
+    return stats;
+}
+
+/** Blocks extending the active chain that have not been processed yet */
+static std::vector<std::shared_ptr<const CBlock> > CreateUnprocessedBlocks(int nBlocks, const CScript& scriptPubKey = CScript())
+{
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    std::vector<std::shared_ptr<const CBlock> > vBlocks;
+    uint256 hashPrev = pindexTip->GetBlockHash();
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    for (int i = 1; i <= nBlocks; i++) {
+        const int nHeight = pindexTip->nHeight + i;
+        CMutableTransaction coinbase;
+        coinbase.vin.resize(1);
+        coinbase.vin[0].scriptSig = CScript() << nHeight << OP_0;
+        coinbase.vout.resize(1);
+        coinbase.vout[0].scriptPubKey = scriptPubKey;
+        coinbase.vout[0].nValue = scriptPubKey.empty() ? 0 : GetBlockSubsidy(nHeight, consensusParams);
+
+        std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+        pblock->nVersion = 4;
+        pblock->hashPrevBlock = hashPrev;
+        // Spaced widely enough to keep the difficulty at the minimum
+        pblock->nTime = pindexTip->nTime + i * 2 * consensusParams.nPowTargetSpacing;
+        pblock->nBits = UintToArith256(consensusParams.powLimit).GetCompact();
+        pblock->vtx.push_back(MakeTransactionRef(std::move(coinbase)));
+        pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
+        while (!CheckProofOfWork(pblock->GetPoWHash(nHeight >= Params().SwitchLyra2REv2_DGWblock()), pblock->nBits, consensusParams))
+            ++pblock->nNonce;
+        hashPrev = pblock->GetHash();
+        vBlocks.push_back(pblock);
+    }
+    return vBlocks;
+}
+
+BOOST_FIXTURE_TEST_CASE(block_download_peer_speed, RegtestingSetup)
+{
+    std::atomic<bool> interruptDummy(false);
+    const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+
+    // One block more than the download window, so that it can fill up
+    std::vector<std::shared_ptr<const CBlock> > vBlocks = CreateUnprocessedBlocks(BLOCK_DOWNLOAD_WINDOW + 2);
+    std::vector<CBlock> vHeaders;
+    for (const auto& pblock : vBlocks)
+        vHeaders.push_back(pblock->GetBlockHeader());
+
+    CAddress addr1(ip(0xa0b0c001), NODE_NONE);
+    CNode slowNode(id++, NODE_NETWORK, 0, INVALID_SOCKET, addr1, 5, 5, "", true);
+    CAddress addr2(ip(0xa0b0c002), NODE_NONE);
+    CNode fastNode(id++, NODE_NETWORK, 0, INVALID_SOCKET, addr2, 6, 6, "", true);
+    for (CNode* pnode : {&slowNode, &fastNode}) {
+        InitializeDummyNode(pnode, *connman);
+        ReceiveMessage(pnode, msgMaker.Make(NetMsgType::HEADERS, vHeaders));
+        ProcessReceivedMessages(pnode, *connman);
+    }
+
+    // Until a peer has delivered a block it gets the default number in flight
+    SendMessages(&slowNode, *connman, interruptDummy);
+    CNodeStateStats stats = GetStats(slowNode.GetId());
+    BOOST_CHECK_EQUAL(stats.nMaxBlocksInFlight, MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(stats.vHeightInFlight.size(), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(stats.vHeightInFlight.front(), 1);
+
+    // A peer taking half a second per block gets fewer
+    MilliSleep(500);
+    ReceiveMessage(&slowNode, msgMaker.Make(NetMsgType::BLOCK, *vBlocks[0]));
+    ProcessReceivedMessages(&slowNode, *connman);
+    BOOST_CHECK_EQUAL(chainActive.Height(), 1);
+    const int64_t nSlowDownloadStart = GetTimeMicros();
+    stats = GetStats(slowNode.GetId());
+    const int64_t nSlowDeliveryTime = stats.nBlockDeliveryTimeAvg;
+    BOOST_CHECK(nSlowDeliveryTime >= 500000);
+    BOOST_CHECK_EQUAL(stats.nMaxBlocksInFlight, std::max<int64_t>(MIN_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER, BLOCK_DOWNLOAD_TARGET_BACKLOG / nSlowDeliveryTime));
+    BOOST_CHECK(stats.nMaxBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A peer delivering its blocks straight away gets more
+    SendMessages(&fastNode, *connman, interruptDummy);
+    stats = GetStats(fastNode.GetId());
+    BOOST_CHECK_EQUAL(stats.vHeightInFlight.size(), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(stats.vHeightInFlight.front(), MAX_BLOCKS_IN_TRANSIT_PER_PEER + 1);
+    for (int nHeight : stats.vHeightInFlight) {
+        ReceiveMessage(&fastNode, msgMaker.Make(NetMsgType::BLOCK, *vBlocks[nHeight - 1]));
+        ProcessReceivedMessages(&fastNode, *connman);
     }
+    stats = GetStats(fastNode.GetId());
+    BOOST_CHECK(stats.vHeightInFlight.empty());
+    BOOST_CHECK(stats.nBlockDeliveryTimeAvg > 0);
+    BOOST_CHECK(stats.nMaxBlocksInFlight > MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // The rest of the window arrives from elsewhere, so that only the slow
+    // peer's blocks hold it up. The idle fast peer takes over the first of
+    // them instead of waiting for the slow one to stall out.
+    for (unsigned int nHeight = 2 * MAX_BLOCKS_IN_TRANSIT_PER_PEER + 1; nHeight <= BLOCK_DOWNLOAD_WINDOW + 1; nHeight++)
+        BOOST_CHECK(ProcessNewBlock(Params(), vBlocks[nHeight - 1], true, NULL));
+    SendMessages(&fastNode, *connman, interruptDummy);
+    stats = GetStats(fastNode.GetId());
+    BOOST_CHECK(stats.vHeightInFlight == std::vector<int>(1, 2));
+    stats = GetStats(slowNode.GetId());
+    BOOST_CHECK_EQUAL(stats.vHeightInFlight.size(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - 2);
+    BOOST_CHECK_EQUAL(stats.vHeightInFlight.front(), 3);
+
+    // Losing the block did not restart the slow peer's download timer, so
+    // its next block counts as delivered since it received the first one
+    const int64_t nSlowDownloadTime = GetTimeMicros() - nSlowDownloadStart;
+    ReceiveMessage(&slowNode, msgMaker.Make(NetMsgType::BLOCK, *vBlocks[2]));
+    ProcessReceivedMessages(&slowNode, *connman);
+    stats = GetStats(slowNode.GetId());
+    BOOST_CHECK(stats.nBlockDeliveryTimeAvg >= (nSlowDeliveryTime * 7 + nSlowDownloadTime) / 8);
+
+    bool fUpdateConnectionTime = false;
+    GetNodeSignals().FinalizeNode(slowNode.GetId(), fUpdateConnectionTime);
+    GetNodeSignals().FinalizeNode(fastNode.GetId(), fUpdateConnectionTime);
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_msgs_warm_batch, RegtestingSetup)
+{
+    std::atomic<bool> interruptDummy(false);
+    const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+    // Sets up the recent rejects filter tx messages are checked against
+    PeerLogicValidation peerLogic(connman);
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    std::vector<std::shared_ptr<const CBlock> > vBlocks = CreateUnprocessedBlocks(COINBASE_MATURITY + 2, scriptPubKey);
+    for (const auto& pblock : vBlocks)
+        BOOST_CHECK(ProcessNewBlock(Params(), pblock, true, NULL));
+
+    // Two chains of three transactions, each starting at a mature coinbase
+    std::vector<CTransactionRef> vChains[2];
+    for (int nChain = 0; nChain < 2; nChain++) {
+        CTransactionRef ptxPrev = vBlocks[nChain]->vtx[0];
+        for (int i = 0; i < 3; i++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(ptxPrev->GetHash(), 0);
+            tx.vout.resize(1);
+            tx.vout[0].scriptPubKey = scriptPubKey;
+            tx.vout[0].nValue = ptxPrev->vout[0].nValue - CENT;
+            BOOST_CHECK(SignSignature(keystore, *ptxPrev, tx, 0, SIGHASH_ALL));
+            ptxPrev = MakeTransactionRef(std::move(tx));
+            vChains[nChain].push_back(ptxPrev);
+        }
+    }
+
+    CAddress addr(ip(0xa0b0c003), NODE_NONE);
+    CNode dummyNode(id++, NODE_NETWORK, 0, INVALID_SOCKET, addr, 7, 7, "", true);
+    InitializeDummyNode(&dummyNode, *connman);
+
+    // The first tx message reads ahead the ones queued behind it
+    for (const CTransactionRef& ptx : vChains[0])
+        ReceiveMessage(&dummyNode, msgMaker.Make(NetMsgType::TX, *ptx));
+    ProcessMessages(&dummyNode, *connman, interruptDummy);
+    BOOST_CHECK(mempool.exists(vChains[0][0]->GetHash()));
+    BOOST_CHECK(ReadAheadTxs(&dummyNode) == std::vector<uint256>({vChains[0][1]->GetHash(), vChains[0][2]->GetHash()}));
+
+    // Messages that were read ahead can be dropped without affecting the
+    // next ones
+    {
+        LOCK(dummyNode.cs_vProcessMsg);
+        dummyNode.vProcessMsg.clear();
+        dummyNode.nProcessQueueSize = 0;
+    }
+    for (const CTransactionRef& ptx : vChains[1])
+        ReceiveMessage(&dummyNode, msgMaker.Make(NetMsgType::TX, *ptx));
+    ProcessMessages(&dummyNode, *connman, interruptDummy);
+    BOOST_CHECK(ReadAheadTxs(&dummyNode) == std::vector<uint256>({vChains[1][1]->GetHash(), vChains[1][2]->GetHash()}));
+
+    ProcessReceivedMessages(&dummyNode, *connman);
+    for (const CTransactionRef& ptx : vChains[1])
+        BOOST_CHECK(mempool.exists(ptx->GetHash()));
+    BOOST_CHECK(!mempool.exists(vChains[0][1]->GetHash()));
+
+    bool fUpdateConnectionTime = false;
+    GetNodeSignals().FinalizeNode(dummyNode.GetId(), fUpdateConnectionTime);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
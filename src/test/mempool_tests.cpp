@@ -2,12 +2,19 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "consensus/validation.h"
+#include "crypto/common.h"
+#include "keystore.h"
 #include "policy/policy.h"
+#include "script/sign.h"
 #include "txmempool.h"
 #include "util.h"
+#include "validation.h"
 
 #include "test/test_bitcoin.h"
+#include "test/test_random.h"
 
+#include <boost/filesystem/fstream.hpp>
 #include <boost/test/unit_test.hpp>
 #include <list>
 #include <vector>
@@ -430,6 +437,253 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
 }
 
 
+BOOST_AUTO_TEST_CASE(MempoolInfoForRelayTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    /* high fee, no ancestors */
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(20000LL).FromTx(tx1));
+
+    /* lower fee parent */
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 5 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(10000LL).FromTx(tx2));
+
+    /* highest fee, but child of tx2 */
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx3.vin[0].scriptSig = CScript() << OP_11;
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx3.vout[0].nValue = 4 * COIN;
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(50000LL).FromTx(tx3));
+
+    /* zero fee, dropped by the fee filter */
+    CMutableTransaction tx4 = CMutableTransaction();
+    tx4.vout.resize(1);
+    tx4.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx4.vout[0].nValue = 1 * COIN;
+    pool.addUnchecked(tx4.GetHash(), entry.Fee(0LL).FromTx(tx4));
+
+    std::vector<uint256> vHashes;
+    vHashes.push_back(tx3.GetHash());
+    vHashes.push_back(tx4.GetHash());
+    vHashes.push_back(uint256()); // not in the mempool
+    vHashes.push_back(tx2.GetHash());
+    vHashes.push_back(tx1.GetHash());
+
+    std::vector<TxMempoolInfo> vInfo = pool.infoForRelay(vHashes, 1, vHashes.size());
+    BOOST_CHECK_EQUAL(vInfo.size(), 3);
+    BOOST_CHECK(vInfo[0].tx->GetHash() == tx1.GetHash());
+    BOOST_CHECK(vInfo[1].tx->GetHash() == tx2.GetHash());
+    BOOST_CHECK(vInfo[2].tx->GetHash() == tx3.GetHash());
+
+    // Only the head is ordered, but nothing is lost
+    vInfo = pool.infoForRelay(vHashes, 0, 1);
+    BOOST_CHECK_EQUAL(vInfo.size(), 4);
+    BOOST_CHECK(vInfo[0].tx->GetHash() == tx1.GetHash());
+}
+
+
+BOOST_AUTO_TEST_CASE(MempoolUpdateFromBlockTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // A diamond hanging off tx1: tx1 -> tx2, tx3 -> tx4
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        tx1.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx1.vout[i].nValue = 10 * COIN;
+    }
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 9 * COIN;
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx1.GetHash(), 1);
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx3.vout[0].nValue = 8 * COIN;
+    CMutableTransaction tx4 = CMutableTransaction();
+    tx4.vin.resize(2);
+    tx4.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx4.vin[1].prevout = COutPoint(tx3.GetHash(), 0);
+    tx4.vout.resize(1);
+    tx4.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx4.vout[0].nValue = 16 * COIN;
+
+    // tx1 and tx2 come back from a disconnected block after their descendants
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(1000LL).FromTx(tx3));
+    pool.addUnchecked(tx4.GetHash(), entry.Fee(1000LL).FromTx(tx4));
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(1000LL).FromTx(tx1));
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(1000LL).FromTx(tx2));
+
+    std::vector<uint256> vHashesToUpdate;
+    vHashesToUpdate.push_back(tx1.GetHash());
+    vHashesToUpdate.push_back(tx2.GetHash());
+    pool.UpdateTransactionsFromBlock(vHashesToUpdate);
+
+    CTxMemPool::txiter it1 = pool.mapTx.find(tx1.GetHash());
+    CTxMemPool::txiter it4 = pool.mapTx.find(tx4.GetHash());
+    BOOST_CHECK_EQUAL(it1->GetCountWithDescendants(), 4);
+    BOOST_CHECK_EQUAL(it1->GetModFeesWithDescendants(), 4000);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx2.GetHash())->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx3.GetHash())->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(it4->GetCountWithAncestors(), 4);
+    BOOST_CHECK_EQUAL(it4->GetModFeesWithAncestors(), 4000);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(it1).size(), 2);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(it4).size(), 2);
+
+    // Confirming tx1 again leaves consistent links behind
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(tx1));
+    pool.removeForBlock(vtx, 1);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx2.GetHash())->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it4->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(pool.mapTx.find(tx3.GetHash())).size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSnapshotTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(1000LL).FromTx(tx1));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 9 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(5000LL).FromTx(tx2));
+
+    CTxMemPoolSnapshotRef snapshot = pool.GetSnapshot();
+    BOOST_CHECK_EQUAL(snapshot->vEntries.size(), 2);
+    BOOST_CHECK(snapshot->vEntries[0].GetTx().GetHash() == tx1.GetHash());
+    BOOST_CHECK(snapshot->vEntries[1].GetTx().GetHash() == tx2.GetHash());
+    BOOST_CHECK(snapshot->vParents[0].empty());
+    BOOST_CHECK_EQUAL(snapshot->vParents[1].size(), 1);
+    BOOST_CHECK(snapshot->vParents[1][0] == tx1.GetHash());
+    BOOST_CHECK_EQUAL(snapshot->vEntries[0].GetCountWithDescendants(), 2);
+
+    // Shared while nothing changes
+    BOOST_CHECK(pool.GetSnapshot() == snapshot);
+
+    // Fee deltas are picked up
+    pool.PrioritiseTransaction(tx2.GetHash(), tx2.GetHash().ToString(), 0, 2000);
+    CTxMemPoolSnapshotRef snapshotPrioritised = pool.GetSnapshot();
+    BOOST_CHECK(snapshotPrioritised != snapshot);
+    BOOST_CHECK_EQUAL(snapshotPrioritised->vEntries[1].GetModifiedFee(), 7000);
+    BOOST_CHECK(pool.GetSnapshot() == snapshotPrioritised);
+
+    // Sorted by depth, then by score
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx3.vout[0].nValue = 11 * COIN;
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(20000LL).FromTx(tx3));
+    CTxMemPoolSnapshotRef snapshotSorted = pool.GetSnapshot();
+    BOOST_CHECK_EQUAL(snapshotSorted->vEntries.size(), 3);
+    BOOST_CHECK(snapshotSorted->vEntries[0].GetTx().GetHash() == tx3.GetHash());
+    BOOST_CHECK(snapshotSorted->vEntries[1].GetTx().GetHash() == tx1.GetHash());
+    BOOST_CHECK(snapshotSorted->vEntries[2].GetTx().GetHash() == tx2.GetHash());
+    BOOST_CHECK(snapshotSorted->vParents[0].empty());
+    BOOST_CHECK_EQUAL(snapshotSorted->vParents[2].size(), 1);
+    pool.removeRecursive(tx3);
+
+    // Earlier snapshots are unaffected by later removals
+    pool.removeRecursive(tx1);
+    BOOST_CHECK_EQUAL(pool.GetSnapshot()->vEntries.size(), 0);
+    BOOST_CHECK_EQUAL(snapshot->vEntries.size(), 2);
+    BOOST_CHECK_EQUAL(snapshot->vEntries[1].GetModifiedFee(), 5000);
+}
+
+static const CFeeHistogramBucket& HistogramBucketFor(const std::vector<CFeeHistogramBucket>& vBuckets, const CFeeRate& feeRate)
+{
+    size_t i = 0;
+    while (i + 1 < vBuckets.size() && vBuckets[i + 1].feeRate <= feeRate)
+        i++;
+    return vBuckets[i];
+}
+
+BOOST_AUTO_TEST_CASE(MempoolFeeHistogramTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    std::vector<CFeeHistogramBucket> vBuckets = pool.GetFeeHistogram();
+    BOOST_CHECK(vBuckets.size() > 2);
+    BOOST_CHECK(vBuckets[0].feeRate == CFeeRate(0));
+    BOOST_CHECK(vBuckets[1].feeRate == CFeeRate(FEE_HISTOGRAM_MIN_FEERATE));
+    for (const CFeeHistogramBucket& bucket : vBuckets)
+        BOOST_CHECK_EQUAL(bucket.nCount, 0);
+
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    // A negative fee delta applied before the transaction arrives puts it in the lowest bucket
+    pool.PrioritiseTransaction(tx1.GetHash(), tx1.GetHash().ToString(), 0, -2000);
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(1000LL).FromTx(tx1));
+    const size_t nSize1 = GetVirtualTransactionSize(tx1);
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 9 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(5000LL).FromTx(tx2));
+    const size_t nSize2 = GetVirtualTransactionSize(tx2);
+
+    vBuckets = pool.GetFeeHistogram();
+    BOOST_CHECK_EQUAL(vBuckets[0].nCount, 1);
+    BOOST_CHECK_EQUAL(vBuckets[0].nSize, nSize1);
+    BOOST_CHECK_EQUAL(vBuckets[0].nFees, -1000);
+    const CFeeHistogramBucket& bucket2 = HistogramBucketFor(vBuckets, CFeeRate(5000, nSize2));
+    BOOST_CHECK(bucket2.feeRate > CFeeRate(0));
+    BOOST_CHECK_EQUAL(bucket2.nCount, 1);
+    BOOST_CHECK_EQUAL(bucket2.nSize, nSize2);
+    BOOST_CHECK_EQUAL(bucket2.nFees, 5000);
+
+    // Prioritising moves the transaction between buckets
+    pool.PrioritiseTransaction(tx2.GetHash(), tx2.GetHash().ToString(), 0, 1000000);
+    vBuckets = pool.GetFeeHistogram();
+    BOOST_CHECK_EQUAL(HistogramBucketFor(vBuckets, CFeeRate(5000, nSize2)).nCount, 0);
+    const CFeeHistogramBucket& bucket2Prioritised = HistogramBucketFor(vBuckets, CFeeRate(1005000, nSize2));
+    BOOST_CHECK_EQUAL(bucket2Prioritised.nCount, 1);
+    BOOST_CHECK_EQUAL(bucket2Prioritised.nFees, 1005000);
+    // Anything above the maximum lands in the last bucket
+    BOOST_CHECK(&bucket2Prioritised == &vBuckets.back());
+
+    pool.removeRecursive(tx1);
+    vBuckets = pool.GetFeeHistogram();
+    for (const CFeeHistogramBucket& bucket : vBuckets) {
+        BOOST_CHECK_EQUAL(bucket.nCount, 0);
+        BOOST_CHECK_EQUAL(bucket.nSize, 0);
+        BOOST_CHECK_EQUAL(bucket.nFees, 0);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
 {
     CTxMemPool pool(CFeeRate(1000));
@@ -467,7 +721,7 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     tx3.vin[0].scriptSig = CScript() << OP_2;
     tx3.vout.resize(1);
     tx3.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
-    tx3.vout[0].nValue = 10 * COIN;
+    tx3.vout[0].nValue = 11 * COIN;
     pool.addUnchecked(tx3.GetHash(), entry.Fee(20000LL).FromTx(tx3, &pool));
 
     pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4); // tx3 should pay for tx2 (CPFP)
@@ -584,4 +838,212 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolTrimBatchTest)
+{
+    // Trimming in one call, which evicts packages in batches, must leave the
+    // same transactions as trimming one package at a time.
+    CTxMemPool poolGraph(CFeeRate(1000));
+    TestMemPoolEntryHelper entry;
+
+    std::vector<CTransaction> vtx;
+    std::vector<CAmount> vFee;
+    for (int i = 0; i < 400; i++) {
+        CMutableTransaction tx;
+        int nInputs = 1 + insecure_rand() % 2;
+        tx.vin.resize(nInputs);
+        for (int j = 0; j < nInputs; j++) {
+            // Spend an output of an earlier transaction, or one from outside the mempool
+            if (!vtx.empty() && insecure_rand() % 3) {
+                tx.vin[j].prevout = COutPoint(vtx[insecure_rand() % vtx.size()].GetHash(), insecure_rand() % 2);
+            } else {
+                tx.vin[j].prevout = COutPoint(GetRandHash(), 0);
+            }
+        }
+        if (nInputs == 2 && tx.vin[0].prevout == tx.vin[1].prevout)
+            tx.vin.resize(1);
+        tx.vout.resize(2);
+        tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[0].nValue = COIN;
+        tx.vout[1].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+        tx.vout[1].nValue = COIN;
+        // Skip transactions double spending an earlier one
+        bool fConflict = false;
+        for (const CTxIn& txin : tx.vin)
+            fConflict |= poolGraph.mapNextTx.count(txin.prevout) != 0;
+        if (fConflict)
+            continue;
+        vFee.push_back(1000 + insecure_rand() % 20000);
+        poolGraph.addUnchecked(tx.GetHash(), entry.Fee(vFee.back()).FromTx(tx, &poolGraph));
+        vtx.push_back(tx);
+    }
+
+    // Limits falling at many different points within a batch, including
+    // right after packages whose parents stay behind.
+    const size_t nFullUsage = poolGraph.DynamicMemoryUsage();
+    for (int nStep = 1; nStep < 40; nStep++) {
+        CTxMemPool pool(CFeeRate(1000));
+        CTxMemPool poolOneByOne(CFeeRate(1000));
+        for (size_t i = 0; i < vtx.size(); i++) {
+            pool.addUnchecked(vtx[i].GetHash(), entry.Fee(vFee[i]).FromTx(vtx[i], &pool));
+            poolOneByOne.addUnchecked(vtx[i].GetHash(), entry.Fee(vFee[i]).FromTx(vtx[i], &poolOneByOne));
+        }
+
+        size_t nLimit = nFullUsage - nFullUsage * nStep / 40 + insecure_rand() % 1000;
+        pool.TrimToSize(nLimit);
+        while (poolOneByOne.DynamicMemoryUsage() > nLimit)
+            poolOneByOne.TrimToSize(poolOneByOne.DynamicMemoryUsage() - 1);
+
+        BOOST_CHECK(pool.size() > 0);
+        BOOST_CHECK_EQUAL(pool.size(), poolOneByOne.size());
+        for (const CTransaction& tx : vtx)
+            BOOST_CHECK_EQUAL(pool.exists(tx.GetHash()), poolOneByOne.exists(tx.GetHash()));
+        BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), poolOneByOne.GetMinFee(1).GetFeePerK());
+    }
+}
+
+/** Signed transactions for the mempool.dat tests: a chain of three, then two on their own */
+static std::vector<CTransactionRef> CreateDumpTestTransactions()
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    // Outputs of a transaction that only exists in the UTXO set
+    CMutableTransaction mtxFunding;
+    mtxFunding.vin.resize(1);
+    mtxFunding.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtxFunding.vout.resize(3, CTxOut(10 * COIN, scriptPubKey));
+    const CTransaction txFunding(mtxFunding);
+    {
+        LOCK(cs_main);
+        pcoinsTip->ModifyCoins(txFunding.GetHash())->FromTx(txFunding, chainActive.Height());
+    }
+
+    std::vector<CTransactionRef> vtx;
+    for (int i = 0; i < 5; i++) {
+        const CTransaction& txFrom = i == 1 || i == 2 ? *vtx.back() : txFunding;
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(txFrom.GetHash(), i < 3 ? 0 : i - 2);
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = scriptPubKey;
+        tx.vout[0].nValue = txFrom.vout[tx.vin[0].prevout.n].nValue - CENT;
+        BOOST_CHECK(SignSignature(keystore, txFrom, tx, 0, SIGHASH_ALL));
+        vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+    for (const CTransactionRef& ptx : vtx) {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, ptx, false, NULL));
+    }
+    return vtx;
+}
+
+static std::vector<char> ReadMempoolFile()
+{
+    boost::filesystem::ifstream file(GetDataDir() / "mempool.dat", std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static void WriteMempoolFile(const std::vector<char>& vData)
+{
+    boost::filesystem::ofstream file(GetDataDir() / "mempool.dat", std::ios::binary | std::ios::trunc);
+    file.write(vData.data(), vData.size());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolDumpLoadTest)
+{
+    std::vector<CTransactionRef> vtx = CreateDumpTestTransactions();
+    BOOST_CHECK_EQUAL(mempool.size(), vtx.size());
+    double dPriorityDummy = 0;
+    const uint256 hashAbsent = GetRandHash();
+    mempool.PrioritiseTransaction(vtx[1]->GetHash(), vtx[1]->GetHash().ToString(), dPriorityDummy, 3 * CENT);
+    mempool.PrioritiseTransaction(hashAbsent, hashAbsent.ToString(), dPriorityDummy, 5 * CENT);
+    std::vector<int64_t> vTime;
+    for (const CTransactionRef& ptx : vtx)
+        vTime.push_back(mempool.mapTx.find(ptx->GetHash())->GetTime());
+
+    DumpMempool();
+    mempool.clear();
+    mempool.ClearPrioritisation(vtx[1]->GetHash());
+    mempool.ClearPrioritisation(hashAbsent);
+    BOOST_CHECK(LoadMempool());
+
+    LOCK(mempool.cs);
+    BOOST_CHECK_EQUAL(mempool.size(), vtx.size());
+    for (size_t i = 0; i < vtx.size(); i++) {
+        auto it = mempool.mapTx.find(vtx[i]->GetHash());
+        BOOST_REQUIRE(it != mempool.mapTx.end());
+        BOOST_CHECK_EQUAL(it->GetTime(), vTime[i]);
+        BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), i < 3 ? i + 1 : 1);
+        BOOST_CHECK_EQUAL(it->GetModifiedFee(), it->GetFee() + (i == 1 ? 3 * CENT : 0));
+    }
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    mempool.ApplyDeltas(hashAbsent, dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(nFeeDelta, 5 * CENT);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolLoadCorruptTest)
+{
+    std::vector<CTransactionRef> vtx = CreateDumpTestTransactions();
+    DumpMempool();
+    mempool.clear();
+
+    // Break the checksum of the first transaction of the chain, and one byte
+    // of the transaction data of the fourth
+    std::vector<char> vData = ReadMempoolFile();
+    BOOST_REQUIRE(vData.size() > 16);
+    size_t nPos = 16;
+    for (size_t i = 0; i < vtx.size(); i++) {
+        BOOST_REQUIRE(nPos + 4 <= vData.size());
+        const size_t nPayloadSize = ReadLE32((const unsigned char*)&vData[nPos]);
+        const char* pTxid = &vData[nPos + 4];
+        if (memcmp(pTxid, vtx[0]->GetHash().begin(), 32) == 0)
+            vData[nPos + 4 + nPayloadSize] ^= 1;
+        if (memcmp(pTxid, vtx[3]->GetHash().begin(), 32) == 0)
+            vData[nPos + 4 + nPayloadSize - 1] ^= 1;
+        nPos += 4 + nPayloadSize + 8;
+    }
+    WriteMempoolFile(vData);
+
+    // Only those records are rejected, and the children of the first
+    // have nothing to spend
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 1);
+    BOOST_CHECK(mempool.exists(vtx[4]->GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolLoadV1Test)
+{
+    std::vector<CTransactionRef> vtx = CreateDumpTestTransactions();
+    const uint256 hashAbsent = GetRandHash();
+    std::map<uint256, CAmount> mapDeltas;
+    mapDeltas[hashAbsent] = 5 * CENT;
+
+    // Files written before the checksummed format are still loaded
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << (uint64_t)1 << (uint64_t)vtx.size();
+    for (size_t i = 0; i < vtx.size(); i++)
+        ss << vtx[i] << GetTime() << (int64_t)(i == 1 ? 3 * CENT : 0);
+    ss << mapDeltas;
+    mempool.clear();
+    WriteMempoolFile(std::vector<char>(ss.begin(), ss.end()));
+
+    BOOST_CHECK(LoadMempool());
+    LOCK(mempool.cs);
+    BOOST_CHECK_EQUAL(mempool.size(), vtx.size());
+    for (size_t i = 0; i < vtx.size(); i++) {
+        auto it = mempool.mapTx.find(vtx[i]->GetHash());
+        BOOST_REQUIRE(it != mempool.mapTx.end());
+        BOOST_CHECK_EQUAL(it->GetModifiedFee(), it->GetFee() + (i == 1 ? 3 * CENT : 0));
+    }
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    mempool.ApplyDeltas(hashAbsent, dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(nFeeDelta, 5 * CENT);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -493,4 +493,92 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+
+BOOST_AUTO_TEST_CASE(IncrementalBlockAssembler_updates)
+{
+    const CChainParams& chainparams = Params(CBaseChainParams::MAIN);
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    TestMemPoolEntryHelper entry;
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+
+    LOCK(cs_main);
+    fCheckpointsEnabled = false;
+    mempool.clear();
+
+    // Outputs of a transaction that only exists in the UTXO set, so that
+    // the templates pass TestBlockValidity
+    CMutableTransaction mtxFunding;
+    mtxFunding.vin.resize(1);
+    mtxFunding.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtxFunding.vout.resize(2, CTxOut(10 * COIN, scriptPubKey));
+    const CTransaction txFunding(mtxFunding);
+    pcoinsTip->ModifyCoins(txFunding.GetHash())->FromTx(txFunding, chainActive.Height());
+
+    IncrementalBlockAssembler assembler(chainparams);
+    BOOST_CHECK(pblocktemplate = assembler.GetBlockTemplate(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+    CAmount nSubsidy = pblocktemplate->block.vtx[0]->GetValueOut();
+
+    // A parent and its child arrive in the mempool and are appended as they come
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txFunding.GetHash(), 0);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    tx.vout[0].nValue = 10 * COIN - 10000;
+    uint256 hashParent = tx.GetHash();
+    mempool.addUnchecked(hashParent, entry.Fee(10000).Time(GetTime()).SpendsCoinbase(false).FromTx(tx));
+
+    BOOST_CHECK(pblocktemplate = assembler.GetBlockTemplate(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == hashParent);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0]->GetValueOut(), nSubsidy + 10000);
+
+    tx.vin[0].prevout = COutPoint(hashParent, 0);
+    tx.vout[0].nValue -= 20000;
+    uint256 hashChild = tx.GetHash();
+    mempool.addUnchecked(hashChild, entry.Fee(20000).FromTx(tx));
+
+    BOOST_CHECK(pblocktemplate = assembler.GetBlockTemplate(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[2]->GetHash() == hashChild);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0]->GetValueOut(), nSubsidy + 30000);
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -30000);
+
+    // Below the minimum block feerate nothing is added
+    tx.vin[0].prevout = COutPoint(txFunding.GetHash(), 1);
+    tx.vout[0].nValue = 10 * COIN;
+    uint256 hashFree = tx.GetHash();
+    mempool.addUnchecked(hashFree, entry.Fee(0).FromTx(tx));
+    BOOST_CHECK(pblocktemplate = assembler.GetBlockTemplate(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+
+    // Removing the parent takes the child along with it
+    mempool.removeRecursive(CTransaction(*pblocktemplate->block.vtx[1]));
+    BOOST_CHECK(pblocktemplate = assembler.GetBlockTemplate(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0]->GetValueOut(), nSubsidy);
+
+    // Fee deltas reach the template, whoever sets them
+    double dPriorityDummy = 0;
+    mempool.PrioritiseTransaction(hashFree, hashFree.ToString(), dPriorityDummy, 10000);
+    BOOST_CHECK(pblocktemplate = assembler.GetBlockTemplate(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == hashFree);
+    mempool.ClearPrioritisation(hashFree);
+
+    // An invalid template is never served
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout[0].nValue = 1 * COIN;
+    mempool.addUnchecked(tx.GetHash(), entry.Fee(50000).FromTx(tx));
+    BOOST_CHECK_THROW(assembler.GetBlockTemplate(scriptPubKey), std::runtime_error);
+    mempool.removeRecursive(tx);
+    BOOST_CHECK(pblocktemplate = assembler.GetBlockTemplate(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+
+    mempool.clear();
+    fCheckpointsEnabled = true;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
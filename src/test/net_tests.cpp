@@ -172,4 +172,31 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+BOOST_AUTO_TEST_CASE(log2_histogram)
+{
+    CLog2Histogram hist;
+    hist.Add(0);
+    hist.Add(1);
+    hist.Add(2);
+    hist.Add(3);
+    hist.Add(1000);
+    hist.Add(std::numeric_limits<uint64_t>::max() >> 1);
+    BOOST_CHECK_EQUAL(hist.nCount, 6);
+    BOOST_CHECK_EQUAL(hist.nMax, std::numeric_limits<uint64_t>::max() >> 1);
+    BOOST_CHECK_EQUAL(hist.vBuckets[0], 1);
+    BOOST_CHECK_EQUAL(hist.vBuckets[1], 1);
+    BOOST_CHECK_EQUAL(hist.vBuckets[2], 2);
+    BOOST_CHECK_EQUAL(hist.vBuckets[10], 1);
+    // values beyond the last bucket are clamped into it
+    BOOST_CHECK_EQUAL(hist.vBuckets[CLog2Histogram::BUCKETS - 1], 1);
+
+    CLog2Histogram sum;
+    sum.Add(5);
+    sum += hist;
+    BOOST_CHECK_EQUAL(sum.nCount, 7);
+    BOOST_CHECK_EQUAL(sum.nSum, hist.nSum + 5);
+    BOOST_CHECK_EQUAL(sum.vBuckets[3], 1);
+    BOOST_CHECK_EQUAL(sum.nMax, hist.nMax);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
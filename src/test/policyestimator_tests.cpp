@@ -4,6 +4,7 @@
 
 #include "policy/policy.h"
 #include "policy/fees.h"
+#include "scheduler.h"
 #include "txmempool.h"
 #include "uint256.h"
 #include "util.h"
@@ -11,6 +12,7 @@
 #include "test/test_bitcoin.h"
 
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(policyestimator_tests, BasicTestingSetup)
 
@@ -197,4 +199,56 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
 }
 
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimatesBackground)
+{
+    // Events processed on a scheduler thread give the same estimates as
+    // events processed as they are reported.
+    CTxMemPool mpool(CFeeRate(1000));
+    CTxMemPool mpoolBackground(CFeeRate(1000));
+    CScheduler scheduler;
+    boost::thread_group threads;
+    threads.create_thread(boost::bind(&CScheduler::serviceQueue, &scheduler));
+    mpoolBackground.StartFeeEstimatorProcessing(scheduler);
+
+    TestMemPoolEntryHelper entry;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0LL;
+
+    std::vector<CTransactionRef> txPending[10];
+    int blocknum = 0;
+    while (blocknum < 200) {
+        for (int j = 0; j < 10; j++) {
+            for (int k = 0; k < 4; k++) {
+                tx.vin[0].prevout.n = 10000*blocknum+100*j+k;
+                CTransactionRef ptx = MakeTransactionRef(tx);
+                mpool.addUnchecked(ptx->GetHash(), entry.Fee(2000 * (j+1)).Time(GetTime()).Priority(0).Height(blocknum).FromTx(*ptx));
+                mpoolBackground.addUnchecked(ptx->GetHash(), entry.Fee(2000 * (j+1)).Time(GetTime()).Priority(0).Height(blocknum).FromTx(*ptx));
+                txPending[j].push_back(ptx);
+            }
+        }
+        // Higher fee transactions are included more often
+        std::vector<CTransactionRef> block;
+        for (int h = 0; h <= blocknum % 10; h++) {
+            block.insert(block.end(), txPending[9-h].begin(), txPending[9-h].end());
+            txPending[9-h].clear();
+        }
+        ++blocknum;
+        mpool.removeForBlock(block, blocknum);
+        mpoolBackground.removeForBlock(block, blocknum);
+    }
+
+    scheduler.stop(true);
+    threads.join_all();
+
+    int answerFound, answerFoundBackground;
+    for (int i = 1; i <= 25; i++) {
+        BOOST_CHECK(mpool.estimateFee(i) == mpoolBackground.estimateFee(i));
+        BOOST_CHECK(mpool.estimateSmartFee(i, &answerFound) == mpoolBackground.estimateSmartFee(i, &answerFoundBackground));
+        BOOST_CHECK_EQUAL(answerFound, answerFoundBackground);
+    }
+    BOOST_CHECK(mpool.estimateFee(5).GetFeePerK() > 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -72,6 +72,26 @@ BOOST_AUTO_TEST_CASE(streams_vector_writer)
     vch.clear();
 }
 
+BOOST_AUTO_TEST_CASE(streams_span_reader)
+{
+    CDataStream ss(SER_NETWORK, INIT_PROTO_VERSION);
+    ss << (unsigned char)1 << (uint16_t)0x0302;
+
+    CSpanReader reader(ss.GetType(), ss.GetVersion(), ss.data(), ss.data() + ss.size());
+    unsigned char a;
+    uint16_t b;
+    reader >> a;
+    BOOST_CHECK_EQUAL(a, 1);
+    BOOST_CHECK_EQUAL(reader.size(), 2);
+    reader >> b;
+    BOOST_CHECK_EQUAL(b, 0x0302);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> a, std::ios_base::failure);
+
+    // The referenced stream is left as it was
+    BOOST_CHECK_EQUAL(ss.size(), 3);
+}
+
 BOOST_AUTO_TEST_CASE(streams_serializedata_xor)
 {
     std::vector<char> in;
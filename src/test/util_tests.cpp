@@ -41,6 +41,25 @@ BOOST_AUTO_TEST_CASE(util_criticalsection)
     } while(0);
 }
 
+BOOST_AUTO_TEST_CASE(util_ParallelFor)
+{
+    std::vector<int> vCalls(1000);
+    ParallelFor(vCalls.size(), [&vCalls](size_t i) { vCalls[i]++; });
+    BOOST_CHECK(vCalls == std::vector<int>(1000, 1));
+    ParallelFor(0, [](size_t i) { BOOST_ERROR("called for an empty range"); });
+
+    // An exception is passed on once every thread has stopped
+    std::atomic<int> nRunning(0);
+    BOOST_CHECK_THROW(ParallelFor(vCalls.size(), [&nRunning](size_t i) {
+        nRunning++;
+        MilliSleep(1);
+        nRunning--;
+        if (i == 10)
+            throw std::runtime_error("ParallelFor test");
+    }), std::runtime_error);
+    BOOST_CHECK_EQUAL(nRunning, 0);
+}
+
 static const unsigned char ParseHex_expected[65] = {
     0x04, 0x67, 0x8a, 0xfd, 0xb0, 0xfe, 0x55, 0x48, 0x27, 0x19, 0x67, 0xf1, 0xa6, 0x71, 0x30, 0xb7,
     0x10, 0x5c, 0xd6, 0xa8, 0x28, 0xe0, 0x39, 0x09, 0xa6, 0x79, 0x62, 0xe0, 0xea, 0x1f, 0x61, 0xde,
@@ -18,6 +18,8 @@
 #include "utiltime.h"
 #include "version.h"
 
+#include <algorithm>
+
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                                  int64_t _nTime, double _entryPriority, unsigned int _entryHeight,
                                  CAmount _inChainInputValue,
@@ -42,6 +44,8 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFe
     nSizeWithAncestors = GetTxSize();
     nModFeesWithAncestors = nFee;
     nSigOpCostWithAncestors = sigOpCost;
+
+    nEpochMarker = 0;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -81,39 +85,45 @@ size_t CTxMemPoolEntry::GetTxSize() const
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
+    vecEntries stageEntries, vAllDescendants;
+    GetFreshEpoch();
+    BOOST_FOREACH(const txiter childEntry, GetMemPoolChildren(updateIt)) {
+        if (!Visited(childEntry))
+            stageEntries.push_back(childEntry);
+    }
 
     while (!stageEntries.empty()) {
-        const txiter cit = *stageEntries.begin();
-        setAllDescendants.insert(cit);
-        stageEntries.erase(cit);
-        const setEntries &setChildren = GetMemPoolChildren(cit);
-        BOOST_FOREACH(const txiter childEntry, setChildren) {
+        const txiter cit = stageEntries.back();
+        stageEntries.pop_back();
+        vAllDescendants.push_back(cit);
+        const vecEntries &vChildren = GetMemPoolChildren(cit);
+        BOOST_FOREACH(const txiter childEntry, vChildren) {
             cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
             if (cacheIt != cachedDescendants.end()) {
                 // We've already calculated this one, just add the entries for this set
-                // but don't traverse again.
+                // but don't traverse again. (The child itself was in the block
+                // and is excluded.)
                 BOOST_FOREACH(const txiter cacheEntry, cacheIt->second) {
-                    setAllDescendants.insert(cacheEntry);
+                    if (!Visited(cacheEntry))
+                        vAllDescendants.push_back(cacheEntry);
                 }
-            } else if (!setAllDescendants.count(childEntry)) {
+            } else if (!Visited(childEntry)) {
                 // Schedule for later processing
-                stageEntries.insert(childEntry);
+                stageEntries.push_back(childEntry);
             }
         }
     }
-    // setAllDescendants now contains all in-mempool descendants of updateIt.
+    // vAllDescendants now contains all in-mempool descendants of updateIt.
     // Update and add to cached descendant map
     int64_t modifySize = 0;
     CAmount modifyFee = 0;
     int64_t modifyCount = 0;
-    BOOST_FOREACH(txiter cit, setAllDescendants) {
+    BOOST_FOREACH(txiter cit, vAllDescendants) {
         if (!setExclude.count(cit->GetTx().GetHash())) {
             modifySize += cit->GetTxSize();
             modifyFee += cit->GetModifiedFee();
             modifyCount++;
-            cachedDescendants[updateIt].insert(cit);
+            cachedDescendants[updateIt].push_back(cit);
             // Update ancestor state for each descendant
             mapTx.modify(cit, update_ancestor_state(updateIt->GetTxSize(), updateIt->GetModifiedFee(), 1, updateIt->GetSigOpCost()));
         }
@@ -129,6 +139,7 @@ void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendan
 void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate)
 {
     LOCK(cs);
+    ++nContentsVersion;
     // For each entry in vHashesToUpdate, store the set of in-mempool, but not
     // in-vHashesToUpdate transactions, so that we don't have to recalculate
     // descendants when we come across a previously seen entry.
@@ -144,13 +155,13 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
     // setMemPoolChildren will be updated, an assumption made in
     // UpdateForDescendants.
     BOOST_REVERSE_FOREACH(const uint256 &hash, vHashesToUpdate) {
-        // we cache the in-mempool children to avoid duplicate updates
-        setEntries setChildren;
         // calculate children from mapNextTx
         txiter it = mapTx.find(hash);
         if (it == mapTx.end()) {
             continue;
         }
+        // we mark the in-mempool children to avoid duplicate updates
+        GetFreshEpoch();
         auto iter = mapNextTx.lower_bound(COutPoint(hash, 0));
         // First calculate the children, and update setMemPoolChildren to
         // include them, and update their setMemPoolParents to include this tx.
@@ -160,7 +171,7 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
             assert(childIter != mapTx.end());
             // We can skip updating entries we've encountered before or that
             // are in the block (which are already accounted for).
-            if (setChildren.insert(childIter).second && !setAlreadyIncluded.count(childHash)) {
+            if (!Visited(childIter) && !setAlreadyIncluded.count(childHash)) {
                 UpdateChild(it, childIter, true);
                 UpdateParent(childIter, it, true);
             }
@@ -173,17 +184,24 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
 {
     LOCK(cs);
 
-    setEntries parentHashes;
+    // Ancestors still to be walked; everything in it or in setAncestors is
+    // marked visited.
+    vecEntries parentHashes;
     const CTransaction &tx = entry.GetTx();
 
+    GetFreshEpoch();
+    BOOST_FOREACH(const txiter ancestorIt, setAncestors) {
+        Visited(ancestorIt);
+    }
+
     if (fSearchForParents) {
         // Get parents of this transaction that are in the mempool
         // GetMemPoolParents() is only valid for entries in the mempool, so we
         // iterate mapTx to find parents.
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
+            if (piter != mapTx.end() && !Visited(piter)) {
+                parentHashes.push_back(piter);
                 if (parentHashes.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
@@ -194,16 +212,19 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        BOOST_FOREACH(const txiter piter, GetMemPoolParents(it)) {
+            if (!Visited(piter))
+                parentHashes.push_back(piter);
+        }
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
 
     while (!parentHashes.empty()) {
-        txiter stageit = *parentHashes.begin();
+        txiter stageit = parentHashes.back();
 
         setAncestors.insert(stageit);
-        parentHashes.erase(stageit);
+        parentHashes.pop_back();
         totalSizeWithAncestors += stageit->GetTxSize();
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
@@ -217,11 +238,11 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
             return false;
         }
 
-        const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
-        BOOST_FOREACH(const txiter &phash, setMemPoolParents) {
+        const vecEntries & vMemPoolParents = GetMemPoolParents(stageit);
+        BOOST_FOREACH(const txiter &phash, vMemPoolParents) {
             // If this is a new ancestor, add it.
-            if (setAncestors.count(phash) == 0) {
-                parentHashes.insert(phash);
+            if (!Visited(phash)) {
+                parentHashes.push_back(phash);
             }
             if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
                 errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
@@ -235,7 +256,7 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
 
 void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
+    const vecEntries &parentIters = GetMemPoolParents(it);
     // add or remove this tx as a child of each parent
     BOOST_FOREACH(txiter piter, parentIters) {
         UpdateChild(piter, it, add);
@@ -264,12 +285,26 @@ void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries &setAncesto
 
 void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 {
-    const setEntries &setMemPoolChildren = GetMemPoolChildren(it);
-    BOOST_FOREACH(txiter updateIt, setMemPoolChildren) {
+    const vecEntries &vMemPoolChildren = GetMemPoolChildren(it);
+    BOOST_FOREACH(txiter updateIt, vMemPoolChildren) {
         UpdateParent(updateIt, it, false);
     }
 }
 
+/** What the descendant state of an entry loses when some of its descendants are removed. */
+struct DescendantUpdate {
+    int64_t nSize;
+    CAmount nFee;
+    int64_t nCount;
+    DescendantUpdate() : nSize(0), nFee(0), nCount(0) {}
+    void Add(const CTxMemPoolEntry& removed)
+    {
+        nSize -= removed.GetTxSize();
+        nFee -= removed.GetModifiedFee();
+        nCount--;
+    }
+};
+
 void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants)
 {
     // For each entry, walk back all ancestors and decrement size associated with this
@@ -294,6 +329,10 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
             }
         }
     }
+    // What each ancestor staying in the mempool loses, summed up so that each
+    // is modified (and re-sorted in mapTx) once rather than once per removed
+    // descendant. Ancestors that are removed as well need no update at all.
+    std::map<txiter, DescendantUpdate, CompareIteratorByAddress> mapAncestorUpdates;
     BOOST_FOREACH(txiter removeIt, entriesToRemove) {
         setEntries setAncestors;
         const CTxMemPoolEntry &entry = *removeIt;
@@ -316,9 +355,19 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // and it's important that we use the mapLinks[] notion of ancestor
         // transactions as the set of things to update for removal.
         CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
-        // Note that UpdateAncestorsOf severs the child links that point to
-        // removeIt in the entries for the parents of removeIt.
-        UpdateAncestorsOf(false, removeIt, setAncestors);
+        // Sever the child links that point to removeIt in the entries for the
+        // parents of removeIt.
+        BOOST_FOREACH(txiter piter, GetMemPoolParents(removeIt)) {
+            UpdateChild(piter, removeIt, false);
+        }
+        BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+            if (entriesToRemove.count(ancestorIt))
+                continue;
+            mapAncestorUpdates[ancestorIt].Add(*removeIt);
+        }
+    }
+    for (const auto& update : mapAncestorUpdates) {
+        mapTx.modify(update.first, update_descendant_state(update.second.nSize, update.second.nFee, update.second.nCount));
     }
     // After updating all the ancestor sizes, we can now sever the link between each
     // transaction being removed and any mempool children (ie, update setMemPoolParents
@@ -349,8 +398,15 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
 }
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minReasonableRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0), nContentsVersion(0), nSnapshotVersion(0), nEpoch(0)
 {
+    // Bucket 0 collects everything below the minimum, including negative
+    // modified fees; the last bucket collects everything above the maximum.
+    vFeeHistogram.push_back(CFeeHistogramBucket(CFeeRate(0)));
+    for (double bucketBoundary = FEE_HISTOGRAM_MIN_FEERATE; bucketBoundary <= FEE_HISTOGRAM_MAX_FEERATE; bucketBoundary *= FEE_HISTOGRAM_SPACING) {
+        vFeeHistogram.push_back(CFeeHistogramBucket(CFeeRate((CAmount)bucketBoundary)));
+    }
+
     _clear(); //lock free clear
 
     // Sanity checks off by default for performance, because otherwise
@@ -411,6 +467,7 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
             mapTx.modify(newit, update_fee_delta(deltas.second));
         }
     }
+    UpdateFeeHistogram(*newit, true);
 
     // Update cachedInnerUsage to include contained transaction's usage.
     // (When we update the entry for in-mempool parents, memory usage will be
@@ -441,6 +498,7 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     UpdateEntryForAncestors(newit, setAncestors);
 
     nTransactionsUpdated++;
+    ++nContentsVersion;
     totalTxSize += entry.GetTxSize();
     minerPolicyEstimator->processTransaction(entry, validFeeEstimate);
 
@@ -450,6 +508,31 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     return true;
 }
 
+/** The histogram bucket an entry is counted in, by its own modified fee rate */
+static CFeeHistogramBucket& FeeHistogramBucketFor(std::vector<CFeeHistogramBucket>& vBuckets, const CTxMemPoolEntry& entry)
+{
+    const CAmount nFeePerK = CFeeRate(entry.GetModifiedFee(), entry.GetTxSize()).GetFeePerK();
+    std::vector<CFeeHistogramBucket>::iterator bucket = std::upper_bound(vBuckets.begin(), vBuckets.end(), nFeePerK,
+        [](CAmount n, const CFeeHistogramBucket& b) { return n < b.feeRate.GetFeePerK(); });
+    if (bucket != vBuckets.begin())
+        --bucket;
+    return *bucket;
+}
+
+void CTxMemPool::UpdateFeeHistogram(const CTxMemPoolEntry& entry, bool fAdd)
+{
+    CFeeHistogramBucket& bucket = FeeHistogramBucketFor(vFeeHistogram, entry);
+    if (fAdd) {
+        bucket.nCount++;
+        bucket.nSize += entry.GetTxSize();
+        bucket.nFees += entry.GetModifiedFee();
+    } else {
+        bucket.nCount--;
+        bucket.nSize -= entry.GetTxSize();
+        bucket.nFees -= entry.GetModifiedFee();
+    }
+}
+
 void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
 {
     NotifyEntryRemoved(it->GetSharedTx(), reason);
@@ -467,11 +550,13 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
         vTxHashes.clear();
 
     totalTxSize -= it->GetTxSize();
+    UpdateFeeHistogram(*it, false);
     cachedInnerUsage -= it->DynamicMemoryUsage();
     cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
     mapLinks.erase(it);
     mapTx.erase(it);
     nTransactionsUpdated++;
+    ++nContentsVersion;
     minerPolicyEstimator->removeTx(hash);
 }
 
@@ -483,22 +568,21 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
 // can save time by not iterating over those entries.
 void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants)
 {
-    setEntries stage;
-    if (setDescendants.count(entryit) == 0) {
-        stage.insert(entryit);
+    vecEntries stage;
+    if (setDescendants.insert(entryit).second) {
+        stage.push_back(entryit);
     }
     // Traverse down the children of entry, only adding children that are not
     // accounted for in setDescendants already (because those children have either
     // already been walked, or will be walked in this iteration).
     while (!stage.empty()) {
-        txiter it = *stage.begin();
-        setDescendants.insert(it);
-        stage.erase(it);
-
-        const setEntries &setChildren = GetMemPoolChildren(it);
-        BOOST_FOREACH(const txiter &childiter, setChildren) {
-            if (!setDescendants.count(childiter)) {
-                stage.insert(childiter);
+        txiter it = stage.back();
+        stage.pop_back();
+
+        const vecEntries &vChildren = GetMemPoolChildren(it);
+        BOOST_FOREACH(const txiter &childiter, vChildren) {
+            if (setDescendants.insert(childiter).second) {
+                stage.push_back(childiter);
             }
         }
     }
@@ -629,10 +713,15 @@ void CTxMemPool::_clear()
     mapNextTx.clear();
     totalTxSize = 0;
     cachedInnerUsage = 0;
+    for (CFeeHistogramBucket& bucket : vFeeHistogram) {
+        bucket.nCount = bucket.nSize = 0;
+        bucket.nFees = 0;
+    }
     lastRollingFeeUpdate = GetTime();
     blockSinceLastRollingFeeBump = false;
     rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
+    ++nContentsVersion;
 }
 
 void CTxMemPool::clear()
@@ -658,11 +747,18 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     const int64_t nSpendHeight = GetSpendHeight(mempoolDuplicate);
 
     LOCK(cs);
+    std::vector<CFeeHistogramBucket> checkHistogram;
+    for (const CFeeHistogramBucket& bucket : vFeeHistogram)
+        checkHistogram.push_back(CFeeHistogramBucket(bucket.feeRate));
     std::list<const CTxMemPoolEntry*> waitingOnDependants;
     for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
         checkTotal += it->GetTxSize();
         innerUsage += it->DynamicMemoryUsage();
+        CFeeHistogramBucket& bucket = FeeHistogramBucketFor(checkHistogram, *it);
+        bucket.nCount++;
+        bucket.nSize += it->GetTxSize();
+        bucket.nFees += it->GetModifiedFee();
         const CTransaction& tx = it->GetTx();
         txlinksMap::const_iterator linksiter = mapLinks.find(it);
         assert(linksiter != mapLinks.end());
@@ -694,7 +790,9 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(it3->second == &tx);
             i++;
         }
-        assert(setParentCheck == GetMemPoolParents(it));
+        const vecEntries &vParents = GetMemPoolParents(it);
+        assert(setParentCheck.size() == vParents.size());
+        assert(setParentCheck == setEntries(vParents.begin(), vParents.end()));
         // Verify ancestor state is correct.
         setEntries setAncestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -727,7 +825,9 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 childSizes += childit->GetTxSize();
             }
         }
-        assert(setChildrenCheck == GetMemPoolChildren(it));
+        const vecEntries &vChildren = GetMemPoolChildren(it);
+        assert(setChildrenCheck.size() == vChildren.size());
+        assert(setChildrenCheck == setEntries(vChildren.begin(), vChildren.end()));
         // Also check to make sure size is greater than sum with immediate children.
         // just a sanity check, not definitive that this calc is correct...
         assert(it->GetSizeWithDescendants() >= childSizes + it->GetTxSize());
@@ -769,6 +869,11 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
+    for (size_t i = 0; i < vFeeHistogram.size(); i++) {
+        assert(vFeeHistogram[i].nCount == checkHistogram[i].nCount);
+        assert(vFeeHistogram[i].nSize == checkHistogram[i].nSize);
+        assert(vFeeHistogram[i].nFees == checkHistogram[i].nFees);
+    }
 }
 
 bool CTxMemPool::CompareDepthAndScore(const uint256& hasha, const uint256& hashb)
@@ -790,15 +895,19 @@ namespace {
 class DepthAndScoreComparator
 {
 public:
-    bool operator()(const CTxMemPool::indexed_transaction_set::const_iterator& a, const CTxMemPool::indexed_transaction_set::const_iterator& b)
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b)
     {
-        uint64_t counta = a->GetCountWithAncestors();
-        uint64_t countb = b->GetCountWithAncestors();
+        uint64_t counta = a.GetCountWithAncestors();
+        uint64_t countb = b.GetCountWithAncestors();
         if (counta == countb) {
-            return CompareTxMemPoolEntryByScore()(*a, *b);
+            return CompareTxMemPoolEntryByScore()(a, b);
         }
         return counta < countb;
     }
+    bool operator()(const CTxMemPool::indexed_transaction_set::const_iterator& a, const CTxMemPool::indexed_transaction_set::const_iterator& b)
+    {
+        return (*this)(*a, *b);
+    }
 };
 }
 
@@ -847,6 +956,85 @@ std::vector<TxMempoolInfo> CTxMemPool::infoAll() const
     return ret;
 }
 
+CTxMemPoolSnapshotRef CTxMemPool::GetSnapshot() const
+{
+    // Only the copy is made under the lock. Sorting it, and freeing the
+    // snapshot it replaces, wait until the lock is released.
+    CTxMemPoolSnapshotRef snapshotStale, snapshotReplaced;
+    std::vector<CTxMemPoolEntry> vEntries;
+    std::vector<std::vector<uint256> > vParents;
+    uint64_t nVersion;
+    {
+        LOCK(cs);
+        if (snapshot && nSnapshotVersion == nContentsVersion)
+            return snapshot;
+        snapshotStale.swap(snapshot);
+        nVersion = nContentsVersion;
+        vEntries.reserve(mapTx.size());
+        vParents.resize(mapTx.size());
+        for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); ++it) {
+            std::vector<uint256>& vEntryParents = vParents[vEntries.size()];
+            vEntries.push_back(*it);
+            const vecEntries& vEntryLinks = GetMemPoolParents(it);
+            vEntryParents.reserve(vEntryLinks.size());
+            for (txiter parent : vEntryLinks) {
+                vEntryParents.push_back(parent->GetTx().GetHash());
+            }
+        }
+    }
+
+    std::vector<size_t> vOrder(vEntries.size());
+    for (size_t i = 0; i < vOrder.size(); i++)
+        vOrder[i] = i;
+    std::sort(vOrder.begin(), vOrder.end(), [&vEntries](size_t a, size_t b) {
+        return DepthAndScoreComparator()(vEntries[a], vEntries[b]);
+    });
+    std::shared_ptr<CTxMemPoolSnapshot> snapshotNew = std::make_shared<CTxMemPoolSnapshot>();
+    snapshotNew->vEntries.reserve(vOrder.size());
+    snapshotNew->vParents.resize(vOrder.size());
+    for (size_t i = 0; i < vOrder.size(); i++) {
+        snapshotNew->vEntries.push_back(std::move(vEntries[vOrder[i]]));
+        snapshotNew->vParents[i].swap(vParents[vOrder[i]]);
+    }
+
+    {
+        LOCK(cs);
+        // Share it, unless the mempool changed in the meantime
+        if (nVersion == nContentsVersion && (!snapshot || nSnapshotVersion != nContentsVersion)) {
+            snapshotReplaced.swap(snapshot);
+            snapshot = snapshotNew;
+            nSnapshotVersion = nVersion;
+        }
+    }
+    return snapshotNew;
+}
+
+std::vector<TxMempoolInfo> CTxMemPool::infoForRelay(const std::vector<uint256>& vHashes, CAmount nMinFeePerK, size_t nSorted) const
+{
+    LOCK(cs);
+
+    std::vector<indexed_transaction_set::const_iterator> iters;
+    iters.reserve(vHashes.size());
+    for (const uint256& hash : vHashes) {
+        indexed_transaction_set::const_iterator it = mapTx.find(hash);
+        if (it == mapTx.end())
+            continue;
+        if (nMinFeePerK && CFeeRate(it->GetFee(), it->GetTxSize()).GetFeePerK() < nMinFeePerK)
+            continue;
+        iters.push_back(it);
+    }
+    // Only order as many entries as the caller is going to announce now.
+    nSorted = std::min(nSorted, iters.size());
+    std::partial_sort(iters.begin(), iters.begin() + nSorted, iters.end(), DepthAndScoreComparator());
+
+    std::vector<TxMempoolInfo> ret;
+    ret.reserve(iters.size());
+    for (auto it : iters) {
+        ret.push_back(GetInfo(it));
+    }
+    return ret;
+}
+
 CTransactionRef CTxMemPool::get(const uint256& hash) const
 {
     LOCK(cs);
@@ -865,14 +1053,19 @@ TxMempoolInfo CTxMemPool::info(const uint256& hash) const
     return GetInfo(i);
 }
 
+void CTxMemPool::StartFeeEstimatorProcessing(CScheduler& scheduler)
+{
+    minerPolicyEstimator->StartBackgroundProcessing(scheduler);
+}
+
+// The estimator has its own lock and answers from precomputed estimates,
+// so fee estimation does not need to wait for the mempool.
 CFeeRate CTxMemPool::estimateFee(int nBlocks) const
 {
-    LOCK(cs);
     return minerPolicyEstimator->estimateFee(nBlocks);
 }
 CFeeRate CTxMemPool::estimateSmartFee(int nBlocks, int *answerFoundAtBlocks) const
 {
-    LOCK(cs);
     return minerPolicyEstimator->estimateSmartFee(nBlocks, answerFoundAtBlocks, *this);
 }
 double CTxMemPool::estimatePriority(int nBlocks) const
@@ -924,12 +1117,15 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const std::string str
 {
     {
         LOCK(cs);
+        ++nContentsVersion;
         std::pair<double, CAmount> &deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
         txiter it = mapTx.find(hash);
         if (it != mapTx.end()) {
+            UpdateFeeHistogram(*it, false);
             mapTx.modify(it, update_fee_delta(deltas.second));
+            UpdateFeeHistogram(*it, true);
             // Now update all ancestors' modified fees with descendants
             setEntries setAncestors;
             uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -948,6 +1144,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const std::string str
         }
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
+    NotifyEntryPrioritised(hash);
 }
 
 void CTxMemPool::ApplyDeltas(const uint256 hash, double &dPriorityDelta, CAmount &nFeeDelta) const
@@ -1033,27 +1230,32 @@ bool CTxMemPool::addUnchecked(const uint256&hash, const CTxMemPoolEntry &entry,
     return addUnchecked(hash, entry, setAncestors, validFeeEstimate);
 }
 
-void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+void CTxMemPool::UpdateLink(vecEntries& links, txiter link, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    vecEntries::iterator it = std::find(links.begin(), links.end(), link);
+    cachedInnerUsage -= memusage::DynamicUsage(links);
+    if (add && it == links.end()) {
+        links.push_back(link);
+    } else if (!add && it != links.end()) {
+        *it = links.back();
+        links.pop_back();
+        if (links.empty())
+            vecEntries().swap(links);
     }
+    cachedInnerUsage += memusage::DynamicUsage(links);
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    UpdateLink(mapLinks[entry].children, child, add);
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
-    }
+    UpdateLink(mapLinks[entry].parents, parent, add);
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
+const CTxMemPool::vecEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
 {
     assert (entry != mapTx.end());
     txlinksMap::const_iterator it = mapLinks.find(entry);
@@ -1061,7 +1263,7 @@ const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
     return it->second.parents;
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
+const CTxMemPool::vecEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert (entry != mapTx.end());
     txlinksMap::const_iterator it = mapLinks.find(entry);
@@ -1101,34 +1303,125 @@ void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
     }
 }
 
+/** Descendant score of e (see CompareTxMemPoolEntryByDescendantScore) as a fee and size,
+ *  once update is applied to it. */
+static std::pair<double, double> GetDescendantScore(const CTxMemPoolEntry& e, const DescendantUpdate& update = DescendantUpdate())
+{
+    double nFeeWithDescendants = e.GetModFeesWithDescendants() + update.nFee;
+    double nSizeWithDescendants = e.GetSizeWithDescendants() + update.nSize;
+    if (nFeeWithDescendants * e.GetTxSize() > (double)e.GetModifiedFee() * nSizeWithDescendants)
+        return std::make_pair(nFeeWithDescendants, nSizeWithDescendants);
+    return std::make_pair((double)e.GetModifiedFee(), (double)e.GetTxSize());
+}
+
 void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining) {
     LOCK(cs);
 
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
     while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
-        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+        // Stage the packages with the lowest descendant scores until removing
+        // them frees enough memory, and remove them all in one pass. Ancestors
+        // left behind by staged packages would score differently once those
+        // are gone, so staging stops at the first package that does not score
+        // below all of them. The outcome is the same as evicting one package
+        // at a time, but each ancestor is walked to and updated only once.
+        const size_t nUsageToFree = DynamicMemoryUsage() - sizelimit;
+        size_t nUsageStaged = 0;
+        std::set<txiter, CompareIteratorByAddress> setStaged;
+        // What staged descendants take off the ancestors left behind
+        std::map<txiter, DescendantUpdate, CompareIteratorByAddress> mapAffected;
+        // How many children of each parent left behind are staged
+        std::map<txiter, size_t, CompareIteratorByAddress> mapChildrenStaged;
+        // Keeping the lowest score ever seen instead of the lowest current one
+        // can only end the batch early.
+        std::pair<double, double> minAffectedScore(std::numeric_limits<double>::infinity(), 1);
 
-        // We set the new mempool min fee to the feerate of the removed set, plus the
-        // "minimum reasonable fee rate" (ie some value under which we consider txn
-        // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
-        // equal to txn which were removed with no block in between.
-        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
-        removed += incrementalRelayFee;
-        trackPackageRemoved(removed);
-        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+        for (; it != mapTx.get<descendant_score>().end() && nUsageStaged < nUsageToFree; ++it) {
+            txiter rootit = mapTx.project<0>(it);
+            if (setStaged.count(rootit))
+                continue;
+            if (!mapAffected.empty()) {
+                if (mapAffected.count(rootit))
+                    break;
+                std::pair<double, double> score = GetDescendantScore(*it);
+                if (score.first * minAffectedScore.second >= minAffectedScore.first * score.second)
+                    break;
+            }
 
-        setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
-        nTxnRemoved += stage.size();
+            // We set the new mempool min fee to the feerate of the removed set, plus the
+            // "minimum reasonable fee rate" (ie some value under which we consider txn
+            // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
+            // equal to txn which were removed with no block in between.
+            CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+            removed += incrementalRelayFee;
+            trackPackageRemoved(removed);
+            maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+            setEntries setPackage;
+            CalculateDescendants(rootit, setPackage);
+            BOOST_FOREACH(txiter pit, setPackage) {
+                setStaged.insert(pit);
+                const TxLinks& links = mapLinks.find(pit)->second;
+                // What removeUnchecked() takes off DynamicMemoryUsage()
+                nUsageStaged += memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) + pit->DynamicMemoryUsage() +
+                                pit->GetTx().vin.size() * memusage::IncrementalDynamicUsage(mapNextTx) + memusage::IncrementalDynamicUsage(mapLinks) +
+                                memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
+            }
+            BOOST_FOREACH(txiter pit, setPackage) {
+                if (pit->GetCountWithAncestors() == 1)
+                    continue;
+                // A parent left behind frees its children vector once the
+                // last of them is removed (see UpdateLink()).
+                BOOST_FOREACH(txiter parentIt, GetMemPoolParents(pit)) {
+                    if (setStaged.count(parentIt))
+                        continue;
+                    const vecEntries& children = GetMemPoolChildren(parentIt);
+                    if (++mapChildrenStaged[parentIt] == children.size())
+                        nUsageStaged += memusage::DynamicUsage(children);
+                }
+                setEntries setAncestors;
+                std::string dummy;
+                CalculateMemPoolAncestors(*pit, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+                BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+                    if (setStaged.count(ancestorIt))
+                        continue;
+                    DescendantUpdate& update = mapAffected[ancestorIt];
+                    update.Add(*pit);
+                    std::pair<double, double> score = GetDescendantScore(*ancestorIt, update);
+                    if (score.first * minAffectedScore.second < minAffectedScore.first * score.second)
+                        minAffectedScore = score;
+                }
+            }
+            // removeUnchecked() shrinks vTxHashes once it is less than half
+            // full, which frees more than estimated: end the batch there.
+            if ((vTxHashes.size() - setStaged.size()) * 2 < vTxHashes.capacity())
+                break;
+        }
+        nTxnRemoved += setStaged.size();
 
         std::vector<CTransaction> txn;
         if (pvNoSpendsRemaining) {
-            txn.reserve(stage.size());
-            BOOST_FOREACH(txiter iter, stage)
+            txn.reserve(setStaged.size());
+            BOOST_FOREACH(txiter iter, setStaged)
                 txn.push_back(iter->GetTx());
         }
-        RemoveStaged(stage, false, MemPoolRemovalReason::SIZELIMIT);
+        // Packages are staged whole, so only ancestors of staged entries and
+        // the links from them need updating; see UpdateForRemoveFromMempool.
+        for (const auto& update : mapAffected) {
+            mapTx.modify(update.first, update_descendant_state(update.second.nSize, update.second.nFee, update.second.nCount));
+        }
+        BOOST_FOREACH(txiter removeIt, setStaged) {
+            BOOST_FOREACH(txiter piter, GetMemPoolParents(removeIt)) {
+                if (!setStaged.count(piter))
+                    UpdateChild(piter, removeIt, false);
+            }
+        }
+        BOOST_FOREACH(txiter removeIt, setStaged) {
+            removeUnchecked(removeIt, MemPoolRemovalReason::SIZELIMIT);
+        }
         if (pvNoSpendsRemaining) {
             BOOST_FOREACH(const CTransaction& tx, txn) {
                 BOOST_FOREACH(const CTxIn& txin, tx.vin) {
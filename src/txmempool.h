@@ -29,6 +29,7 @@
 
 class CAutoFile;
 class CBlockIndex;
+class CScheduler;
 
 inline double AllowFreeThreshold()
 {
@@ -158,6 +159,7 @@ public:
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint64_t nEpochMarker; //!< Last mempool traversal (epoch) that visited this entry
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -335,6 +337,41 @@ struct TxMempoolInfo
     int64_t nFeeDelta;
 };
 
+/** Lower bound of the lowest nonzero fee histogram bucket, in satoshis per kB */
+static const double FEE_HISTOGRAM_MIN_FEERATE = 1000;
+/** Upper bound of the fee histogram; higher fee rates go into the last bucket */
+static const double FEE_HISTOGRAM_MAX_FEERATE = 1e7;
+/** Spacing of fee histogram buckets */
+static const double FEE_HISTOGRAM_SPACING = 1.2;
+
+/**
+ * Totals for the mempool transactions whose own modified fee rate falls
+ * into [feeRate, next bucket's feeRate).
+ */
+struct CFeeHistogramBucket
+{
+    CFeeRate feeRate;
+    uint64_t nCount;
+    uint64_t nSize;  //!< sum of virtual sizes
+    CAmount nFees;   //!< sum of modified fees
+
+    CFeeHistogramBucket(const CFeeRate& _feeRate) : feeRate(_feeRate), nCount(0), nSize(0), nFees(0) {}
+};
+
+/**
+ * Immutable copy of the mempool contents, taken under a single lock and
+ * shared between readers, so that RPC and REST calls can walk the whole
+ * mempool without holding CTxMemPool::cs.
+ */
+struct CTxMemPoolSnapshot
+{
+    /** Copies of all entries, in depth-and-score order */
+    std::vector<CTxMemPoolEntry> vEntries;
+    /** Txids of the in-mempool parents of each entry */
+    std::vector<std::vector<uint256> > vParents;
+};
+typedef std::shared_ptr<const CTxMemPoolSnapshot> CTxMemPoolSnapshotRef;
+
 /** Reason why a transaction was removed from the mempool,
  * this is passed to the notification signal.
  */
@@ -437,13 +474,24 @@ private:
 
     uint64_t totalTxSize;      //!< sum of all mempool tx's virtual sizes. Differs from serialized tx size since witness data is discounted. Defined in BIP 141.
     uint64_t cachedInnerUsage; //!< sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+    std::vector<CFeeHistogramBucket> vFeeHistogram; //!< per fee rate bucket totals, ascending by fee rate
 
     mutable int64_t lastRollingFeeUpdate;
     mutable bool blockSinceLastRollingFeeBump;
     mutable double rollingMinimumFeeRate; //!< minimum fee to get into the pool, decreases exponentially
 
+    //! Bumped for every change a snapshot would show
+    uint64_t nContentsVersion;
+    //! Last snapshot built, and the nContentsVersion it was built at. A stale
+    //! one is kept until the next GetSnapshot call, which frees it outside cs.
+    mutable CTxMemPoolSnapshotRef snapshot;
+    mutable uint64_t nSnapshotVersion;
+
     void trackPackageRemoved(const CFeeRate& rate);
 
+    /** Add (or with fAdd false, subtract) an entry to its fee histogram bucket */
+    void UpdateFeeHistogram(const CTxMemPoolEntry& entry, bool fAdd);
+
 public:
 
     static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; // public only for testing
@@ -492,22 +540,53 @@ public:
         }
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
+    typedef std::vector<txiter> vecEntries;
 
-    const setEntries & GetMemPoolParents(txiter entry) const;
-    const setEntries & GetMemPoolChildren(txiter entry) const;
+    /** Orders iterators by entry address: unlike CompareIteratorByHash, this
+     *  does not touch the entries, which matters for lookups in large maps
+     *  whose order is of no interest. */
+    struct CompareIteratorByAddress {
+        bool operator()(const txiter &a, const txiter &b) const {
+            return &*a < &*b;
+        }
+    };
+
+    const vecEntries & GetMemPoolParents(txiter entry) const;
+    const vecEntries & GetMemPoolChildren(txiter entry) const;
 private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+    typedef std::map<txiter, vecEntries, CompareIteratorByHash> cacheMap;
 
+    /** Direct in-mempool parents and children. Transactions have few of
+     *  either, so unsorted vectors are cheaper to walk and update than sets. */
     struct TxLinks {
-        setEntries parents;
-        setEntries children;
+        vecEntries parents;
+        vecEntries children;
     };
 
-    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    typedef std::map<txiter, TxLinks, CompareIteratorByAddress> txlinksMap;
     txlinksMap mapLinks;
 
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
+    /** Add or remove a link, keeping cachedInnerUsage current */
+    void UpdateLink(vecEntries& links, txiter link, bool add);
+
+    /**
+     * Graph traversals mark the entries they visit with the current epoch
+     * instead of collecting them in a set. GetFreshEpoch() starts a new
+     * traversal, after which no entry counts as visited. Traversals must not
+     * be nested, and require cs.
+     */
+    mutable uint64_t nEpoch;
+    void GetFreshEpoch() const { ++nEpoch; }
+    /** Mark it visited by the current traversal. Returns whether it already was. */
+    bool Visited(txiter it) const
+    {
+        if (it->nEpochMarker == nEpoch)
+            return true;
+        it->nEpochMarker = nEpoch;
+        return false;
+    }
 
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
@@ -629,6 +708,16 @@ public:
         return totalTxSize;
     }
 
+    /**
+     * Return the fee histogram, ascending by fee rate. Buckets are kept up to
+     * date as transactions enter and leave, so this does not walk the mempool.
+     */
+    std::vector<CFeeHistogramBucket> GetFeeHistogram() const
+    {
+        LOCK(cs);
+        return vFeeHistogram;
+    }
+
     bool exists(uint256 hash) const
     {
         LOCK(cs);
@@ -638,6 +727,23 @@ public:
     CTransactionRef get(const uint256& hash) const;
     TxMempoolInfo info(const uint256& hash) const;
     std::vector<TxMempoolInfo> infoAll() const;
+    /**
+     * Return a snapshot of the mempool contents. The snapshot is shared
+     * by all callers until the mempool changes, so repeated calls on an
+     * unchanged mempool cost nothing.
+     */
+    CTxMemPoolSnapshotRef GetSnapshot() const;
+    /**
+     * Look up a batch of transactions for inventory relay under a single lock.
+     * Transactions that are no longer in the mempool, or whose fee rate is below
+     * nMinFeePerK, are left out. The first nSorted results are in depth-and-score
+     * order (parents before children, higher fee rate first); the rest follow in
+     * unspecified order.
+     */
+    std::vector<TxMempoolInfo> infoForRelay(const std::vector<uint256>& vHashes, CAmount nMinFeePerK, size_t nSorted) const;
+
+    /** Update the fee estimator from the scheduler thread rather than inline */
+    void StartFeeEstimatorProcessing(CScheduler& scheduler);
 
     /** Estimate fee rate needed to get into the next nBlocks
      *  If no answer can be given at nBlocks, return an estimate
@@ -665,6 +771,8 @@ public:
 
     boost::signals2::signal<void (CTransactionRef)> NotifyEntryAdded;
     boost::signals2::signal<void (CTransactionRef, MemPoolRemovalReason)> NotifyEntryRemoved;
+    //! Fired, without cs held, after a fee or priority delta changed
+    boost::signals2::signal<void (const uint256&)> NotifyEntryPrioritised;
 
 private:
     /** UpdateForDescendants is used by UpdateTransactionsFromBlock to update
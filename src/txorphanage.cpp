@@ -0,0 +1,187 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txorphanage.h"
+
+#include "core_memusage.h"
+#include "memusage.h"
+#include "policy/policy.h"
+#include "random.h"
+#include "util.h"
+
+bool CTxOrphanage::AddTx(const CTransactionRef& tx, NodeId peer, int64_t nTimeExpire)
+{
+    LOCK(cs);
+
+    const uint256& hash = tx->GetHash();
+    if (mapOrphans.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    // 100 orphans, each of which is at most 99,999 bytes big is
+    // at most 10 megabytes of orphans and somewhat more byprev index (in the worst case):
+    unsigned int sz = GetTransactionWeight(*tx);
+    if (sz >= MAX_STANDARD_TX_WEIGHT)
+    {
+        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
+        return false;
+    }
+
+    size_t nUsage = RecursiveDynamicUsage(*tx) + memusage::MallocUsage(sizeof(COrphanTx) + 6 * sizeof(void*));
+    auto ret = mapOrphans.insert(COrphanTx{tx, peer, nTimeExpire, nUsage, vOrphanRandom.size()});
+    assert(ret.second);
+    vOrphanRandom.push_back(ret.first);
+    for (const CTxIn& txin : tx->vin) {
+        mapOrphansByPrev[txin.prevout].insert(ret.first);
+    }
+    nOrphanUsage += nUsage;
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u, %u kB)\n", hash.ToString(),
+             mapOrphans.size(), mapOrphansByPrev.size(), nOrphanUsage / 1000);
+    return true;
+}
+
+bool CTxOrphanage::HaveTx(const uint256& hash) const
+{
+    LOCK(cs);
+    return mapOrphans.count(hash) != 0;
+}
+
+int CTxOrphanage::_EraseTx(orphaniter it)
+{
+    AssertLockHeld(cs);
+    for (const CTxIn& txin : it->tx->vin)
+    {
+        auto itPrev = mapOrphansByPrev.find(txin.prevout);
+        if (itPrev == mapOrphansByPrev.end())
+            continue;
+        itPrev->second.erase(it);
+        if (itPrev->second.empty())
+            mapOrphansByPrev.erase(itPrev);
+    }
+
+    // Swap the last entry of vOrphanRandom into the erased slot.
+    size_t nIdx = it->nRandomIdx;
+    if (nIdx + 1 != vOrphanRandom.size()) {
+        vOrphanRandom[nIdx] = vOrphanRandom.back();
+        vOrphanRandom[nIdx]->nRandomIdx = nIdx;
+    }
+    vOrphanRandom.pop_back();
+
+    nOrphanUsage -= it->nUsage;
+    mapOrphans.erase(it);
+    return 1;
+}
+
+int CTxOrphanage::EraseTx(const uint256& hash)
+{
+    LOCK(cs);
+    orphaniter it = mapOrphans.find(hash);
+    if (it == mapOrphans.end())
+        return 0;
+    return _EraseTx(it);
+}
+
+int CTxOrphanage::EraseForPeer(NodeId peer)
+{
+    LOCK(cs);
+    int nErased = 0;
+    auto& index = mapOrphans.get<orphan_peer>();
+    auto range = index.equal_range(peer);
+    while (range.first != range.second) {
+        // Advance before erasing, the erased entry's iterator becomes invalid.
+        orphaniter it = mapOrphans.project<0>(range.first++);
+        nErased += _EraseTx(it);
+    }
+    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer=%d\n", nErased, peer);
+    return nErased;
+}
+
+int CTxOrphanage::EraseForTx(const CTransaction& tx)
+{
+    LOCK(cs);
+    std::vector<uint256> vOrphanErase;
+    // Which orphan pool entries must we evict?
+    for (const CTxIn& txin : tx.vin) {
+        auto itByPrev = mapOrphansByPrev.find(txin.prevout);
+        if (itByPrev == mapOrphansByPrev.end()) continue;
+        for (const orphaniter& it : itByPrev->second) {
+            vOrphanErase.push_back(it->GetHash());
+        }
+    }
+
+    // The same orphan may spend several outputs of tx, so look each one up again.
+    int nErased = 0;
+    for (const uint256& orphanHash : vOrphanErase) {
+        orphaniter it = mapOrphans.find(orphanHash);
+        if (it != mapOrphans.end())
+            nErased += _EraseTx(it);
+    }
+    return nErased;
+}
+
+int CTxOrphanage::EraseExpired(int64_t nNow)
+{
+    LOCK(cs);
+    int nErased = 0;
+    auto& index = mapOrphans.get<orphan_expiry>();
+    while (!index.empty() && index.begin()->nTimeExpire <= nNow) {
+        nErased += _EraseTx(mapOrphans.project<0>(index.begin()));
+    }
+    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
+    return nErased;
+}
+
+unsigned int CTxOrphanage::LimitOrphans(unsigned int nMaxOrphans)
+{
+    LOCK(cs);
+    unsigned int nEvicted = 0;
+    while (mapOrphans.size() > nMaxOrphans)
+    {
+        // Evict a random orphan:
+        _EraseTx(vOrphanRandom[GetRand(vOrphanRandom.size())]);
+        ++nEvicted;
+    }
+    return nEvicted;
+}
+
+std::vector<std::pair<CTransactionRef, NodeId>> CTxOrphanage::GetChildren(const COutPoint& prevout) const
+{
+    LOCK(cs);
+    std::vector<std::pair<CTransactionRef, NodeId>> vChildren;
+    auto itByPrev = mapOrphansByPrev.find(prevout);
+    if (itByPrev == mapOrphansByPrev.end())
+        return vChildren;
+    vChildren.reserve(itByPrev->second.size());
+    for (const orphaniter& it : itByPrev->second) {
+        vChildren.emplace_back(it->tx, it->fromPeer);
+    }
+    return vChildren;
+}
+
+void CTxOrphanage::Clear()
+{
+    LOCK(cs);
+    mapOrphans.clear();
+    mapOrphansByPrev.clear();
+    vOrphanRandom.clear();
+    nOrphanUsage = 0;
+}
+
+size_t CTxOrphanage::Size() const
+{
+    LOCK(cs);
+    return mapOrphans.size();
+}
+
+size_t CTxOrphanage::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return nOrphanUsage + memusage::DynamicUsage(mapOrphansByPrev) + memusage::DynamicUsage(vOrphanRandom);
+}
@@ -0,0 +1,117 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXORPHANAGE_H
+#define BITCOIN_TXORPHANAGE_H
+
+#include "coins.h"
+#include "net.h"
+#include "primitives/transaction.h"
+#include "sync.h"
+
+#include <map>
+#include <set>
+#include <vector>
+
+#undef foreach
+#include "boost/multi_index_container.hpp"
+#include "boost/multi_index/ordered_index.hpp"
+#include "boost/multi_index/hashed_index.hpp"
+#include "boost/multi_index/member.hpp"
+#include "boost/multi_index/mem_fun.hpp"
+
+/** A transaction whose inputs we do not have yet. */
+struct COrphanTx {
+    CTransactionRef tx;
+    NodeId fromPeer;
+    int64_t nTimeExpire;
+    size_t nUsage;             //!< Memory accounted for this entry
+    mutable size_t nRandomIdx; //!< Index in CTxOrphanage::vOrphanRandom
+
+    const uint256& GetHash() const { return tx->GetHash(); }
+};
+
+// Multi_index tag names
+struct orphan_peer {};
+struct orphan_expiry {};
+
+/**
+ * Pool of orphan transactions, indexed by txid, by the outpoints they spend,
+ * by the peer that sent them and by expiry time, so that a disconnecting peer
+ * or an expiry sweep only touches the entries involved.
+ *
+ * The orphanage has its own lock and does not require cs_main.
+ */
+class CTxOrphanage
+{
+public:
+    typedef boost::multi_index_container<
+        COrphanTx,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::hashed_unique<boost::multi_index::const_mem_fun<COrphanTx, const uint256&, &COrphanTx::GetHash>, SaltedTxidHasher>,
+            // sorted by peer
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<orphan_peer>,
+                boost::multi_index::member<COrphanTx, NodeId, &COrphanTx::fromPeer>
+            >,
+            // sorted by expiry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<orphan_expiry>,
+                boost::multi_index::member<COrphanTx, int64_t, &COrphanTx::nTimeExpire>
+            >
+        >
+    > indexed_orphan_set;
+    typedef indexed_orphan_set::const_iterator orphaniter;
+
+private:
+    struct CompareIteratorByHash {
+        bool operator()(const orphaniter& a, const orphaniter& b) const {
+            return a->GetHash() < b->GetHash();
+        }
+    };
+
+    mutable CCriticalSection cs;
+    indexed_orphan_set mapOrphans;
+    std::map<COutPoint, std::set<orphaniter, CompareIteratorByHash>> mapOrphansByPrev;
+    //! All entries, in random order, for O(1) random eviction
+    std::vector<orphaniter> vOrphanRandom;
+    size_t nOrphanUsage;
+
+    int _EraseTx(orphaniter it);
+
+public:
+    CTxOrphanage() : nOrphanUsage(0) {}
+
+    /** Add a new orphan transaction. Returns false if it is already present or too large. */
+    bool AddTx(const CTransactionRef& tx, NodeId peer, int64_t nTimeExpire);
+
+    /** Check if we already have an orphan transaction with this txid. */
+    bool HaveTx(const uint256& hash) const;
+
+    /** Erase an orphan by txid. Returns the number of entries erased (0 or 1). */
+    int EraseTx(const uint256& hash);
+
+    /** Erase all orphans announced by a peer. */
+    int EraseForPeer(NodeId peer);
+
+    /** Erase all orphans spending any input of tx, as it was included in or conflicted by a block. */
+    int EraseForTx(const CTransaction& tx);
+
+    /** Erase all orphans that expire at or before nNow. */
+    int EraseExpired(int64_t nNow);
+
+    /** Randomly evict orphans until at most nMaxOrphans remain. Returns the number evicted. */
+    unsigned int LimitOrphans(unsigned int nMaxOrphans);
+
+    /** Orphans spending the given outpoint, with the peers that sent them. */
+    std::vector<std::pair<CTransactionRef, NodeId>> GetChildren(const COutPoint& prevout) const;
+
+    void Clear();
+    size_t Size() const;
+    size_t DynamicMemoryUsage() const;
+};
+
+#endif // BITCOIN_TXORPHANAGE_H
@@ -17,6 +17,7 @@
 #include "utiltime.h"
 
 #include <stdarg.h>
+#include <exception>
 
 #if (defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__DragonFly__))
 #include <pthread.h>
@@ -844,6 +845,38 @@ int GetNumCores()
 #endif
 }
 
+void ParallelFor(size_t nCount, const std::function<void(size_t)>& func)
+{
+    std::atomic<size_t> nNext(0);
+    boost::mutex csError;
+    std::exception_ptr error;
+    auto worker = [&nNext, nCount, &func, &csError, &error]() {
+        try {
+            size_t i;
+            while ((i = nNext++) < nCount)
+                func(i);
+        } catch (...) {
+            // Hand out no more work and keep the first exception for the caller
+            nNext = nCount;
+            boost::lock_guard<boost::mutex> lock(csError);
+            if (!error)
+                error = std::current_exception();
+        }
+    };
+    const int nThreads = std::max(1, std::min(GetNumCores(), MAX_PARALLEL_FOR_THREADS));
+    boost::thread_group workers;
+    try {
+        for (int i = 1; i < nThreads && (size_t)i < nCount; i++)
+            workers.create_thread(worker);
+    } catch (const boost::thread_resource_error&) {
+        // The threads that did start, and this one, do all the work
+    }
+    worker();
+    workers.join_all();
+    if (error)
+        std::rethrow_exception(error);
+}
+
 std::string CopyrightHolders(const std::string& strPrefix)
 {
     std::string strCopyrightHolders = strPrefix + strprintf(_(COPYRIGHT_HOLDERS), _(COPYRIGHT_HOLDERS_SUBSTITUTION));
@@ -20,6 +20,7 @@
 
 #include <atomic>
 #include <exception>
+#include <functional>
 #include <map>
 #include <stdint.h>
 #include <string>
@@ -203,6 +204,18 @@ std::string HelpMessageOpt(const std::string& option, const std::string& message
  */
 int GetNumCores();
 
+/** Maximum number of threads ParallelFor spreads its work over */
+static const int MAX_PARALLEL_FOR_THREADS = 8;
+
+/**
+ * Call func(i) for every i in [0, nCount), on up to MAX_PARALLEL_FOR_THREADS
+ * threads (one per core) including the calling one, and return once all calls
+ * have returned. Calls for different i run concurrently and in no set order.
+ * If a call throws, no further calls are started and the first exception is
+ * rethrown on the calling thread once all threads have been joined.
+ */
+void ParallelFor(size_t nCount, const std::function<void(size_t)>& func);
+
 void RenameThread(const char* name);
 
 /**
@@ -13,6 +13,7 @@
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
 #include "hash.h"
 #include "init.h"
 #include "policy/fees.h"
@@ -40,6 +41,13 @@
 #include <atomic>
 #include <sstream>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/join.hpp>
 #include <boost/filesystem.hpp>
@@ -1165,6 +1173,31 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+bool ReadIndexedBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const uint256& hashBlock)
+{
+    block.SetNull();
+
+    // Open history file to read
+    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    // Read block
+    try {
+        filein >> block;
+    }
+    catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    // The indexed header already passed its proof of work check; matching its
+    // hash is enough and much cheaper than recomputing the PoW hash.
+    if (block.GetHash() != hashBlock)
+        return error("%s: GetHash() doesn't match index at %s", __func__, pos.ToString());
+
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     int halvings = nHeight / consensusParams.nSubsidyHalvingInterval;
@@ -1661,12 +1694,92 @@ void static FlushBlockFile(bool fFinalize = false)
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+/** Number of script checks WarmSignatureCache queues before checking whether block validation wants the queue */
+static const size_t WARM_SIGNATURE_CACHE_CHECKS = 256;
 
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
+void WarmSignatureCache(const std::vector<CTransactionRef>& vtx, const std::function<bool(const CTransaction&)>& fnSkip)
+{
+    if (!nScriptCheckThreads || vtx.empty())
+        return;
+
+    std::map<uint256, const CTransaction*> mapBatch;
+    for (const CTransactionRef& ptx : vtx)
+        mapBatch.emplace(ptx->GetHash(), ptx.get());
+
+    std::vector<PrecomputedTransactionData> vTxData;
+    vTxData.reserve(vtx.size());
+    std::vector<CScriptCheck> vChecks;
+    {
+        LOCK2(cs_main, mempool.cs);
+        const bool witnessEnabled = IsWitnessEnabled(chainActive.Tip(), Params().GetConsensus());
+        const CFeeRate mempoolMinFee = mempool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+        for (const CTransactionRef& ptx : vtx) {
+            const CTransaction& tx = *ptx;
+            // Only spend time on transactions that AcceptToMemoryPool would
+            // go on to verify: new, standard, with all inputs and paying the
+            // relay fee.
+            std::string reason;
+            if (mempool.exists(tx.GetHash()) || (fnSkip && fnSkip(tx)) || (fRequireStandard && !IsStandardTx(tx, reason, witnessEnabled)))
+                continue;
+            std::vector<CTxOut> vSpent;
+            vSpent.reserve(tx.vin.size());
+            CAmount nValueIn = 0;
+            for (const CTxIn& txin : tx.vin) {
+                const COutPoint& prevout = txin.prevout;
+                // The spent output is created by a transaction in this batch, in the mempool or in the UTXO set
+                auto itBatch = mapBatch.find(prevout.hash);
+                CTransactionRef ptxMempool;
+                const CCoins* coins;
+                const CTxOut* pout = NULL;
+                if (itBatch != mapBatch.end()) {
+                    if (prevout.n < itBatch->second->vout.size())
+                        pout = &itBatch->second->vout[prevout.n];
+                } else if ((ptxMempool = mempool.get(prevout.hash))) {
+                    if (prevout.n < ptxMempool->vout.size())
+                        pout = &ptxMempool->vout[prevout.n];
+                } else if ((coins = pcoinsTip->AccessCoins(prevout.hash)) && coins->IsAvailable(prevout.n)) {
+                    pout = &coins->vout[prevout.n];
+                }
+                if (pout == NULL || !MoneyRange(pout->nValue))
+                    break;
+                vSpent.push_back(*pout);
+                nValueIn += pout->nValue;
+            }
+            if (vSpent.size() != tx.vin.size() || !MoneyRange(nValueIn) || nValueIn < tx.GetValueOut())
+                continue;
+            double dPriorityDelta = 0;
+            CAmount nFees = nValueIn - tx.GetValueOut();
+            mempool.ApplyDeltas(tx.GetHash(), dPriorityDelta, nFees);
+            unsigned int nSize = GetVirtualTransactionSize(tx);
+            if (nFees < ::minRelayTxFee.GetFee(nSize) || nFees < mempoolMinFee.GetFee(nSize))
+                continue;
+
+            vTxData.emplace_back(tx);
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+                vChecks.emplace_back(vSpent[i], tx, i, STANDARD_SCRIPT_VERIFY_FLAGS, true, &vTxData.back());
+        }
+    }
+
+    // The results are thrown away: AcceptToMemoryPool verifies every script
+    // again, but finds the signatures in the cache. A failing check makes the
+    // queue skip the rest of its portion, which only leaves them uncached.
+    // The checks are handed over in portions so that block validation waiting
+    // for the queue takes over after the current one.
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue, true);
+    for (auto it = vChecks.begin(); it != vChecks.end() && !control.IsPreempted(); ) {
+        auto itEnd = it + std::min<size_t>(WARM_SIGNATURE_CACHE_CHECKS, vChecks.end() - it);
+        std::vector<CScriptCheck> vPortion(std::make_move_iterator(it), std::make_move_iterator(itEnd));
+        control.Add(vPortion);
+        control.Wait();
+        it = itEnd;
+    }
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -4185,14 +4298,204 @@ int VersionBitsTipStateSinceHeight(const Consensus::Params& params, Consensus::D
     return VersionBitsStateSinceHeight(chainActive.Tip(), params, pos, versionbitscache);
 }
 
-static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/**
+ * mempool.dat version 2: a header, then one self-contained record per entry in
+ * the order DumpMempool found them, parents before children, then the fee
+ * deltas of transactions not in the mempool.
+ *
+ * Header:  uint64 version, uint64 number of records
+ * Record:  uint32 payload size, payload, uint64 SipHash of the payload
+ * Payload: txid, int64 entry time, int64 fee delta, uint64 count with
+ *          ancestors, transaction
+ *
+ * The fixed-size fields lead the payload, so LoadMempool can pick the records
+ * worth loading straight from the mapped file and only deserialize those,
+ * taking the txid from the record instead of hashing the transaction again.
+ * A record failing its checksum is skipped without affecting the others.
+ *
+ * Version 1 files, a plain list of transaction, entry time and fee delta
+ * followed by the same fee deltas, are still read.
+ */
+static const uint64_t MEMPOOL_DUMP_VERSION = 2;
+static const uint64_t MEMPOOL_DUMP_VERSION_1 = 1;
+static const size_t MEMPOOL_DUMP_HEADER_SIZE = 16;
+static const size_t MEMPOOL_RECORD_FIXED_SIZE = 56;
+static const uint64_t MEMPOOL_RECORD_CHECKSUM_K0 = 0x6d656d706f6f6c2eULL; // "mempool."
+static const uint64_t MEMPOOL_RECORD_CHECKSUM_K1 = 0x6461742072656364ULL; // "dat recd"
+
+static std::atomic<bool> fMempoolLoaded(false);
+static std::atomic<int64_t> nMempoolLoadTotal(0);
+static std::atomic<int64_t> nMempoolLoadDone(0);
+
+bool IsMempoolLoaded()
+{
+    return fMempoolLoaded;
+}
 
-bool LoadMempool(void)
+double GetMempoolLoadProgress()
+{
+    if (fMempoolLoaded)
+        return 1.0;
+    int64_t nTotal = nMempoolLoadTotal;
+    if (nTotal <= 0)
+        return 0.0;
+    return std::min(1.0, (double)nMempoolLoadDone / nTotal);
+}
+
+namespace {
+
+/** Read-only view of a whole file, mapped into memory where the platform allows it. */
+class CMappedFile
+{
+private:
+    const unsigned char* pData;
+    size_t nSize;
+#ifdef WIN32
+    std::vector<unsigned char> vData;
+#endif
+
+public:
+    explicit CMappedFile(const boost::filesystem::path& path) : pData(NULL), nSize(0)
+    {
+#ifdef WIN32
+        FILE* file = fopen(path.string().c_str(), "rb");
+        if (!file)
+            return;
+        unsigned char buf[65536];
+        size_t nRead;
+        while ((nRead = fread(buf, 1, sizeof(buf), file)) > 0)
+            vData.insert(vData.end(), buf, buf + nRead);
+        fclose(file);
+        pData = vData.data();
+        nSize = vData.size();
+#else
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd == -1)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+                pData = (const unsigned char*)p;
+                nSize = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~CMappedFile()
+    {
+#ifndef WIN32
+        if (pData)
+            munmap((void*)pData, nSize);
+#endif
+    }
+
+    bool IsNull() const { return pData == NULL; }
+    const unsigned char* begin() const { return pData; }
+    const unsigned char* end() const { return pData + nSize; }
+    size_t size() const { return nSize; }
+};
+
+struct MempoolLoadEntry {
+    uint256 txid;
+    CTransactionRef tx; //!< Null until the record is deserialized
+    const unsigned char* pTxBegin; //!< Serialized transaction of a version 2 record
+    const unsigned char* pTxEnd;
+    int64_t nTime;
+    int64_t nFeeDelta;
+    uint64_t nCountWithAncestors;
+};
+
+/** Collect the unexpired records of a version 2 file and the trailing fee deltas */
+bool ReadMempoolRecords(const CMappedFile& file, int64_t nExpiry, std::vector<MempoolLoadEntry>& vEntries, std::map<uint256, CAmount>& mapDeltas, int64_t& skipped, int64_t& failed)
+{
+    uint64_t num = ReadLE64(file.begin() + 8);
+    nMempoolLoadTotal = num;
+
+    const unsigned char* p = file.begin() + MEMPOOL_DUMP_HEADER_SIZE;
+    for (; num > 0; num--) {
+        if ((size_t)(file.end() - p) < 4 || (size_t)(file.end() - p) - 4 < (size_t)ReadLE32(p) + 8) {
+            LogPrintf("Failed to deserialize mempool data on disk: truncated file. Continuing anyway.\n");
+            return false;
+        }
+        const unsigned char* pPayload = p + 4;
+        const unsigned char* pPayloadEnd = pPayload + ReadLE32(p);
+        p = pPayloadEnd + 8;
+
+        uint64_t nChecksum = CSipHasher(MEMPOOL_RECORD_CHECKSUM_K0, MEMPOOL_RECORD_CHECKSUM_K1).Write(pPayload, pPayloadEnd - pPayload).Finalize();
+        if (pPayloadEnd - pPayload < (ptrdiff_t)MEMPOOL_RECORD_FIXED_SIZE || nChecksum != ReadLE64(pPayloadEnd)) {
+            ++failed;
+            ++nMempoolLoadDone;
+            continue;
+        }
+        MempoolLoadEntry entry;
+        memcpy(entry.txid.begin(), pPayload, 32);
+        entry.nTime = ReadLE64(pPayload + 32);
+        entry.nFeeDelta = ReadLE64(pPayload + 40);
+        entry.nCountWithAncestors = ReadLE64(pPayload + 48);
+        entry.pTxBegin = pPayload + MEMPOOL_RECORD_FIXED_SIZE;
+        entry.pTxEnd = pPayloadEnd;
+        if (entry.nTime <= nExpiry) {
+            ++skipped;
+            ++nMempoolLoadDone;
+        } else {
+            vEntries.push_back(entry);
+        }
+    }
+    try {
+        CDataStream ss((const char*)p, (const char*)file.end(), SER_DISK, CLIENT_VERSION);
+        ss >> mapDeltas;
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+/** Deserialize the unexpired transactions of a version 1 file and the trailing fee deltas */
+bool ReadMempoolRecordsV1(const CMappedFile& file, int64_t nExpiry, std::vector<MempoolLoadEntry>& vEntries, std::map<uint256, CAmount>& mapDeltas, int64_t& skipped)
+{
+    try {
+        CDataStream ss((const char*)file.begin() + 8, (const char*)file.end(), SER_DISK, CLIENT_VERSION);
+        uint64_t num;
+        ss >> num;
+        nMempoolLoadTotal = num;
+        for (; num > 0; num--) {
+            MempoolLoadEntry entry;
+            ss >> entry.tx;
+            ss >> entry.nTime;
+            ss >> entry.nFeeDelta;
+            if (entry.nTime <= nExpiry) {
+                ++skipped;
+                ++nMempoolLoadDone;
+                continue;
+            }
+            entry.txid = entry.tx->GetHash();
+            entry.pTxBegin = entry.pTxEnd = NULL;
+            // Written in depth-and-score order, which the stable sort keeps
+            entry.nCountWithAncestors = 0;
+            vEntries.push_back(std::move(entry));
+            if (ShutdownRequested())
+                return false;
+        }
+        ss >> mapDeltas;
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+} // anon namespace
+
+static bool LoadMempoolFromDisk()
 {
     int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
-    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
-    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
-    if (file.IsNull()) {
+    CMappedFile file(GetDataDir() / "mempool.dat");
+    if (file.IsNull() || file.size() < MEMPOOL_DUMP_HEADER_SIZE) {
         LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
         return false;
     }
@@ -4200,72 +4503,127 @@ bool LoadMempool(void)
     int64_t count = 0;
     int64_t skipped = 0;
     int64_t failed = 0;
-    int64_t nNow = GetTime();
+    int64_t nExpiry = GetTime() - nExpiryTimeout;
+    int64_t nStart = GetTimeMicros();
 
-    try {
-        uint64_t version;
-        file >> version;
-        if (version != MEMPOOL_DUMP_VERSION) {
+    std::vector<MempoolLoadEntry> vEntries;
+    std::map<uint256, CAmount> mapDeltas;
+    uint64_t nVersion = ReadLE64(file.begin());
+    if (nVersion == MEMPOOL_DUMP_VERSION) {
+        if (!ReadMempoolRecords(file, nExpiry, vEntries, mapDeltas, skipped, failed))
             return false;
+    } else if (nVersion == MEMPOOL_DUMP_VERSION_1) {
+        if (!ReadMempoolRecordsV1(file, nExpiry, vEntries, mapDeltas, skipped))
+            return false;
+    } else {
+        return false;
+    }
+
+    // Transactions confirmed since the dump will not be accepted again. Look
+    // them up a batch at a time, so that block processing is not held up.
+    std::vector<MempoolLoadEntry> vEntriesLeft;
+    vEntriesLeft.reserve(vEntries.size());
+    for (auto itBatch = vEntries.begin(); itBatch != vEntries.end(); ) {
+        auto itBatchEnd = itBatch + std::min<size_t>(MEMPOOL_LOAD_BATCH_SIZE, vEntries.end() - itBatch);
+        LOCK(cs_main);
+        for (; itBatch != itBatchEnd; ++itBatch) {
+            if (pcoinsTip->HaveCoins(itBatch->txid)) {
+                ++skipped;
+                ++nMempoolLoadDone;
+            } else {
+                vEntriesLeft.push_back(std::move(*itBatch));
+            }
         }
-        uint64_t num;
-        file >> num;
-        double prioritydummy = 0;
-        while (num--) {
-            CTransactionRef tx;
-            int64_t nTime;
-            int64_t nFeeDelta;
-            file >> tx;
-            file >> nTime;
-            file >> nFeeDelta;
-
-            CAmount amountdelta = nFeeDelta;
+    }
+    vEntries.swap(vEntriesLeft);
+    vEntriesLeft.clear();
+
+    for (MempoolLoadEntry& entry : vEntries) {
+        if (!entry.tx) {
+            try {
+                CDataStream ss((const char*)entry.pTxBegin, (const char*)entry.pTxEnd, SER_DISK, CLIENT_VERSION);
+                CMutableTransaction mtx(deserialize, ss);
+                entry.tx = std::make_shared<const CTransaction>(std::move(mtx), entry.txid);
+            } catch (const std::exception&) {
+                ++failed;
+                ++nMempoolLoadDone;
+                continue;
+            }
+        }
+        vEntriesLeft.push_back(std::move(entry));
+        if (ShutdownRequested())
+            return false;
+    }
+    vEntries.swap(vEntriesLeft);
+    // Parents have fewer ancestors than their children
+    std::stable_sort(vEntries.begin(), vEntries.end(), [](const MempoolLoadEntry& a, const MempoolLoadEntry& b) {
+        return a.nCountWithAncestors < b.nCountWithAncestors;
+    });
+
+    // Accept the transactions in batches, verifying the scripts of each batch
+    // in parallel first, so that cs_main is only held for the cheap part.
+    double prioritydummy = 0;
+    for (auto itBatch = vEntries.begin(); itBatch != vEntries.end(); ) {
+        auto itBatchEnd = itBatch + std::min<size_t>(MEMPOOL_LOAD_BATCH_SIZE, vEntries.end() - itBatch);
+        std::vector<CTransactionRef> vBatch;
+        for (auto it = itBatch; it != itBatchEnd; ++it)
+            vBatch.push_back(it->tx);
+        WarmSignatureCache(vBatch);
+
+        for (; itBatch != itBatchEnd; ++itBatch) {
+            const MempoolLoadEntry& entry = *itBatch;
+            CAmount amountdelta = entry.nFeeDelta;
             if (amountdelta) {
-                mempool.PrioritiseTransaction(tx->GetHash(), tx->GetHash().ToString(), prioritydummy, amountdelta);
+                mempool.PrioritiseTransaction(entry.tx->GetHash(), entry.tx->GetHash().ToString(), prioritydummy, amountdelta);
             }
             CValidationState state;
-            if (nTime + nExpiryTimeout > nNow) {
+            {
                 LOCK(cs_main);
-                AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime);
-                if (state.IsValid()) {
-                    ++count;
-                } else {
-                    ++failed;
-                }
+                AcceptToMemoryPoolWithTime(mempool, state, entry.tx, true, NULL, entry.nTime);
+            }
+            if (state.IsValid()) {
+                ++count;
             } else {
-                ++skipped;
+                ++failed;
             }
-            if (ShutdownRequested())
-                return false;
+            ++nMempoolLoadDone;
         }
-        std::map<uint256, CAmount> mapDeltas;
-        file >> mapDeltas;
+        if (ShutdownRequested())
+            return false;
+    }
 
-        for (const auto& i : mapDeltas) {
-            mempool.PrioritiseTransaction(i.first, i.first.ToString(), prioritydummy, i.second);
-        }
-    } catch (const std::exception& e) {
-        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
-        return false;
+    for (const auto& i : mapDeltas) {
+        mempool.PrioritiseTransaction(i.first, i.first.ToString(), prioritydummy, i.second);
     }
 
-    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired\n", count, failed, skipped);
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired or confirmed (%.2fs)\n", count, failed, skipped, (GetTimeMicros() - nStart) * 0.000001);
     return true;
 }
 
+bool LoadMempool(void)
+{
+    bool fRet = LoadMempoolFromDisk();
+    fMempoolLoaded = true;
+    return fRet;
+}
+
 void DumpMempool(void)
 {
+    // Periodic dumps run on the scheduler thread, the last one at shutdown
+    static CCriticalSection cs_dump;
+    LOCK(cs_dump);
+
     int64_t start = GetTimeMicros();
 
     std::map<uint256, CAmount> mapDeltas;
-    std::vector<TxMempoolInfo> vinfo;
+    CTxMemPoolSnapshotRef snapshot;
 
     {
         LOCK(mempool.cs);
         for (const auto &i : mempool.mapDeltas) {
             mapDeltas[i.first] = i.second.second;
         }
-        vinfo = mempool.infoAll();
+        snapshot = mempool.GetSnapshot();
     }
 
     int64_t mid = GetTimeMicros();
@@ -4281,12 +4639,20 @@ void DumpMempool(void)
         uint64_t version = MEMPOOL_DUMP_VERSION;
         file << version;
 
-        file << (uint64_t)vinfo.size();
-        for (const auto& i : vinfo) {
-            file << *(i.tx);
-            file << (int64_t)i.nTime;
-            file << (int64_t)i.nFeeDelta;
-            mapDeltas.erase(i.tx->GetHash());
+        file << (uint64_t)snapshot->vEntries.size();
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        for (const CTxMemPoolEntry& e : snapshot->vEntries) {
+            ss.clear();
+            ss << e.GetTx().GetHash();
+            ss << (int64_t)e.GetTime();
+            ss << (int64_t)(e.GetModifiedFee() - e.GetFee());
+            ss << (uint64_t)e.GetCountWithAncestors();
+            assert(ss.size() == MEMPOOL_RECORD_FIXED_SIZE);
+            ss << e.GetTx();
+            file << (uint32_t)ss.size();
+            file.write(ss.data(), ss.size());
+            file << CSipHasher(MEMPOOL_RECORD_CHECKSUM_K0, MEMPOOL_RECORD_CHECKSUM_K1).Write((const unsigned char*)ss.data(), ss.size()).Finalize();
+            mapDeltas.erase(e.GetTx().GetHash());
         }
 
         file << mapDeltas;
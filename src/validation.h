@@ -20,6 +20,7 @@
 
 #include <algorithm>
 #include <exception>
+#include <functional>
 #include <map>
 #include <set>
 #include <stdint.h>
@@ -71,6 +72,10 @@ static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 336;
+/** Default for -dumpmempoolinterval, minutes between dumps of the mempool to disk, 0 for only at shutdown */
+static const unsigned int DEFAULT_DUMP_MEMPOOL_INTERVAL = 0;
+/** Number of transactions from mempool.dat whose scripts are verified together before they are accepted */
+static const unsigned int MEMPOOL_LOAD_BATCH_SIZE = 1000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -82,8 +87,17 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer, until its
+ *  block delivery rate is known. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds on the number of blocks in flight from a single peer once its delivery rate is known. */
+static const int MIN_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 4;
+static const int MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 64;
+/** Amount of download time (in microseconds) worth of blocks to keep requested from each peer. */
+static const int64_t BLOCK_DOWNLOAD_TARGET_BACKLOG = 4 * 1000000;
+/** How many times slower than another idle peer a peer must be delivering blocks before the block
+ *  it holds up the download window with is requested from the faster peer instead. */
+static const int BLOCK_DOWNLOAD_SLOW_PEER_RATIO = 4;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -267,6 +281,14 @@ bool LoadBlockIndex(const CChainParams& chainparams);
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/**
+ * Verify the input scripts of a batch of transactions on the script checking
+ * threads, without holding cs_main while doing so, to fill the signature cache
+ * ahead of AcceptToMemoryPool. Transactions that AcceptToMemoryPool would
+ * reject before verifying scripts are skipped, as are those fnSkip (called
+ * with cs_main held) returns true for. Gives way to block validation.
+ */
+void WarmSignatureCache(const std::vector<CTransactionRef>& vtx, const std::function<bool(const CTransaction&)>& fnSkip = nullptr);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -454,6 +476,9 @@ public:
     CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
 
@@ -476,6 +501,12 @@ public:
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, int nHeight, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/**
+ * Read a block that is already in the block index, checking it against the
+ * indexed block hash instead of re-checking its proof of work. Takes the
+ * position and hash rather than the index entry, so it does not need cs_main.
+ */
+bool ReadIndexedBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const uint256& hashBlock);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -580,4 +611,10 @@ void DumpMempool();
 /** Load the mempool from disk. */
 bool LoadMempool();
 
+/** Whether LoadMempool has finished, successfully or not. */
+bool IsMempoolLoaded();
+
+/** Fraction of the mempool file processed by LoadMempool so far, 1 once it has finished. */
+double GetMempoolLoadProgress();
+
 #endif // BITCOIN_VALIDATION_H
@@ -5,11 +5,14 @@
 #include "crypter.h"
 
 #include "crypto/aes.h"
+#include "crypto/sha256.h"
 #include "crypto/sha512.h"
+#include "random.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "util.h"
 
+#include <atomic>
 #include <string>
 #include <vector>
 #include <boost/foreach.hpp>
@@ -162,12 +165,15 @@ bool CCryptoKeyStore::Lock()
     {
         LOCK(cs_KeyStore);
         vMasterKey.clear();
+        ClearUnlockPassphrase();
     }
 
     NotifyStatusChanged(this);
     return true;
 }
 
+typedef std::pair<CPubKey, std::vector<unsigned char> > CryptedKey;
+
 bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
 {
     {
@@ -175,23 +181,31 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
         if (!SetCrypted())
             return false;
 
-        bool keyPass = false;
-        bool keyFail = false;
-        CryptedKeyMap::const_iterator mi = mapCryptedKeys.begin();
-        for (; mi != mapCryptedKeys.end(); ++mi)
+        // Check the first key only once the wallet is known to be consistent,
+        // otherwise decrypt every key, spread over several threads
+        std::vector<const CryptedKey*> vKeys;
+        vKeys.reserve(fDecryptionThoroughlyChecked ? 1 : mapCryptedKeys.size());
+        for (CryptedKeyMap::const_iterator mi = mapCryptedKeys.begin(); mi != mapCryptedKeys.end(); ++mi)
         {
-            const CPubKey &vchPubKey = (*mi).second.first;
-            const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
-            CKey key;
-            if (!DecryptKey(vMasterKeyIn, vchCryptedSecret, vchPubKey, key))
-            {
-                keyFail = true;
-                break;
-            }
-            keyPass = true;
+            vKeys.push_back(&mi->second);
             if (fDecryptionThoroughlyChecked)
                 break;
         }
+
+        std::atomic<size_t> nPass(0);
+        std::atomic<bool> fFail(false);
+        ParallelFor(vKeys.size(), [&](size_t i) {
+            if (fFail)
+                return;
+            CKey key;
+            if (DecryptKey(vMasterKeyIn, vKeys[i]->second, vKeys[i]->first, key))
+                ++nPass;
+            else
+                fFail = true;
+        });
+
+        bool keyPass = nPass > 0;
+        bool keyFail = fFail;
         if (keyPass && keyFail)
         {
             LogPrintf("The wallet is probably corrupted: Some keys decrypt but not all.\n");
@@ -200,12 +214,52 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
         if (keyFail || !keyPass)
             return false;
         vMasterKey = vMasterKeyIn;
+        ClearUnlockPassphrase();
         fDecryptionThoroughlyChecked = true;
     }
     NotifyStatusChanged(this);
     return true;
 }
 
+static void HashUnlockPassphrase(const CKeyingMaterial& vchSalt, const SecureString& strPassphrase, CKeyingMaterial& vchHash)
+{
+    vchHash.resize(CSHA256::OUTPUT_SIZE);
+    CSHA256().Write(vchSalt.data(), vchSalt.size()).Write((const unsigned char*)strPassphrase.data(), strPassphrase.size()).Finalize(vchHash.data());
+}
+
+void CCryptoKeyStore::ClearUnlockPassphrase()
+{
+    memory_cleanse(vchUnlockSalt.data(), vchUnlockSalt.size());
+    memory_cleanse(vchUnlockPassphraseHash.data(), vchUnlockPassphraseHash.size());
+    vchUnlockSalt.clear();
+    vchUnlockPassphraseHash.clear();
+}
+
+void CCryptoKeyStore::SetUnlockPassphrase(const SecureString& strPassphrase)
+{
+    LOCK(cs_KeyStore);
+    if (vMasterKey.empty())
+        return;
+    vchUnlockSalt.resize(32);
+    GetStrongRandBytes(vchUnlockSalt.data(), vchUnlockSalt.size());
+    HashUnlockPassphrase(vchUnlockSalt, strPassphrase, vchUnlockPassphraseHash);
+}
+
+bool CCryptoKeyStore::IsUnlockedWith(const SecureString& strPassphrase) const
+{
+    LOCK(cs_KeyStore);
+    if (vMasterKey.empty() || vchUnlockPassphraseHash.empty())
+        return false;
+    CKeyingMaterial vchHash;
+    HashUnlockPassphrase(vchUnlockSalt, strPassphrase, vchHash);
+    // Compare without an early exit so the timing does not leak the match length
+    unsigned char nDiff = 0;
+    for (size_t i = 0; i < vchHash.size(); i++)
+        nDiff |= vchHash[i] ^ vchUnlockPassphraseHash[i];
+    memory_cleanse(vchHash.data(), vchHash.size());
+    return nDiff == 0;
+}
+
 bool CCryptoKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
 {
     {
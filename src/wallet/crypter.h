@@ -8,8 +8,7 @@
 #include "keystore.h"
 #include "serialize.h"
 #include "support/allocators/secure.h"
-
-class uint256;
+#include "uint256.h"
 
 const unsigned int WALLET_CRYPTO_KEY_SIZE = 32;
 const unsigned int WALLET_CRYPTO_SALT_SIZE = 8;
@@ -126,6 +125,14 @@ private:
     //! keeps track of whether Unlock has run a thorough check before
     bool fDecryptionThoroughlyChecked;
 
+    //! salted hash of the passphrase vMasterKey was unlocked with, held in
+    //! locked memory and wiped together with vMasterKey
+    CKeyingMaterial vchUnlockSalt;
+    CKeyingMaterial vchUnlockPassphraseHash;
+
+    //! Wipe the cached passphrase hash (cs_KeyStore must be held)
+    void ClearUnlockPassphrase();
+
 protected:
     bool SetCrypted();
 
@@ -134,6 +141,11 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
+    //! Remember the passphrase the store was just unlocked with (see IsUnlockedWith)
+    void SetUnlockPassphrase(const SecureString& strPassphrase);
+    //! Whether the store is unlocked and was unlocked with this passphrase
+    bool IsUnlockedWith(const SecureString& strPassphrase) const;
+
 public:
     CCryptoKeyStore() : fUseCrypto(false), fDecryptionThoroughlyChecked(false)
     {
@@ -93,7 +93,11 @@ bool CDBEnv::Open(const boost::filesystem::path& pathIn)
     dbenv->set_lk_max_objects(40000);
     dbenv->set_errfile(fopen(pathErrorFile.string().c_str(), "a")); /// debug
     dbenv->set_flags(DB_AUTO_COMMIT, 1);
-    dbenv->set_flags(DB_TXN_WRITE_NOSYNC, 1);
+    std::string strSync = GetArg("-walletdbsync", DEFAULT_WALLET_DBSYNC);
+    if (strSync == "none")
+        dbenv->set_flags(DB_TXN_NOSYNC, 1);
+    else if (strSync != "full")
+        dbenv->set_flags(DB_TXN_WRITE_NOSYNC, 1);
     dbenv->log_set_config(DB_LOG_AUTO_REMOVE, 1);
     int ret = dbenv->open(strPath.c_str(),
                          DB_CREATE |
@@ -22,6 +22,8 @@
 
 static const unsigned int DEFAULT_WALLET_DBLOGSIZE = 100;
 static const bool DEFAULT_WALLET_PRIVDB = true;
+//! -walletdbsync: "full" syncs every commit to disk, "os" hands the log to the OS, "none" leaves it in memory
+static const char* const DEFAULT_WALLET_DBSYNC = "os";
 
 class CDBEnv
 {
@@ -75,7 +77,7 @@ public:
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
-    DbTxn* TxnBegin(int flags = DB_TXN_WRITE_NOSYNC)
+    DbTxn* TxnBegin(int flags = 0) // durability follows -walletdbsync
     {
         DbTxn* ptxn = NULL;
         int ret = dbenv->txn_begin(NULL, &ptxn, flags);
@@ -991,6 +991,107 @@ UniValue sendmany(const JSONRPCRequest& request)
     return wtx.GetHash().GetHex();
 }
 
+UniValue sendbatch(const JSONRPCRequest& request)
+{
+    if (!EnsureWalletIsAvailable(request.fHelp))
+        return NullUniValue;
+
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 3)
+        throw runtime_error(
+            "sendbatch {\"address\":amount,...} ( maxoutputs \"comment\" )\n"
+            "\nPay many recipients at once, split over as many transactions as needed. Coins are selected\n"
+            "once for the whole batch and no coin is spent twice. The wallet pays all fees.\n"
+            "Amounts are double-precision floating point numbers."
+            + HelpRequiringPassphrase() + "\n"
+            "\nArguments:\n"
+            "1. \"amounts\"             (string, required) A json object with addresses and amounts\n"
+            "    {\n"
+            "      \"address\":amount   (numeric or string) The umrcoin address is the key, the numeric amount (can be string) in " + CURRENCY_UNIT + " is the value\n"
+            "      ,...\n"
+            "    }\n"
+            "2. maxoutputs              (numeric, optional, default=" + strprintf("%u", DEFAULT_BATCH_MAX_OUTPUTS) + ") The most recipients paid by one transaction\n"
+            "3. \"comment\"             (string, optional) A comment stored with every transaction\n"
+            "\nResult:\n"
+            "[                          (json array of string)\n"
+            "  \"txid\"                 (string) The transaction ids, in the order of the recipients they pay\n"
+            "  ,...\n"
+            "]\n"
+            "If a transaction fails to commit, none after it are sent, and the error object lists the\n"
+            "transactions committed before it in a \"txids\" array.\n"
+            "\nExamples:\n"
+            "\nPay two addresses:\n"
+            + HelpExampleCli("sendbatch", "\"{\\\"LEr4hNAefWYhBMgxCFP2Po1NPrUeiK8kM2\\\":0.01,\\\"LbhhnrHHVFP1eUjP1tdNIYeEVsNHfN9FCw\\\":0.02}\"") +
+            "\nPay them in separate transactions, with a comment:\n"
+            + HelpExampleCli("sendbatch", "\"{\\\"LEr4hNAefWYhBMgxCFP2Po1NPrUeiK8kM2\\\":0.01,\\\"LbhhnrHHVFP1eUjP1tdNIYeEVsNHfN9FCw\\\":0.02}\" 1 \"payouts\"") +
+            "\nAs a json rpc call\n"
+            + HelpExampleRpc("sendbatch", "\"{\\\"LEr4hNAefWYhBMgxCFP2Po1NPrUeiK8kM2\\\":0.01,\\\"LbhhnrHHVFP1eUjP1tdNIYeEVsNHfN9FCw\\\":0.02}\", 1, \"payouts\"")
+        );
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    if (pwalletMain->GetBroadcastTransactions() && !g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    UniValue sendTo = request.params[0].get_obj();
+    int nMaxOutputs = DEFAULT_BATCH_MAX_OUTPUTS;
+    if (request.params.size() > 1 && !request.params[1].isNull())
+        nMaxOutputs = request.params[1].get_int();
+    if (nMaxOutputs < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, maxoutputs must be at least 1");
+    string strComment;
+    if (request.params.size() > 2 && !request.params[2].isNull())
+        strComment = request.params[2].get_str();
+
+    set<CBitcoinAddress> setAddress;
+    vector<CRecipient> vecSend;
+
+    vector<string> keys = sendTo.getKeys();
+    BOOST_FOREACH(const string& name_, keys)
+    {
+        CBitcoinAddress address(name_);
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("Invalid UMRcoin address: ")+name_);
+
+        if (setAddress.count(address))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, string("Invalid parameter, duplicated address: ")+name_);
+        setAddress.insert(address);
+
+        CScript scriptPubKey = GetScriptForDestination(address.Get());
+        CAmount nAmount = AmountFromValue(sendTo[name_]);
+        if (nAmount <= 0)
+            throw JSONRPCError(RPC_TYPE_ERROR, "Invalid amount for send");
+
+        CRecipient recipient = {scriptPubKey, nAmount, false};
+        vecSend.push_back(recipient);
+    }
+
+    EnsureWalletIsUnlocked();
+
+    vector<CWalletTx> vwtx;
+    vector<std::unique_ptr<CReserveKey> > vKeyChange;
+    string strFailReason;
+    if (!pwalletMain->CreateTransactions(vecSend, nMaxOutputs, vwtx, vKeyChange, strFailReason))
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, strFailReason);
+
+    UniValue result(UniValue::VARR);
+    for (unsigned int i = 0; i < vwtx.size(); i++)
+    {
+        if (!strComment.empty())
+            vwtx[i].mapValue["comment"] = strComment;
+        CValidationState state;
+        if (!pwalletMain->CommitTransaction(vwtx[i], *vKeyChange[i], g_connman.get(), state)) {
+            strFailReason = strprintf("Transaction commit failed after %u of %u transactions: %s", i, vwtx.size(), state.GetRejectReason());
+            // Those already committed are in the wallet and may be relayed
+            UniValue error = JSONRPCError(RPC_WALLET_ERROR, strFailReason);
+            error.pushKV("txids", result);
+            throw error;
+        }
+        result.push_back(vwtx[i].GetHash().GetHex());
+    }
+
+    return result;
+}
+
 // Defined in rpc/misc.cpp
 extern CScript _createmultisig_redeemScript(const UniValue& params);
 
@@ -1734,17 +1835,10 @@ UniValue listsinceblock(const JSONRPCRequest& request)
         filter = filter | ISMINE_WATCH_ONLY;
     }
 
-    int depth = pindex ? (1 + chainActive.Height() - pindex->nHeight) : -1;
-
     UniValue transactions(UniValue::VARR);
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
-    {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions, filter);
-    }
+    BOOST_FOREACH(const CWalletTx* pwtx, pwalletMain->GetTxsSinceBlock(pindex))
+        ListTransactions(*pwtx, "*", 0, true, transactions, filter);
 
     CBlockIndex *pblockLast = chainActive[chainActive.Height() + 1 - target_confirms];
     uint256 lastblock = pblockLast ? pblockLast->GetBlockHash() : uint256();
@@ -2335,6 +2429,11 @@ UniValue getwalletinfo(const JSONRPCRequest& request)
             "  \"unlocked_until\": ttt,        (numeric) the timestamp in seconds since epoch (midnight Jan 1 1970 GMT) that the wallet is unlocked for transfers, or 0 if the wallet is locked\n"
             "  \"paytxfee\": x.xxxx,           (numeric) the transaction fee configuration, set in " + CURRENCY_UNIT + "/kB\n"
             "  \"hdmasterkeyid\": \"<hash160>\" (string) the Hash160 of the HD master pubkey\n"
+            "  \"scanning\":                  (json object) current scanning details, or false if no scan is in progress\n"
+            "    {\n"
+            "      \"duration\" : xxxx          (numeric) elapsed seconds since scan start\n"
+            "      \"progress\" : x.xxxx,       (numeric) scanning progress percentage [0.0, 1.0]\n"
+            "    }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getwalletinfo", "")
@@ -2357,6 +2456,14 @@ UniValue getwalletinfo(const JSONRPCRequest& request)
     CKeyID masterKeyID = pwalletMain->GetHDChain().masterKeyID;
     if (!masterKeyID.IsNull())
          obj.push_back(Pair("hdmasterkeyid", masterKeyID.GetHex()));
+    if (pwalletMain->IsScanning()) {
+        UniValue scanning(UniValue::VOBJ);
+        scanning.push_back(Pair("duration", pwalletMain->ScanningDuration() / 1000));
+        scanning.push_back(Pair("progress", pwalletMain->ScanningProgress()));
+        obj.push_back(Pair("scanning", scanning));
+    } else {
+        obj.push_back(Pair("scanning", false));
+    }
     return obj;
 }
 
@@ -2993,6 +3100,7 @@ extern UniValue importwallet(const JSONRPCRequest& request);
 extern UniValue importprunedfunds(const JSONRPCRequest& request);
 extern UniValue removeprunedfunds(const JSONRPCRequest& request);
 extern UniValue importmulti(const JSONRPCRequest& request);
+extern UniValue abortrescan(const JSONRPCRequest& request);
 
 static const CRPCCommand commands[] =
 { //  category              name                        actor (function)           okSafeMode
@@ -3000,6 +3108,7 @@ static const CRPCCommand commands[] =
     { "rawtransactions",    "fundrawtransaction",       &fundrawtransaction,       false,  {"hexstring","options"} },
     { "hidden",             "resendwallettransactions", &resendwallettransactions, true,   {} },
     { "wallet",             "abandontransaction",       &abandontransaction,       false,  {"txid"} },
+    { "wallet",             "abortrescan",              &abortrescan,              false,  {} },
     { "wallet",             "addmultisigaddress",       &addmultisigaddress,       true,   {"nrequired","keys","account"} },
     { "wallet",             "addwitnessaddress",        &addwitnessaddress,        true,   {"address"} },
     { "wallet",             "backupwallet",             &backupwallet,             true,   {"destination"} },
@@ -3035,6 +3144,7 @@ static const CRPCCommand commands[] =
     { "wallet",             "listunspent",              &listunspent,              false,  {"minconf","maxconf","addresses","include_unsafe"} },
     { "wallet",             "lockunspent",              &lockunspent,              true,   {"unlock","transactions"} },
     { "wallet",             "move",                     &movecmd,                  false,  {"fromaccount","toaccount","amount","minconf","comment"} },
+    { "wallet",             "sendbatch",                &sendbatch,                false,  {"amounts","maxoutputs","comment"} },
     { "wallet",             "sendfrom",                 &sendfrom,                 false,  {"fromaccount","toaddress","amount","minconf","comment","comment_to"} },
     { "wallet",             "sendmany",                 &sendmany,                 false,  {"fromaccount","amounts","minconf","comment","subtractfeefrom"} },
     { "wallet",             "sendtoaddress",            &sendtoaddress,            false,  {"address","amount","comment","comment_to","subtractfeefromamount"} },
@@ -9,6 +9,9 @@
 #include <utility>
 #include <vector>
 
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "policy/policy.h"
 #include "rpc/server.h"
 #include "test/test_bitcoin.h"
 #include "validation.h"
@@ -280,7 +283,12 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
              for (uint16_t j = 0; j < 676; j++)
                  add_coin(amt);
              BOOST_CHECK(wallet.SelectCoinsMinConf(2000, 1, 1, 0, vCoins, setCoinsRet, nValueRet));
-             if (amt - 2000 < MIN_CHANGE) {
+             uint16_t nNoChangeSize = std::ceil(2000.0/amt);
+             if (amt * nNoChangeSize - 2000 <= CTxOut(0, GetScriptForDestination(CKeyID())).GetDustThreshold(dustRelayFee) / 3) {
+                 // the excess is below the cost of change, so none is needed:
+                 BOOST_CHECK_EQUAL(nValueRet, amt * nNoChangeSize);
+                 BOOST_CHECK_EQUAL(setCoinsRet.size(), nNoChangeSize);
+             } else if (amt - 2000 < MIN_CHANGE) {
                  // needs more than one input:
                  uint16_t returnSize = std::ceil((2000.0 + MIN_CHANGE)/amt);
                  CAmount returnValue = amt * returnSize;
@@ -363,6 +371,416 @@ BOOST_AUTO_TEST_CASE(ApproximateBestSubset)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(branch_and_bound)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    empty_wallet();
+
+    // An excess below the change dust threshold needs no change output and
+    // beats spending the larger coin
+    add_coin(7 * CENT);
+    add_coin(3 * CENT);
+    add_coin(2 * CENT);
+    add_coin(1 * CENT + 10000);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(4 * CENT + 100, 1, 6, 0, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 4 * CENT + 10000);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+    // Otherwise the knapsack solver still leaves room for sizeable change
+    BOOST_CHECK(wallet.SelectCoinsMinConf(4 * CENT - 2 * MIN_CHANGE / 10, 1, 6, 0, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 5 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+    empty_wallet();
+
+    // Many identical coins are searched without revisiting equivalent sets
+    for (int i = 0; i < 20000; i++)
+        add_coin(1 * CENT);
+    add_coin(MIN_CHANGE / 10);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(50 * CENT + MIN_CHANGE / 10, 1, 6, 0, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 50 * CENT + MIN_CHANGE / 10);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 51U);
+
+    empty_wallet();
+}
+
+/** P2PKH script pushing the key hash with OP_PUSHDATA1, which Solver still accepts */
+static CScript GetNonMinimalP2PKH(const CKeyID& keyID)
+{
+    CScript script;
+    script << OP_DUP << OP_HASH160 << OP_PUSHDATA1;
+    script.insert(script.end(), (unsigned char)keyID.size());
+    script.insert(script.end(), keyID.begin(), keyID.end());
+    script << OP_EQUALVERIFY << OP_CHECKSIG;
+    return script;
+}
+
+BOOST_AUTO_TEST_CASE(ismine_script_set)
+{
+    CWallet wallet;
+    LOCK(wallet.cs_wallet);
+
+    CKey key, other, uncompressed;
+    key.MakeNewKey(true);
+    other.MakeNewKey(true);
+    uncompressed.MakeNewKey(false);
+    CPubKey pubkey = key.GetPubKey();
+    CScript witness = GetScriptForWitness(GetScriptForDestination(pubkey.GetID()));
+    CScript watched = GetScriptForDestination(other.GetPubKey().GetID());
+    CScript multisig = GetScriptForMultisig(1, {key.GetPubKey(), uncompressed.GetPubKey()});
+
+    wallet.AddKeyPubKey(key, pubkey);
+    wallet.AddCScript(witness);
+    wallet.AddWatchOnly(watched, 0);
+
+    std::vector<CScript> vScripts = {
+        GetScriptForRawPubKey(pubkey),
+        GetScriptForDestination(pubkey.GetID()),
+        GetScriptForDestination(CScriptID(witness)),
+        witness,
+        watched,
+        multisig,
+        GetScriptForRawPubKey(other.GetPubKey()),
+        GetScriptForDestination(CScriptID(watched)),
+        GetScriptForDestination(uncompressed.GetPubKey().GetID()),
+        GetNonMinimalP2PKH(pubkey.GetID()),
+        GetNonMinimalP2PKH(other.GetPubKey().GetID()),
+        CScript() << OP_RETURN,
+    };
+    // The script set must never change the outcome, only the cost
+    for (const CScript& script : vScripts) {
+        BOOST_CHECK_EQUAL(wallet.IsMine(CTxOut(1, script)), ::IsMine(wallet, script));
+    }
+    BOOST_CHECK(!wallet.MayBeMine(GetScriptForRawPubKey(other.GetPubKey())));
+    BOOST_CHECK(!wallet.MayBeMine(GetScriptForDestination(uncompressed.GetPubKey().GetID())));
+    BOOST_CHECK(wallet.MayBeMine(multisig));
+    BOOST_CHECK_EQUAL(wallet.IsMine(CTxOut(1, GetNonMinimalP2PKH(pubkey.GetID()))), ISMINE_SPENDABLE);
+
+    // A payment to a non-minimal P2PKH of ours is still picked up
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.push_back(CTxOut(1, GetNonMinimalP2PKH(pubkey.GetID())));
+    BOOST_CHECK(wallet.IsMine(CTransaction(tx)));
+    BOOST_CHECK_EQUAL(wallet.GetCredit(CTransaction(tx), ISMINE_SPENDABLE), 1);
+
+    // Keys loaded from disk or added later are picked up as well
+    wallet.LoadKey(uncompressed, uncompressed.GetPubKey());
+    BOOST_CHECK_EQUAL(wallet.IsMine(CTxOut(1, GetScriptForDestination(uncompressed.GetPubKey().GetID()))), ISMINE_SPENDABLE);
+    BOOST_CHECK_EQUAL(wallet.IsMine(CTxOut(1, multisig)), ISMINE_SPENDABLE);
+}
+
+BOOST_AUTO_TEST_CASE(scan_filter)
+{
+    CKey key, other;
+    key.MakeNewKey(true);
+    other.MakeNewKey(true);
+    CScript watched = GetScriptForDestination(other.GetPubKey().GetID());
+
+    CWalletScanFilter filter;
+    filter.AddScript(watched);
+    filter.AddKey(key.GetPubKey().GetID());
+
+    BOOST_CHECK(filter.MatchesOutput(CTxOut(1, watched)));
+    // Bare multisig matches on any of its keys
+    BOOST_CHECK(filter.MatchesOutput(CTxOut(1, GetScriptForMultisig(1, {other.GetPubKey(), key.GetPubKey()}))));
+    BOOST_CHECK(!filter.MatchesOutput(CTxOut(1, GetScriptForMultisig(1, {other.GetPubKey()}))));
+    // Key scripts with non-minimal pushes match on their key
+    BOOST_CHECK(filter.MatchesOutput(CTxOut(1, GetNonMinimalP2PKH(key.GetPubKey().GetID()))));
+    BOOST_CHECK(!filter.MatchesOutput(CTxOut(1, GetNonMinimalP2PKH(other.GetPubKey().GetID()))));
+    // Anything else only by exact script
+    BOOST_CHECK(!filter.MatchesOutput(CTxOut(1, GetScriptForRawPubKey(other.GetPubKey()))));
+    BOOST_CHECK(!filter.MatchesOutput(CTxOut(1, GetScriptForDestination(key.GetPubKey().GetID()))));
+
+    CMutableTransaction tx;
+    tx.vout.push_back(CTxOut(1, CScript() << OP_TRUE));
+    BOOST_CHECK(!filter.MatchesAnyOutput(tx));
+    tx.vout.push_back(CTxOut(1, watched));
+    BOOST_CHECK(filter.MatchesAnyOutput(tx));
+}
+
+BOOST_AUTO_TEST_CASE(unspent_index)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    pwalletMain->AddKeyPubKey(key, key.GetPubKey());
+    CScript script = GetScriptForDestination(key.GetPubKey().GetID());
+
+    // Unconfirmed payment to us from someone else
+    CMutableTransaction fund;
+    fund.vin.resize(1);
+    fund.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    fund.vout.push_back(CTxOut(5 * COIN, script));
+    fund.vout.push_back(CTxOut(3 * COIN, CScript() << OP_TRUE));
+    TestMemPoolEntryHelper entry;
+    mempool.addUnchecked(fund.GetHash(), entry.FromTx(fund));
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, MakeTransactionRef(fund))));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), 5 * COIN);
+
+    // Spending it drops the funding transaction from the balances
+    CMutableTransaction spend;
+    spend.vin.push_back(CTxIn(COutPoint(fund.GetHash(), 0)));
+    spend.vout.push_back(CTxOut(4 * COIN, CScript() << OP_TRUE));
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, MakeTransactionRef(spend))));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), 0);
+
+    // Abandoning the spender (never in the mempool) makes the output available again
+    BOOST_CHECK(pwalletMain->AbandonTransaction(spend.GetHash()));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), 5 * COIN);
+
+    // Same result after a full rebuild of the index
+    pwalletMain->MarkDirty();
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), 5 * COIN);
+
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(create_transactions)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    pwalletMain->AddKeyPubKey(key, key.GetPubKey());
+    CScript script = GetScriptForDestination(key.GetPubKey().GetID());
+
+    // Split a payment from elsewhere into coins the wallet trusts while
+    // still unconfirmed
+    CMutableTransaction fund;
+    fund.vin.resize(1);
+    fund.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    fund.vout.push_back(CTxOut(100 * COIN, script));
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, MakeTransactionRef(fund))));
+    CMutableTransaction split;
+    split.vin.push_back(CTxIn(COutPoint(fund.GetHash(), 0)));
+    for (int i = 0; i < 20; i++)
+        split.vout.push_back(CTxOut(4 * COIN, script));
+    TestMemPoolEntryHelper entry;
+    mempool.addUnchecked(split.GetHash(), entry.FromTx(split));
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, MakeTransactionRef(split))));
+
+    bool fWitness;
+    BOOST_CHECK_EQUAL(pwalletMain->EstimateSignedInputWeight(script, fWitness), (32 + 4 + 4 + 1 + 74 + 34) * WITNESS_SCALE_FACTOR);
+    BOOST_CHECK(!fWitness);
+    BOOST_CHECK_EQUAL(pwalletMain->EstimateSignedInputWeight(CScript() << OP_TRUE, fWitness), -1);
+
+    std::vector<CRecipient> vecSend;
+    for (int i = 0; i < 7; i++) {
+        CKey other;
+        other.MakeNewKey(true);
+        CRecipient recipient = {GetScriptForDestination(other.GetPubKey().GetID()), (i + 1) * COIN, false};
+        vecSend.push_back(recipient);
+    }
+
+    std::vector<CWalletTx> vwtx;
+    std::vector<std::unique_ptr<CReserveKey> > vReserveKeys;
+    std::string strFailReason;
+    BOOST_CHECK(pwalletMain->CreateTransactions(vecSend, 3, vwtx, vReserveKeys, strFailReason));
+    BOOST_CHECK_EQUAL(vwtx.size(), 3U);
+    BOOST_CHECK_EQUAL(vReserveKeys.size(), 3U);
+
+    std::set<COutPoint> setSpent;
+    size_t nRecipient = 0;
+    for (const CWalletTx& wtx : vwtx) {
+        const CTransaction& tx = *wtx.tx;
+        CAmount nValueIn = 0;
+        for (unsigned int n = 0; n < tx.vin.size(); n++) {
+            BOOST_CHECK(setSpent.insert(tx.vin[n].prevout).second);
+            BOOST_CHECK(tx.vin[n].prevout.hash == split.GetHash());
+            const CTxOut& prevout = split.vout[tx.vin[n].prevout.n];
+            nValueIn += prevout.nValue;
+            BOOST_CHECK(VerifyScript(tx.vin[n].scriptSig, prevout.scriptPubKey, &tx.vin[n].scriptWitness, STANDARD_SCRIPT_VERIFY_FLAGS,
+                                     TransactionSignatureChecker(&tx, n, prevout.nValue)));
+        }
+        // Recipients are paid in order, next to at most one change output
+        for (const CTxOut& txout : tx.vout) {
+            if (nRecipient < vecSend.size() && txout.scriptPubKey == vecSend[nRecipient].scriptPubKey) {
+                BOOST_CHECK_EQUAL(txout.nValue, vecSend[nRecipient].nAmount);
+                nRecipient++;
+            }
+        }
+        BOOST_CHECK(tx.vout.size() <= 4);
+        // The estimated size covers the signed transaction
+        CAmount nFee = nValueIn - tx.GetValueOut();
+        BOOST_CHECK(nFee >= CWallet::GetMinimumFee(GetVirtualTransactionSize(tx), nTxConfirmTarget, mempool));
+    }
+    BOOST_CHECK_EQUAL(nRecipient, vecSend.size());
+
+    // More than the wallet holds
+    vecSend[0].nAmount = 100 * COIN;
+    BOOST_CHECK(!pwalletMain->CreateTransactions(vecSend, 3, vwtx, vReserveKeys, strFailReason));
+    BOOST_CHECK_EQUAL(strFailReason, "Insufficient funds");
+
+    mempool.clear();
+}
+
+static size_t CountStoredTxs()
+{
+    std::vector<uint256> vTxHash;
+    std::vector<CWalletTx> vWtx;
+    CWalletDB(pwalletMain->strWalletFile).FindWalletTx(pwalletMain, vTxHash, vWtx);
+    return vTxHash.size();
+}
+
+BOOST_AUTO_TEST_CASE(queued_tx_writes)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    pwalletMain->AddKeyPubKey(key, key.GetPubKey());
+    CScript script = GetScriptForDestination(key.GetPubKey().GetID());
+
+    // A block of three transactions paying us
+    CBlockIndex index = *chainActive.Tip();
+    index.nTx = 3;
+    size_t nStored = CountStoredTxs();
+    for (int i = 0; i < 3; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.push_back(CTxOut(COIN, script));
+        pwalletMain->SyncTransaction(tx, &index, i);
+        BOOST_CHECK(pwalletMain->mapWallet.count(tx.GetHash()));
+        // Nothing reaches the database until the block's last transaction
+        BOOST_CHECK_EQUAL(CountStoredTxs(), nStored + (i == 2 ? 3 : 0));
+    }
+
+    // Outside a block every change is written at once
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.push_back(CTxOut(COIN, script));
+    pwalletMain->SyncTransaction(tx, NULL, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+    BOOST_CHECK_EQUAL(CountStoredTxs(), nStored + 4);
+}
+
+BOOST_AUTO_TEST_CASE(load_wallet_txs)
+{
+    bool fFirstRun;
+    CWallet wallet("wallet_load_test.dat");
+    BOOST_CHECK_EQUAL(wallet.LoadWallet(fFirstRun), DB_LOAD_OK);
+
+    // More transactions than one parsing batch, each spending the one before
+    std::vector<uint256> vHashes;
+    {
+        LOCK(wallet.cs_wallet);
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+        for (int i = 0; i < 2500; i++) {
+            BOOST_CHECK(wallet.AddToWallet(CWalletTx(&wallet, MakeTransactionRef(tx))));
+            vHashes.push_back(tx.GetHash());
+            tx.vin[0].prevout = COutPoint(tx.GetHash(), 0);
+        }
+    }
+
+    CWallet loaded("wallet_load_test.dat");
+    BOOST_CHECK_EQUAL(loaded.LoadWallet(fFirstRun), DB_LOAD_OK);
+
+    LOCK2(cs_main, loaded.cs_wallet);
+    BOOST_CHECK_EQUAL(loaded.mapWallet.size(), vHashes.size());
+    BOOST_CHECK_EQUAL(loaded.wtxOrdered.size(), vHashes.size());
+    for (size_t i = 0; i < vHashes.size(); i++) {
+        std::map<uint256, CWalletTx>::const_iterator it = loaded.mapWallet.find(vHashes[i]);
+        BOOST_REQUIRE(it != loaded.mapWallet.end());
+        BOOST_CHECK_EQUAL(it->second.nOrderPos, (int64_t)i);
+        BOOST_CHECK_EQUAL(loaded.IsSpent(vHashes[i], 0), i + 1 < vHashes.size());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(keypool_topup)
+{
+    bool fFirstRun;
+    CWallet wallet("wallet_keypool_test.dat");
+    BOOST_CHECK_EQUAL(wallet.LoadWallet(fFirstRun), DB_LOAD_OK);
+    CPubKey masterPubKey = wallet.GenerateNewHDMasterKey();
+    BOOST_CHECK(wallet.SetHDMasterKey(masterPubKey));
+
+    LOCK(wallet.cs_wallet);
+
+    // The same keys as deriving m/0'/0'/k one at a time
+    const uint32_t nHardened = 0x80000000;
+    CKey masterSeed;
+    BOOST_CHECK(wallet.GetKey(masterPubKey.GetID(), masterSeed));
+    CExtKey masterKey, accountKey, chainKey;
+    masterKey.SetMaster(masterSeed.begin(), masterSeed.size());
+    masterKey.Derive(accountKey, nHardened);
+    accountKey.Derive(chainKey, nHardened);
+    std::vector<CPubKey> vExpected;
+    for (unsigned int i = 0; i < 2503; i++) {
+        CExtKey childKey;
+        chainKey.Derive(childKey, i | nHardened);
+        vExpected.push_back(childKey.key.GetPubKey());
+        if (i == 2)
+            // Already known to the wallet, so skipped
+            BOOST_CHECK(wallet.AddKeyPubKey(childKey.key, vExpected.back()));
+    }
+    vExpected.erase(vExpected.begin() + 2);
+
+    // More keys than one batch
+    BOOST_CHECK(wallet.TopUpKeyPool(2500));
+    BOOST_CHECK_EQUAL(wallet.GetKeyPoolSize(), 2501U);
+    BOOST_CHECK_EQUAL(wallet.GetHDChain().nExternalChainCounter, 2502U);
+    CWalletDB walletdb(wallet.strWalletFile);
+    for (unsigned int i = 0; i < 2501; i++) {
+        CKeyPool keypool;
+        BOOST_REQUIRE(walletdb.ReadPool(i + 1, keypool));
+        BOOST_CHECK(keypool.vchPubKey == vExpected[i]);
+        BOOST_CHECK(wallet.HaveKey(vExpected[i].GetID()));
+    }
+    BOOST_CHECK_EQUAL(wallet.mapKeyMetadata[vExpected[3].GetID()].hdKeypath, "m/0'/0'/4'");
+}
+
+BOOST_AUTO_TEST_CASE(unlock_passphrase)
+{
+    bool fFirstRun;
+    CWallet wallet("wallet_unlock_test.dat");
+    BOOST_CHECK_EQUAL(wallet.LoadWallet(fFirstRun), DB_LOAD_OK);
+    {
+        LOCK(wallet.cs_wallet);
+        BOOST_CHECK(wallet.TopUpKeyPool(200));
+    }
+    SecureString strPass("first"), strNewPass("second");
+    BOOST_CHECK(wallet.EncryptWallet(strPass));
+    BOOST_CHECK(wallet.IsLocked());
+
+    BOOST_CHECK(!wallet.Unlock(strNewPass));
+    BOOST_CHECK(wallet.Unlock(strPass));
+    BOOST_CHECK(!wallet.IsLocked());
+    // Repeated unlocks are recognised, other passphrases still checked
+    BOOST_CHECK(wallet.Unlock(strPass));
+    BOOST_CHECK(!wallet.Unlock(strNewPass));
+
+    // A changed passphrase replaces the remembered one
+    BOOST_CHECK(wallet.ChangeWalletPassphrase(strPass, strNewPass));
+    BOOST_CHECK(!wallet.IsLocked());
+    BOOST_CHECK(!wallet.Unlock(strPass));
+    BOOST_CHECK(wallet.Unlock(strNewPass));
+    BOOST_CHECK(wallet.Lock());
+    BOOST_CHECK(!wallet.Unlock(strPass));
+    BOOST_CHECK(wallet.IsLocked());
+
+    // The first unlock after loading decrypts and checks every key
+    CWallet loaded("wallet_unlock_test.dat");
+    BOOST_CHECK_EQUAL(loaded.LoadWallet(fFirstRun), DB_LOAD_OK);
+    BOOST_CHECK(loaded.IsLocked());
+    BOOST_CHECK(loaded.Unlock(strNewPass));
+    LOCK(loaded.cs_wallet);
+    CPubKey pubkey;
+    BOOST_CHECK(loaded.GetKeyFromPool(pubkey));
+    CKey key;
+    BOOST_CHECK(loaded.GetKey(pubkey.GetID(), key));
+    BOOST_CHECK(key.VerifyPubKey(pubkey));
+}
+
 BOOST_FIXTURE_TEST_CASE(rescan, TestChain100Setup)
 {
     LOCK(cs_main);
@@ -379,7 +797,13 @@ BOOST_FIXTURE_TEST_CASE(rescan, TestChain100Setup)
         CWallet wallet;
         LOCK(wallet.cs_wallet);
         wallet.AddKeyPubKey(coinbaseKey, coinbaseKey.GetPubKey());
-        BOOST_CHECK_EQUAL(oldTip, wallet.ScanForWalletTransactions(oldTip));
+        CWalletRescanReserver reserver(&wallet);
+        BOOST_CHECK(reserver.Reserve());
+        CWalletRescanReserver reserverConcurrent(&wallet);
+        BOOST_CHECK(!reserverConcurrent.Reserve());
+        bool fMissingBlocks;
+        BOOST_CHECK_EQUAL(oldTip, wallet.ScanForWalletTransactions(oldTip, reserver, false, &fMissingBlocks));
+        BOOST_CHECK_EQUAL(fMissingBlocks, false);
         BOOST_CHECK_EQUAL(wallet.GetImmatureBalance(), 100 * COIN);
     }
 
@@ -393,7 +817,11 @@ BOOST_FIXTURE_TEST_CASE(rescan, TestChain100Setup)
         CWallet wallet;
         LOCK(wallet.cs_wallet);
         wallet.AddKeyPubKey(coinbaseKey, coinbaseKey.GetPubKey());
-        BOOST_CHECK_EQUAL(newTip, wallet.ScanForWalletTransactions(oldTip));
+        CWalletRescanReserver reserver(&wallet);
+        BOOST_CHECK(reserver.Reserve());
+        bool fMissingBlocks;
+        BOOST_CHECK_EQUAL(newTip, wallet.ScanForWalletTransactions(oldTip, reserver, false, &fMissingBlocks));
+        BOOST_CHECK_EQUAL(fMissingBlocks, true);
         BOOST_CHECK_EQUAL(wallet.GetImmatureBalance(), 50 * COIN);
     }
 
@@ -430,6 +858,56 @@ BOOST_FIXTURE_TEST_CASE(rescan, TestChain100Setup)
     }
 }
 
+BOOST_FIXTURE_TEST_CASE(txs_since_block, TestChain100Setup)
+{
+    bitdb.MakeMock();
+    bool fFirstRun;
+    CWallet wallet("wallet_since_test.dat");
+    BOOST_CHECK_EQUAL(wallet.LoadWallet(fFirstRun), DB_LOAD_OK);
+
+    LOCK2(cs_main, wallet.cs_wallet);
+    CScript script = GetScriptForRawPubKey(coinbaseKey.GetPubKey());
+    wallet.AddKeyPubKey(coinbaseKey, coinbaseKey.GetPubKey());
+
+    // One transaction paying us in each of the last five blocks, and one
+    // still unconfirmed
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 6; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.push_back(CTxOut(COIN, script));
+        const CBlockIndex* pindex = i < 5 ? chainActive[chainActive.Height() - 4 + i] : NULL;
+        wallet.SyncTransaction(tx, pindex, pindex ? 0 : CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+        vHashes.push_back(tx.GetHash());
+    }
+
+    // Only those in the last two blocks are newer than the third from the tip
+    std::vector<const CWalletTx*> vSince = wallet.GetTxsSinceBlock(chainActive[chainActive.Height() - 2]);
+    BOOST_CHECK_EQUAL(vSince.size(), 3U);
+    BOOST_CHECK(vSince[0]->GetHash() == vHashes[3]);
+    BOOST_CHECK(vSince[1]->GetHash() == vHashes[4]);
+    BOOST_CHECK(vSince[2]->GetHash() == vHashes[5]);
+    BOOST_CHECK_EQUAL(wallet.GetTxsSinceBlock(chainActive.Tip()).size(), 1U);
+    BOOST_CHECK_EQUAL(wallet.GetTxsSinceBlock(chainActive.Genesis()).size(), 6U);
+    BOOST_CHECK_EQUAL(wallet.GetTxsSinceBlock(NULL).size(), wallet.mapWallet.size());
+
+    // A transaction in a disconnected block no longer has any confirmations
+    CValidationState state;
+    CBlockIndex* pindexOldTip = chainActive.Tip();
+    BOOST_CHECK(InvalidateBlock(state, Params(), pindexOldTip));
+    BOOST_CHECK(chainActive.Tip() == pindexOldTip->pprev);
+    wallet.SyncTransaction(*wallet.mapWallet[vHashes[4]].tx, pindexOldTip->pprev, CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK);
+    vSince = wallet.GetTxsSinceBlock(chainActive.Tip());
+    BOOST_CHECK_EQUAL(vSince.size(), 2U);
+    BOOST_CHECK_EQUAL(wallet.GetTxsSinceBlock(chainActive[chainActive.Height() - 1]).size(), 3U);
+    BOOST_CHECK(ResetBlockFailureFlags(pindexOldTip));
+    BOOST_CHECK(ActivateBestChain(state, Params()));
+
+    bitdb.Flush(true);
+    bitdb.Reset();
+}
+
 // Verify importwallet RPC starts rescan at earliest block with timestamp
 // greater or equal than key birthday. Previously there was a bug where
 // importwallet RPC would start the scan at the latest block with timestamp less
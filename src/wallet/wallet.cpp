@@ -18,6 +18,7 @@
 #include "policy/policy.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
+#include "random.h"
 #include "script/script.h"
 #include "script/sign.h"
 #include "timedata.h"
@@ -89,98 +90,177 @@ const CWalletTx* CWallet::GetWalletTx(const uint256& hash) const
 
 CPubKey CWallet::GenerateNewKey()
 {
-    AssertLockHeld(cs_wallet); // mapKeyMetadata
-    bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+    AssertLockHeld(cs_wallet);
+    CWalletDB walletdb(strWalletFile);
+    std::vector<CPubKey> vPubKeys;
+    // HD derivation skips keys the wallet already has
+    while (vPubKeys.empty())
+        vPubKeys = GenerateNewKeys(walletdb, 1);
+    return vPubKeys[0];
+}
+
+namespace {
+/** Number of keys added to the keypool per database transaction */
+const size_t KEYPOOL_BATCH_SIZE = 1000;
 
+/** A key being generated, with its HD child index when derived */
+struct CNewKey
+{
+    uint32_t nChild;
     CKey secret;
+    CPubKey pubkey;
+};
+
+void ComputeNewKey(const CExtKey* pchainKey, bool fCompressed, CNewKey& newkey)
+{
+    if (pchainKey) {
+        // always derive hardened keys
+        // childIndex | BIP32_HARDENED_KEY_LIMIT = derive childIndex in hardened child-index-range
+        // example: 1 | BIP32_HARDENED_KEY_LIMIT == 0x80000001 == 2147483649
+        CExtKey childKey;
+        pchainKey->Derive(childKey, newkey.nChild | BIP32_HARDENED_KEY_LIMIT);
+        newkey.secret = childKey.key;
+    } else {
+        newkey.secret.MakeNewKey(fCompressed);
+    }
+    newkey.pubkey = newkey.secret.GetPubKey();
+    assert(newkey.secret.VerifyPubKey(newkey.pubkey));
+}
+}
+
+std::vector<CPubKey> CWallet::GenerateNewKeys(CWalletDB& walletdb, unsigned int nKeys)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
+    bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
 
     // Create new metadata
     int64_t nCreationTime = GetTime();
-    CKeyMetadata metadata(nCreationTime);
 
     // use HD key derivation if HD was enabled during wallet creation
-    if (IsHDEnabled()) {
-        DeriveNewChildKey(metadata, secret);
-    } else {
-        secret.MakeNewKey(fCompressed);
-    }
-
-    // Compressed public keys were introduced in version 0.6.0
-    if (fCompressed)
-        SetMinVersion(FEATURE_COMPRPUBKEY);
+    // for now we use a fixed keypath scheme of m/0'/0'/k
+    bool fHD = IsHDEnabled();
+    CExtKey externalChainChildKey; //key at m/0'/0'
+    if (fHD) {
+        CKey key;                      //master key seed (256bit)
+        CExtKey masterKey;             //hd master key
+        CExtKey accountKey;            //key at m/0'
 
-    CPubKey pubkey = secret.GetPubKey();
-    assert(secret.VerifyPubKey(pubkey));
+        // try to get the master key
+        if (!GetKey(hdChain.masterKeyID, key))
+            throw std::runtime_error(std::string(__func__) + ": Master key not found");
 
-    mapKeyMetadata[pubkey.GetID()] = metadata;
-    UpdateTimeFirstKey(nCreationTime);
+        masterKey.SetMaster(key.begin(), key.size());
 
-    if (!AddKeyPubKey(secret, pubkey))
-        throw std::runtime_error(std::string(__func__) + ": AddKey failed");
-    return pubkey;
-}
+        // derive m/0'
+        // use hardened derivation (child keys >= 0x80000000 are hardened after bip32)
+        masterKey.Derive(accountKey, BIP32_HARDENED_KEY_LIMIT);
 
-void CWallet::DeriveNewChildKey(CKeyMetadata& metadata, CKey& secret)
-{
-    // for now we use a fixed keypath scheme of m/0'/0'/k
-    CKey key;                      //master key seed (256bit)
-    CExtKey masterKey;             //hd master key
-    CExtKey accountKey;            //key at m/0'
-    CExtKey externalChainChildKey; //key at m/0'/0'
-    CExtKey childKey;              //key at m/0'/0'/<n>'
+        // derive m/0'/0'
+        accountKey.Derive(externalChainChildKey, BIP32_HARDENED_KEY_LIMIT);
+    }
 
-    // try to get the master key
-    if (!GetKey(hdChain.masterKeyID, key))
-        throw std::runtime_error(std::string(__func__) + ": Master key not found");
+    // The elliptic curve work for every key is independent: spread it over
+    // several threads, then add the keys to the wallet in order
+    std::vector<CNewKey> vNewKeys(nKeys);
+    for (unsigned int i = 0; i < nKeys; i++)
+        vNewKeys[i].nChild = hdChain.nExternalChainCounter + i;
 
-    masterKey.SetMaster(key.begin(), key.size());
+    const CExtKey* pchainKey = fHD ? &externalChainChildKey : NULL;
+    ParallelFor(vNewKeys.size(), [&](size_t i) {
+        ComputeNewKey(pchainKey, fCompressed, vNewKeys[i]);
+    });
 
-    // derive m/0'
-    // use hardened derivation (child keys >= 0x80000000 are hardened after bip32)
-    masterKey.Derive(accountKey, BIP32_HARDENED_KEY_LIMIT);
+    // Compressed public keys were introduced in version 0.6.0
+    if (fCompressed)
+        SetMinVersion(FEATURE_COMPRPUBKEY, &walletdb);
+
+    std::vector<CPubKey> vPubKeys;
+    for (const CNewKey& newkey : vNewKeys) {
+        CKeyMetadata metadata(nCreationTime);
+        if (fHD) {
+            metadata.hdKeypath = "m/0'/0'/" + std::to_string(newkey.nChild) + "'";
+            metadata.hdMasterKeyID = hdChain.masterKeyID;
+            // increment childkey index
+            hdChain.nExternalChainCounter = newkey.nChild + 1;
+            // skip keys already known to the wallet
+            if (HaveKey(newkey.pubkey.GetID()))
+                continue;
+        }
 
-    // derive m/0'/0'
-    accountKey.Derive(externalChainChildKey, BIP32_HARDENED_KEY_LIMIT);
+        mapKeyMetadata[newkey.pubkey.GetID()] = metadata;
+        UpdateTimeFirstKey(nCreationTime);
 
-    // derive child key at next index, skip keys already known to the wallet
-    do {
-        // always derive hardened keys
-        // childIndex | BIP32_HARDENED_KEY_LIMIT = derive childIndex in hardened child-index-range
-        // example: 1 | BIP32_HARDENED_KEY_LIMIT == 0x80000001 == 2147483649
-        externalChainChildKey.Derive(childKey, hdChain.nExternalChainCounter | BIP32_HARDENED_KEY_LIMIT);
-        metadata.hdKeypath = "m/0'/0'/" + std::to_string(hdChain.nExternalChainCounter) + "'";
-        metadata.hdMasterKeyID = hdChain.masterKeyID;
-        // increment childkey index
-        hdChain.nExternalChainCounter++;
-    } while (HaveKey(childKey.key.GetPubKey().GetID()));
-    secret = childKey.key;
+        if (!AddKeyPubKeyWithDB(walletdb, newkey.secret, newkey.pubkey))
+            throw std::runtime_error(std::string(__func__) + ": AddKey failed");
+        vPubKeys.push_back(newkey.pubkey);
+    }
 
     // update the chain model in the database
-    if (!CWalletDB(strWalletFile).WriteHDChain(hdChain))
+    if (fHD && !walletdb.WriteHDChain(hdChain))
         throw std::runtime_error(std::string(__func__) + ": Writing HD chain model failed");
+
+    return vPubKeys;
+}
+
+SaltedScriptHasher::SaltedScriptHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+void CWallet::AddMineScriptsForKey(const CPubKey& pubkey)
+{
+    LOCK(cs_KeyStore);
+    setMineScripts.insert(GetScriptForRawPubKey(pubkey));
+    setMineScripts.insert(GetScriptForDestination(pubkey.GetID()));
+}
+
+void CWallet::AddMineScriptsForScript(const CScript& redeemScript)
+{
+    // Outputs already in the wallet may pay to it
+    fUnspentTxStale = true;
+    LOCK(cs_KeyStore);
+    setMineScripts.insert(GetScriptForDestination(CScriptID(redeemScript)));
+    // A known P2SH-wrapped witness program also makes the bare one ours
+    int witnessversion;
+    std::vector<unsigned char> witnessprogram;
+    if (redeemScript.IsWitnessProgram(witnessversion, witnessprogram))
+        setMineScripts.insert(redeemScript);
 }
 
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
+{
+    CWalletDB walletdb(strWalletFile);
+    return AddKeyPubKeyWithDB(walletdb, secret, pubkey);
+}
+
+bool CWallet::AddKeyPubKeyWithDB(CWalletDB& walletdb, const CKey& secret, const CPubKey &pubkey)
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
-    if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
+
+    // CCryptoKeyStore stores encrypted keys through AddCryptedKey below;
+    // hand it the caller's database so they end up in its transaction.
+    bool fTunnelDB = !pwalletdbEncryption;
+    if (fTunnelDB)
+        pwalletdbEncryption = &walletdb;
+    bool fAdded = CCryptoKeyStore::AddKeyPubKey(secret, pubkey);
+    if (fTunnelDB)
+        pwalletdbEncryption = NULL;
+    if (!fAdded)
         return false;
+    AddMineScriptsForKey(pubkey);
 
     // check if we need to remove from watch-only
     CScript script;
     script = GetScriptForDestination(pubkey.GetID());
     if (HaveWatchOnly(script))
-        RemoveWatchOnly(script);
+        RemoveWatchOnlyWithDB(walletdb, script);
     script = GetScriptForRawPubKey(pubkey);
     if (HaveWatchOnly(script))
-        RemoveWatchOnly(script);
+        RemoveWatchOnlyWithDB(walletdb, script);
 
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
-        return CWalletDB(strWalletFile).WriteKey(pubkey,
-                                                 secret.GetPrivKey(),
-                                                 mapKeyMetadata[pubkey.GetID()]);
+        return walletdb.WriteKey(pubkey,
+                                 secret.GetPrivKey(),
+                                 mapKeyMetadata[pubkey.GetID()]);
     }
     return true;
 }
@@ -190,6 +270,7 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    AddMineScriptsForKey(vchPubKey);
     if (!fFileBacked)
         return true;
     {
@@ -214,9 +295,20 @@ bool CWallet::LoadKeyMetadata(const CTxDestination& keyID, const CKeyMetadata &m
     return true;
 }
 
+bool CWallet::LoadKey(const CKey& key, const CPubKey &pubkey)
+{
+    if (!CCryptoKeyStore::AddKeyPubKey(key, pubkey))
+        return false;
+    AddMineScriptsForKey(pubkey);
+    return true;
+}
+
 bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
-    return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret);
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    AddMineScriptsForKey(vchPubKey);
+    return true;
 }
 
 void CWallet::UpdateTimeFirstKey(int64_t nCreateTime)
@@ -235,6 +327,7 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    AddMineScriptsForScript(redeemScript);
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -253,13 +346,21 @@ bool CWallet::LoadCScript(const CScript& redeemScript)
         return true;
     }
 
-    return CCryptoKeyStore::AddCScript(redeemScript);
+    if (!CCryptoKeyStore::AddCScript(redeemScript))
+        return false;
+    AddMineScriptsForScript(redeemScript);
+    return true;
 }
 
 bool CWallet::AddWatchOnly(const CScript& dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    {
+        LOCK(cs_KeyStore);
+        setMineScripts.insert(dest);
+    }
+    fUnspentTxStale = true;
     const CKeyMetadata& meta = mapKeyMetadata[CScriptID(dest)];
     UpdateTimeFirstKey(meta.nCreateTime);
     NotifyWatchonlyChanged(true);
@@ -275,6 +376,12 @@ bool CWallet::AddWatchOnly(const CScript& dest, int64_t nCreateTime)
 }
 
 bool CWallet::RemoveWatchOnly(const CScript &dest)
+{
+    CWalletDB walletdb(strWalletFile);
+    return RemoveWatchOnlyWithDB(walletdb, dest);
+}
+
+bool CWallet::RemoveWatchOnlyWithDB(CWalletDB& walletdb, const CScript &dest)
 {
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
@@ -282,7 +389,7 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (fFileBacked)
-        if (!CWalletDB(strWalletFile).EraseWatchOnly(dest))
+        if (!walletdb.EraseWatchOnly(dest))
             return false;
 
     return true;
@@ -290,11 +397,20 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
 
 bool CWallet::LoadWatchOnly(const CScript &dest)
 {
-    return CCryptoKeyStore::AddWatchOnly(dest);
+    if (!CCryptoKeyStore::AddWatchOnly(dest))
+        return false;
+    LOCK(cs_KeyStore);
+    setMineScripts.insert(dest);
+    return true;
 }
 
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)
 {
+    // Unlocking again with the same passphrase, as walletpassphrase does to
+    // extend the unlock time, skips the nDeriveIterations key derivation
+    if (IsUnlockedWith(strWalletPassphrase))
+        return true;
+
     CCrypter crypter;
     CKeyingMaterial vMasterKey;
 
@@ -306,8 +422,10 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase)
                 return false;
             if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
                 continue; // try another master key
-            if (CCryptoKeyStore::Unlock(vMasterKey))
+            if (CCryptoKeyStore::Unlock(vMasterKey)) {
+                SetUnlockPassphrase(strWalletPassphrase);
                 return true;
+            }
         }
     }
     return false;
@@ -361,6 +479,16 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
 
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
+    {
+        // Never record a best block ahead of the transactions it contains:
+        // while some are still queued, keep the old locator so that they are
+        // found again by the rescan at the next startup
+        LOCK(cs_wallet);
+        if (!WritePendingTxs()) {
+            LogPrintf("%s: keeping the previous best block, wallet transactions could not be written\n", __func__);
+            return;
+        }
+    }
     CWalletDB walletdb(strWalletFile);
     walletdb.WriteBestBlock(loc);
 }
@@ -436,6 +564,10 @@ bool CWallet::HasWalletSpend(const uint256& txid) const
 
 void CWallet::Flush(bool shutdown)
 {
+    {
+        LOCK(cs_wallet);
+        WritePendingTxs();
+    }
     bitdb.Flush(shutdown);
 }
 
@@ -762,12 +894,43 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     int64_t nRet = nOrderPosNext++;
     if (pwalletdb) {
         pwalletdb->WriteOrderPosNext(nOrderPosNext);
-    } else {
+    } else if (!fQueueTxWrites) {
+        // Queued writes store it along with the transactions
         CWalletDB(strWalletFile).WriteOrderPosNext(nOrderPosNext);
     }
     return nRet;
 }
 
+bool CWallet::WritePendingTxs()
+{
+    AssertLockHeld(cs_wallet); // setPendingTxWrites, mapWallet
+    fQueueTxWrites = false;
+    if (setPendingTxWrites.empty())
+        return true;
+
+    // Keep each database transaction well inside the environment's lock limits
+    static const size_t MAX_TX_WRITES_PER_COMMIT = 1000;
+    CWalletDB walletdb(strWalletFile);
+    std::set<uint256>::iterator it = setPendingTxWrites.begin();
+    while (it != setPendingTxWrites.end()) {
+        bool fOk = walletdb.TxnBegin();
+        std::set<uint256>::iterator itEnd = it;
+        for (size_t n = 0; fOk && itEnd != setPendingTxWrites.end() && n < MAX_TX_WRITES_PER_COMMIT; ++itEnd, ++n) {
+            std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(*itEnd);
+            if (mi != mapWallet.end())
+                fOk = walletdb.WriteTx(mi->second);
+        }
+        fOk = fOk && walletdb.WriteOrderPosNext(nOrderPosNext) && walletdb.TxnCommit();
+        if (!fOk) {
+            walletdb.TxnAbort();
+            LogPrintf("%s: failed to write %u wallet transactions, keeping them queued\n", __func__, setPendingTxWrites.size());
+            return false;
+        }
+        it = setPendingTxWrites.erase(it, itEnd);
+    }
+    return true;
+}
+
 bool CWallet::AccountMove(std::string strFrom, std::string strTo, CAmount nAmount, std::string strComment)
 {
     CWalletDB walletdb(strWalletFile);
@@ -846,7 +1009,132 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        fUnspentTxStale = true;
+    }
+}
+
+void CWallet::MarkInputsDirty(const CTransaction& tx)
+{
+    AssertLockHeld(cs_wallet);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(txin.prevout.hash);
+        if (mi != mapWallet.end()) {
+            mi->second.MarkDirty();
+            setUnspentTx.insert(mi->first);
+        }
+    }
+}
+
+std::vector<const CWalletTx*> CWallet::GetUnspentTxs() const
+{
+    AssertLockHeld(cs_wallet);
+    if (fUnspentTxStale) {
+        setUnspentTx.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setUnspentTx.insert(setUnspentTx.end(), it->first);
+        fUnspentTxStale = false;
+    }
+
+    std::vector<const CWalletTx*> vRet;
+    vRet.reserve(setUnspentTx.size());
+    std::set<uint256>::iterator it = setUnspentTx.begin();
+    while (it != setUnspentTx.end()) {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(*it);
+        bool fUnspent = false;
+        if (mi != mapWallet.end()) {
+            const CTransaction& tx = *mi->second.tx;
+            for (unsigned int i = 0; i < tx.vout.size() && !fUnspent; i++)
+                fUnspent = IsMine(tx.vout[i]) != ISMINE_NO && !IsSpent(*it, i);
+        }
+        if (fUnspent) {
+            vRet.push_back(&mi->second);
+            ++it;
+        } else {
+            setUnspentTx.erase(it++);
+        }
+    }
+    return vRet;
+}
+
+void CWallet::IndexTxByBlock(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+    if (!wtx.hashUnset() && wtx.nIndex >= 0)
+        mapTxsByBlock[wtx.hashBlock].insert(wtx.GetHash());
+    else
+        setTxsNotInChain.insert(wtx.GetHash());
+}
+
+std::vector<const CWalletTx*> CWallet::GetTxsSinceBlock(const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    std::vector<const CWalletTx*> vRet;
+    if (!pindex) {
+        vRet.reserve(mapWallet.size());
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            vRet.push_back(&it->second);
+        return vRet;
     }
+
+    if (fTxsNotInChainStale) {
+        // Blocks may have gone while the wallet was not loaded
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            if (it->second.GetDepthInMainChain() <= 0)
+                setTxsNotInChain.insert(it->first);
+        fTxsNotInChainStale = false;
+    }
+
+    // Confirmed since pindex: walk the blocks after it, or the index when
+    // that is shorter
+    std::vector<std::pair<int, std::map<uint256, std::set<uint256> >::iterator> > vBlocks;
+    if (chainActive.Height() - pindex->nHeight <= (int)mapTxsByBlock.size()) {
+        for (const CBlockIndex* pblock = chainActive.Next(pindex); pblock; pblock = chainActive.Next(pblock)) {
+            std::map<uint256, std::set<uint256> >::iterator mi = mapTxsByBlock.find(pblock->GetBlockHash());
+            if (mi != mapTxsByBlock.end())
+                vBlocks.push_back(std::make_pair(pblock->nHeight, mi));
+        }
+    } else {
+        for (std::map<uint256, std::set<uint256> >::iterator mi = mapTxsByBlock.begin(); mi != mapTxsByBlock.end(); ++mi) {
+            BlockMap::const_iterator bi = mapBlockIndex.find(mi->first);
+            if (bi != mapBlockIndex.end() && bi->second->nHeight > pindex->nHeight && chainActive.Contains(bi->second))
+                vBlocks.push_back(std::make_pair(bi->second->nHeight, mi));
+        }
+        std::sort(vBlocks.begin(), vBlocks.end(), [](const std::pair<int, std::map<uint256, std::set<uint256> >::iterator>& a,
+                                                     const std::pair<int, std::map<uint256, std::set<uint256> >::iterator>& b) {
+            return a.first < b.first;
+        });
+    }
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        const uint256& hashBlock = vBlocks[i].second->first;
+        std::set<uint256>& setTxs = vBlocks[i].second->second;
+        std::set<uint256>::iterator it = setTxs.begin();
+        while (it != setTxs.end()) {
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(*it);
+            if (mi == mapWallet.end() || mi->second.hashBlock != hashBlock || mi->second.nIndex < 0) {
+                it = setTxs.erase(it);
+                continue;
+            }
+            vRet.push_back(&mi->second);
+            ++it;
+        }
+        if (setTxs.empty())
+            mapTxsByBlock.erase(vBlocks[i].second);
+    }
+
+    // Not in the active chain, hence with no confirmations or conflicted
+    std::set<uint256>::iterator it = setTxsNotInChain.begin();
+    while (it != setTxsNotInChain.end()) {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(*it);
+        if (mi == mapWallet.end() || mi->second.GetDepthInMainChain() > 0) {
+            it = setTxsNotInChain.erase(it);
+            continue;
+        }
+        vRet.push_back(&mi->second);
+        ++it;
+    }
+    return vRet;
 }
 
 bool CWallet::MarkReplaced(const uint256& originalHash, const uint256& newHash)
@@ -882,7 +1170,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFlushOnClose)
 {
     LOCK(cs_wallet);
 
-    CWalletDB walletdb(strWalletFile, "r+", fFlushOnClose);
+    std::unique_ptr<CWalletDB> pwalletdb;
+    if (!fQueueTxWrites)
+        pwalletdb.reset(new CWalletDB(strWalletFile, "r+", fFlushOnClose));
 
     uint256 hash = wtxIn.GetHash();
 
@@ -894,7 +1184,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFlushOnClose)
     if (fInsertedNew)
     {
         wtx.nTimeReceived = GetAdjustedTime();
-        wtx.nOrderPos = IncOrderPosNext(&walletdb);
+        wtx.nOrderPos = IncOrderPosNext(pwalletdb.get());
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
         wtx.nTimeSmart = wtx.nTimeReceived;
@@ -975,12 +1265,17 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFlushOnClose)
     LogPrintf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
     // Write to disk
-    if (fInsertedNew || fUpdated)
-        if (!walletdb.WriteTx(wtx))
+    if (fInsertedNew || fUpdated) {
+        if (fQueueTxWrites)
+            setPendingTxWrites.insert(hash);
+        else if (!pwalletdb->WriteTx(wtx))
             return false;
+    }
 
     // Break debit/credit balance caches:
     wtx.MarkDirty();
+    setUnspentTx.insert(hash);
+    IndexTxByBlock(wtx);
 
     // Notify UI of new or updated transaction
     NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -1006,6 +1301,7 @@ bool CWallet::LoadToWallet(const CWalletTx& wtxIn)
     wtx.BindWallet(this);
     wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
     AddToSpends(hash);
+    IndexTxByBlock(wtx);
     BOOST_FOREACH(const CTxIn& txin, wtx.tx->vin) {
         if (mapWallet.count(txin.prevout.hash)) {
             CWalletTx& prevtx = mapWallet[txin.prevout.hash];
@@ -1099,6 +1395,7 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
             wtx.nIndex = -1;
             wtx.setAbandoned();
             wtx.MarkDirty();
+            IndexTxByBlock(wtx);
             walletdb.WriteTx(wtx);
             NotifyTransactionChanged(this, wtx.GetHash(), CT_UPDATED);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them abandoned too
@@ -1111,11 +1408,7 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
             }
             // If a transaction changes 'conflicted' state, that changes the balance
             // available of the outputs it spends. So force those to be recomputed
-            BOOST_FOREACH(const CTxIn& txin, wtx.tx->vin)
-            {
-                if (mapWallet.count(txin.prevout.hash))
-                    mapWallet[txin.prevout.hash].MarkDirty();
-            }
+            MarkInputsDirty(*wtx.tx);
         }
     }
 
@@ -1161,6 +1454,7 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
             wtx.nIndex = -1;
             wtx.hashBlock = hashBlock;
             wtx.MarkDirty();
+            IndexTxByBlock(wtx);
             walletdb.WriteTx(wtx);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them conflicted too
             TxSpends::const_iterator iter = mapTxSpends.lower_bound(COutPoint(now, 0));
@@ -1172,11 +1466,7 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
             }
             // If a transaction changes 'conflicted' state, that changes the balance
             // available of the outputs it spends. So force those to be recomputed
-            BOOST_FOREACH(const CTxIn& txin, wtx.tx->vin)
-            {
-                if (mapWallet.count(txin.prevout.hash))
-                    mapWallet[txin.prevout.hash].MarkDirty();
-            }
+            MarkInputsDirty(*wtx.tx);
         }
     }
 }
@@ -1185,17 +1475,31 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex,
 {
     LOCK2(cs_main, cs_wallet);
 
-    if (!AddToWalletIfInvolvingMe(tx, pindex, posInBlock, true))
-        return; // Not one of ours
+    // A disconnected block changes the depth of everything it contained;
+    // recheck all wallet transactions rather than tracking each spender.
+    if (pindex != NULL && posInBlock == CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK) {
+        fUnspentTxStale = true;
+        if (mapWallet.count(tx.GetHash()))
+            setTxsNotInChain.insert(tx.GetHash());
+    }
 
-    // If a transaction changes 'conflicted' state, that changes the balance
-    // available of the outputs it spends. So force those to be
-    // recomputed, also:
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-    {
-        if (mapWallet.count(txin.prevout.hash))
-            mapWallet[txin.prevout.hash].MarkDirty();
+    // Writes for a connected block's transactions are committed together
+    // after its last one.
+    bool fInBlock = pindex != NULL && posInBlock != CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK;
+    if (fInBlock)
+        fQueueTxWrites = true;
+    else
+        WritePendingTxs();
+
+    if (AddToWalletIfInvolvingMe(tx, pindex, posInBlock, true)) {
+        // If a transaction changes 'conflicted' state, that changes the balance
+        // available of the outputs it spends. So force those to be
+        // recomputed, also:
+        MarkInputsDirty(tx);
     }
+
+    if (fInBlock && (unsigned int)posInBlock + 1 >= pindex->nTx)
+        WritePendingTxs();
 }
 
 
@@ -1232,8 +1536,48 @@ CAmount CWallet::GetDebit(const CTxIn &txin, const isminefilter& filter) const
     return 0;
 }
 
+/**
+ * Whether a script ending in OP_CHECKSIG is byte for byte the P2PK or P2PKH
+ * script setMineScripts lists for a key. Solver also matches these templates
+ * when they are written with non-minimal pushes, which no set of scripts
+ * lists, so any other such script needs a key lookup.
+ */
+static bool IsCanonicalKeyScript(const CScript& script)
+{
+    if (script.size() == 25)
+        return script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 && script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG;
+    if (script.size() == 35)
+        return script[0] == 33 && script[34] == OP_CHECKSIG;
+    if (script.size() == 67)
+        return script[0] == 65 && script[66] == OP_CHECKSIG;
+    return false;
+}
+
+/** Whether an output script can be ours without being listed in setMineScripts */
+static bool NeedsKeyLookup(const CScript& script)
+{
+    if (script.empty())
+        return false;
+    // Bare multisig is ours when we have all its keys, which no set of
+    // scripts can express.
+    if (script.back() == OP_CHECKMULTISIG)
+        return true;
+    return script.back() == OP_CHECKSIG && !IsCanonicalKeyScript(script);
+}
+
+bool CWallet::MayBeMine(const CScript& scriptPubKey) const
+{
+    // Leave scripts the set cannot list to ::IsMine
+    if (NeedsKeyLookup(scriptPubKey))
+        return true;
+    LOCK(cs_KeyStore);
+    return setMineScripts.count(scriptPubKey) > 0;
+}
+
 isminetype CWallet::IsMine(const CTxOut& txout) const
 {
+    if (!MayBeMine(txout.scriptPubKey))
+        return ISMINE_NO;
     return ::IsMine(*this, txout.scriptPubKey);
 }
 
@@ -1253,7 +1597,7 @@ bool CWallet::IsChange(const CTxOut& txout) const
     // a better way of identifying which outputs are 'the send' and which are
     // 'the change' will need to be implemented (maybe extend CWalletTx to remember
     // which output, if any, was change).
-    if (::IsMine(*this, txout.scriptPubKey))
+    if (IsMine(txout))
     {
         CTxDestination address;
         if (!ExtractDestination(txout.scriptPubKey, address))
@@ -1541,22 +1885,116 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
     }
 }
 
+bool CWalletScanFilter::MatchesOutput(const CTxOut& txout) const
+{
+    if (setScripts.count(txout.scriptPubKey))
+        return true;
+
+    // Same exceptions as CWallet::MayBeMine: bare multisig and key scripts
+    // with non-minimal pushes need a key lookup. Having any of the multisig
+    // keys is enough here, IsMine checks for all of them.
+    const CScript& script = txout.scriptPubKey;
+    if (!NeedsKeyLookup(script))
+        return false;
+    std::vector<std::vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    if (!Solver(script, whichType, vSolutions))
+        return false;
+    switch (whichType)
+    {
+    case TX_PUBKEY:
+        return setKeys.count(CPubKey(vSolutions[0]).GetID()) > 0;
+    case TX_PUBKEYHASH:
+        return setKeys.count(CKeyID(uint160(vSolutions[0]))) > 0;
+    case TX_MULTISIG:
+        for (size_t i = 1; i + 1 < vSolutions.size(); i++) {
+            if (setKeys.count(CPubKey(vSolutions[i]).GetID()))
+                return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool CWalletScanFilter::MatchesAnyOutput(const CTransaction& tx) const
+{
+    for (const CTxOut& txout : tx.vout) {
+        if (MatchesOutput(txout))
+            return true;
+    }
+    return false;
+}
+
+CWalletScanFilter CWallet::GetScanFilter() const
+{
+    AssertLockHeld(cs_wallet);
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    LOCK(cs_KeyStore);
+    return CWalletScanFilter(setMineScripts, setKeys);
+}
+
+namespace {
+/** Blocks read and matched by the worker threads between lock windows of a rescan */
+const size_t RESCAN_BATCH_SIZE = 32;
+
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    CDiskBlockPos pos;
+    uint256 hash;
+    bool fRead;
+    CBlock block;
+    //! Per transaction: whether any output matched the scan filter
+    std::vector<bool> vMatch;
+
+    CRescanBlock(CBlockIndex* pindexIn) : pindex(pindexIn), pos(pindexIn->GetBlockPos()), hash(pindexIn->GetBlockHash()), fRead(false) {}
+};
+
+void ReadRescanBlock(CRescanBlock& rb, const CWalletScanFilter& filter)
+{
+    rb.fRead = ReadIndexedBlockFromDisk(rb.block, rb.pos, rb.hash);
+    if (!rb.fRead)
+        return;
+    rb.vMatch.resize(rb.block.vtx.size());
+    for (size_t n = 0; n < rb.block.vtx.size(); n++)
+        rb.vMatch[n] = filter.MatchesAnyOutput(*rb.block.vtx[n]);
+}
+}
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
  *
+ * Blocks are read and their outputs matched against a snapshot of the
+ * wallet's keys and scripts in parallel, a batch at a time; cs_main and
+ * cs_wallet are only taken to collect a batch and to apply its results.
+ * Keys added to the wallet while the scan runs are not matched by it.
+ * Callers should not hold cs_wallet, or the wallet stays locked throughout.
+ * They must have reserved the scan with reserver, so that only one runs at a
+ * time. pfMissingBlocks is set if some blocks, pruned meanwhile or unreadable,
+ * could not be scanned.
+ *
  * Returns pointer to the first block in the last contiguous range that was
  * successfully scanned.
- *
  */
-CBlockIndex* CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+CBlockIndex* CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, const CWalletRescanReserver& reserver, bool fUpdate, bool* pfMissingBlocks)
 {
+    assert(reserver.IsReserved());
+    if (pfMissingBlocks)
+        *pfMissingBlocks = false;
+    nScanStartTime = GetTimeMillis();
+    dScanProgress = 0;
+
     CBlockIndex* ret = nullptr;
     int64_t nNow = GetTime();
     const CChainParams& chainParams = Params();
 
     CBlockIndex* pindex = pindexStart;
+    CWalletScanFilter filter;
+    double dProgressStart, dProgressTip;
     {
         LOCK2(cs_main, cs_wallet);
 
@@ -1565,33 +2003,74 @@ CBlockIndex* CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool f
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = GuessVerificationProgress(chainParams.TxData(), pindex);
-        double dProgressTip = GuessVerificationProgress(chainParams.TxData(), chainActive.Tip());
-        while (pindex)
+        filter = GetScanFilter();
+        dProgressStart = GuessVerificationProgress(chainParams.TxData(), pindex);
+        dProgressTip = GuessVerificationProgress(chainParams.TxData(), chainActive.Tip());
+    }
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+
+    std::vector<CRescanBlock> vBlocks;
+    while (pindex && !fAbortRescan)
+    {
+        vBlocks.clear();
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((GuessVerificationProgress(chainParams.TxData(), pindex) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            LOCK(cs_main);
+            for (CBlockIndex* p = pindex; p && vBlocks.size() < RESCAN_BATCH_SIZE; p = chainActive.Next(p))
+                vBlocks.push_back(CRescanBlock(p));
+        }
+
+        ParallelFor(vBlocks.size(), [&](size_t i) {
+            ReadRescanBlock(vBlocks[i], filter);
+        });
 
-            CBlock block;
-            if (ReadBlockFromDisk(block, pindex, Params().GetConsensus())) {
-                for (size_t posInBlock = 0; posInBlock < block.vtx.size(); ++posInBlock) {
-                    AddToWalletIfInvolvingMe(*block.vtx[posInBlock], pindex, posInBlock, fUpdate);
+        {
+            LOCK2(cs_main, cs_wallet);
+            fQueueTxWrites = true;
+            pindex = nullptr;
+            for (CRescanBlock& rb : vBlocks) {
+                if (!chainActive.Contains(rb.pindex)) {
+                    // Reorganized away while the batch was read; the wallet
+                    // saw the disconnects, so resume after the fork point.
+                    pindex = chainActive.Next(chainActive.FindFork(rb.pindex));
+                    break;
                 }
-                if (!ret) {
-                    ret = pindex;
+                if (rb.fRead) {
+                    for (size_t posInBlock = 0; posInBlock < rb.block.vtx.size(); ++posInBlock) {
+                        const CTransaction& tx = *rb.block.vtx[posInBlock];
+                        // Outputs were matched by the readers; spends of and
+                        // conflicts with wallet transactions are found here.
+                        bool fInvolved = rb.vMatch[posInBlock] || mapWallet.count(tx.GetHash());
+                        for (size_t i = 0; !fInvolved && i < tx.vin.size(); i++)
+                            fInvolved = mapWallet.count(tx.vin[i].prevout.hash) || mapTxSpends.count(tx.vin[i].prevout);
+                        if (fInvolved)
+                            AddToWalletIfInvolvingMe(tx, rb.pindex, posInBlock, fUpdate);
+                    }
+                    if (!ret) {
+                        ret = rb.pindex;
+                    }
+                } else {
+                    LogPrintf("%s: block %s at height %d is %s, the rescan misses it\n", __func__, rb.hash.ToString(), rb.pindex->nHeight,
+                              (rb.pindex->nStatus & BLOCK_HAVE_DATA) ? "unreadable" : "pruned");
+                    if (pfMissingBlocks)
+                        *pfMissingBlocks = true;
+                    ret = nullptr;
                 }
-            } else {
-                ret = nullptr;
+                pindex = chainActive.Next(rb.pindex);
             }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
+            WritePendingTxs();
+            if (pindex && dProgressTip - dProgressStart > 0.0)
+                dScanProgress = std::max(0.0, std::min(1.0, (GuessVerificationProgress(chainParams.TxData(), pindex) - dProgressStart) / (dProgressTip - dProgressStart)));
+            if (pindex && GetTime() >= nNow + 60) {
                 nNow = GetTime();
                 LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, GuessVerificationProgress(chainParams.TxData(), pindex));
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+        if (pindex)
+            ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)(dScanProgress * 100))));
     }
+    if (pindex && fAbortRescan)
+        LogPrintf("Rescan aborted at block %d\n", pindex->nHeight);
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     return ret;
 }
 
@@ -1934,9 +2413,8 @@ CAmount CWallet::GetBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1950,9 +2428,8 @@ CAmount CWallet::GetUnconfirmedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1965,9 +2442,8 @@ CAmount CWallet::GetImmatureBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureCredit();
         }
     }
@@ -1979,9 +2455,8 @@ CAmount CWallet::GetWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -1995,9 +2470,8 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -2010,9 +2484,8 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureWatchOnlyCredit();
         }
     }
@@ -2025,10 +2498,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const uint256& wtxid = pcoin->GetHash();
 
             if (!CheckFinalTx(*pcoin))
                 continue;
@@ -2082,8 +2554,8 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             for (unsigned int i = 0; i < pcoin->tx->vout.size(); i++) {
                 isminetype mine = IsMine(pcoin->tx->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->tx->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(COutPoint((*it).first, i))))
+                    !IsLockedCoin(wtxid, i) && (pcoin->tx->vout[i].nValue > 0 || fIncludeZeroValue) &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(COutPoint(wtxid, i))))
                         vCoins.push_back(COutput(pcoin, i, nDepth,
                                                  ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
                                                   (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO),
@@ -2093,7 +2565,13 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
     }
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+//! Steps the branch and bound coin search may take before giving up
+static const int BNB_MAX_TRIES = 100000;
+//! Bound on coins visited by the stochastic coin search (iterations times coins)
+static const size_t MAX_KNAPSACK_STEPS = 10000000;
+static const int MIN_KNAPSACK_ITERATIONS = 20;
+
+static void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
                                   vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -2139,6 +2617,70 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     }
 }
 
+/**
+ * Depth-first branch and bound search for a subset of vValue (sorted by
+ * descending value) totalling between nTargetValue and nTargetValue +
+ * nMaxExcess, so that no change output is needed. Branches that can no
+ * longer reach the target or already overshoot it are cut, and after leaving
+ * a coin out the equal-valued coins following it are left out too, as
+ * including one of them would only repeat an explored branch. Every step is
+ * constant time, and the search gives up after BNB_MAX_TRIES of them.
+ * Returns whether a subset was found, preferring the smallest total seen.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTargetValue,
+                           const CAmount& nMaxExcess, vector<char>& vfBest, CAmount& nBest)
+{
+    const size_t nCoins = vValue.size();
+    // Value of coin i and all after it, and the first coin after i worth less
+    vector<CAmount> vRemaining(nCoins + 1, 0);
+    vector<size_t> vNextSmaller(nCoins + 1, nCoins);
+    for (size_t i = nCoins; i-- > 0; ) {
+        vRemaining[i] = vRemaining[i + 1] + vValue[i].first;
+        if (i + 1 < nCoins && vValue[i + 1].first == vValue[i].first)
+            vNextSmaller[i] = vNextSmaller[i + 1];
+        else
+            vNextSmaller[i] = i + 1;
+    }
+
+    vector<size_t> vSelected, vBestSelected;
+    CAmount nTotal = 0;
+    bool fFound = false;
+    size_t i = 0;
+
+    for (int nTries = 0; nTries < BNB_MAX_TRIES; nTries++)
+    {
+        if (nTotal + vRemaining[i] >= nTargetValue && nTotal < nTargetValue) {
+            // Still short of the target: try including coin i
+            vSelected.push_back(i);
+            nTotal += vValue[i].first;
+            ++i;
+            continue;
+        }
+        if (nTotal >= nTargetValue && nTotal <= nTargetValue + nMaxExcess && (!fFound || nTotal < nBest)) {
+            fFound = true;
+            nBest = nTotal;
+            vBestSelected = vSelected;
+            if (nBest == nTargetValue)
+                break;
+        }
+
+        // Backtrack: leave out the last included coin instead
+        if (vSelected.empty())
+            break; // search space exhausted
+        size_t nLast = vSelected.back();
+        vSelected.pop_back();
+        nTotal -= vValue[nLast].first;
+        i = vNextSmaller[nLast];
+    }
+
+    if (fFound) {
+        vfBest.assign(nCoins, false);
+        BOOST_FOREACH(size_t n, vBestSelected)
+            vfBest[n] = true;
+    }
+    return fFound;
+}
+
 bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMine, const int nConfTheirs, const uint64_t nMaxAncestors, vector<COutput> vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
@@ -2208,15 +2750,36 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMin
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
     std::sort(vValue.begin(), vValue.end(), CompareValueOnly());
     std::reverse(vValue.begin(), vValue.end());
     vector<char> vfBest;
     CAmount nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest);
+    // Look for a set that needs no change first, accepting an excess of up to
+    // what creating and later spending a change output would cost at the
+    // dust relay rate (a third of the dust threshold). CreateTransaction
+    // would drop such change as dust anyway.
+    static const CTxOut changeDummy(0, GetScriptForDestination(CKeyID()));
+    const CAmount nMaxExcess = changeDummy.GetDustThreshold(dustRelayFee) / 3;
+    if (SelectCoinsBnB(vValue, nTargetValue, nMaxExcess, vfBest, nBest) &&
+        (!coinLowestLarger.second.first || nBest < coinLowestLarger.first))
+    {
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+        LogPrint("selectcoins", "SelectCoins() branch and bound: total %s\n", FormatMoney(nBest));
+        return true;
+    }
+
+    // Solve subset sum by stochastic approximation, bounding the total work
+    // for wallets with very many small coins
+    int nIterations = std::max(MIN_KNAPSACK_ITERATIONS, std::min(1000, (int)(MAX_KNAPSACK_STEPS / vValue.size())));
+    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nIterations);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + MIN_CHANGE)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + MIN_CHANGE, vfBest, nBest);
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + MIN_CHANGE, vfBest, nBest, nIterations);
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -2369,34 +2932,24 @@ bool CWallet::FundTransaction(CMutableTransaction& tx, CAmount& nFeeRet, bool ov
     return true;
 }
 
-bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet,
-                                int& nChangePosInOut, std::string& strFailReason, const CCoinControl* coinControl, bool sign)
+/** Whether tx would stay within the mempool's chain limits, if -walletrejectlongchains asks for them to be checked */
+static bool CheckMempoolChainLimits(const CTransactionRef& tx)
 {
-    CAmount nValue = 0;
-    int nChangePosRequest = nChangePosInOut;
-    unsigned int nSubtractFeeFromAmount = 0;
-    for (const auto& recipient : vecSend)
-    {
-        if (nValue < 0 || recipient.nAmount < 0)
-        {
-            strFailReason = _("Transaction amounts must not be negative");
-            return false;
-        }
-        nValue += recipient.nAmount;
-
-        if (recipient.fSubtractFeeFromAmount)
-            nSubtractFeeFromAmount++;
-    }
-    if (vecSend.empty())
-    {
-        strFailReason = _("Transaction must have at least one recipient");
-        return false;
-    }
-
-    wtxNew.fTimeReceivedIsTxTime = true;
-    wtxNew.BindWallet(this);
-    CMutableTransaction txNew;
+    if (!GetBoolArg("-walletrejectlongchains", DEFAULT_WALLET_REJECT_LONG_CHAINS))
+        return true;
+    LockPoints lp;
+    CTxMemPoolEntry entry(tx, 0, 0, 0, 0, 0, false, 0, lp);
+    CTxMemPool::setEntries setAncestors;
+    size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+    size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+    size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+    size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+    std::string errString;
+    return mempool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString);
+}
 
+static uint32_t GetLocktimeForNewTransaction()
+{
     // Discourage fee sniping.
     //
     // For a large miner the value of the transactions in the best block and
@@ -2417,17 +2970,49 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wt
     // enough, that fee sniping isn't a problem yet, but by implementing a fix
     // now we ensure code won't be written that makes assumptions about
     // nLockTime that preclude a fix later.
-    txNew.nLockTime = chainActive.Height();
+    uint32_t nLockTime = chainActive.Height();
 
     // Secondly occasionally randomly pick a nLockTime even further back, so
     // that transactions that are delayed after signing for whatever reason,
     // e.g. high-latency mix networks and some CoinJoin implementations, have
     // better privacy.
     if (GetRandInt(10) == 0)
-        txNew.nLockTime = std::max(0, (int)txNew.nLockTime - GetRandInt(100));
+        nLockTime = std::max(0, (int)nLockTime - GetRandInt(100));
+
+    assert(nLockTime <= (unsigned int)chainActive.Height());
+    assert(nLockTime < LOCKTIME_THRESHOLD);
+    return nLockTime;
+}
+
+bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet,
+                                int& nChangePosInOut, std::string& strFailReason, const CCoinControl* coinControl, bool sign)
+{
+    CAmount nValue = 0;
+    int nChangePosRequest = nChangePosInOut;
+    unsigned int nSubtractFeeFromAmount = 0;
+    for (const auto& recipient : vecSend)
+    {
+        if (nValue < 0 || recipient.nAmount < 0)
+        {
+            strFailReason = _("Transaction amounts must not be negative");
+            return false;
+        }
+        nValue += recipient.nAmount;
+
+        if (recipient.fSubtractFeeFromAmount)
+            nSubtractFeeFromAmount++;
+    }
+    if (vecSend.empty())
+    {
+        strFailReason = _("Transaction must have at least one recipient");
+        return false;
+    }
+
+    wtxNew.fTimeReceivedIsTxTime = true;
+    wtxNew.BindWallet(this);
+    CMutableTransaction txNew;
 
-    assert(txNew.nLockTime <= (unsigned int)chainActive.Height());
-    assert(txNew.nLockTime < LOCKTIME_THRESHOLD);
+    txNew.nLockTime = GetLocktimeForNewTransaction();
 
     {
         set<pair<const CWalletTx*,unsigned int> > setCoins;
@@ -2723,17 +3308,251 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wt
         }
     }
 
-    if (GetBoolArg("-walletrejectlongchains", DEFAULT_WALLET_REJECT_LONG_CHAINS)) {
-        // Lastly, ensure this tx will pass the mempool's chain limits
-        LockPoints lp;
-        CTxMemPoolEntry entry(wtxNew.tx, 0, 0, 0, 0, 0, false, 0, lp);
-        CTxMemPool::setEntries setAncestors;
-        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
-        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
-        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
-        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
-        std::string errString;
-        if (!mempool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+    // Lastly, ensure this tx will pass the mempool's chain limits
+    if (!CheckMempoolChainLimits(wtxNew.tx)) {
+        strFailReason = _("Transaction has too long of a mempool chain");
+        return false;
+    }
+    return true;
+}
+
+int64_t CWallet::EstimateSignedInputWeight(const CScript& scriptPubKey, bool& fWitness) const
+{
+    // Outpoint, nSequence and a one byte scriptSig length
+    static const int64_t nInputBase = 32 + 4 + 4 + 1;
+    // Pushes of a DER signature with its sighash byte, and of a compressed key
+    static const int64_t nSigPush = 1 + 73;
+    static const int64_t nKeyPush = 1 + 33;
+
+    fWitness = false;
+    txnouttype whichType;
+    std::vector<std::vector<unsigned char> > vSolutions;
+    if (Solver(scriptPubKey, whichType, vSolutions)) {
+        CPubKey pubkey;
+        CScript redeemScript;
+        switch (whichType) {
+        case TX_PUBKEY:
+            return (nInputBase + nSigPush) * WITNESS_SCALE_FACTOR;
+        case TX_PUBKEYHASH:
+            if (GetPubKey(CKeyID(uint160(vSolutions[0])), pubkey))
+                return (nInputBase + nSigPush + 1 + pubkey.size()) * WITNESS_SCALE_FACTOR;
+            break;
+        case TX_WITNESS_V0_KEYHASH:
+            // Empty scriptSig; the witness holds its item count, signature and key
+            fWitness = true;
+            return nInputBase * WITNESS_SCALE_FACTOR + 1 + nSigPush + nKeyPush;
+        case TX_SCRIPTHASH:
+            // P2SH-wrapped P2WPKH pushes the witness program in the scriptSig
+            if (GetCScript(CScriptID(uint160(vSolutions[0])), redeemScript) &&
+                Solver(redeemScript, whichType, vSolutions) && whichType == TX_WITNESS_V0_KEYHASH) {
+                fWitness = true;
+                return (nInputBase + 1 + redeemScript.size()) * WITNESS_SCALE_FACTOR + 1 + nSigPush + nKeyPush;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Anything else is measured with a dummy signature
+    SignatureData sigdata;
+    if (!ProduceSignature(DummySignatureCreator(this), scriptPubKey, sigdata))
+        return -1;
+    CTxIn txin;
+    txin.scriptSig = sigdata.scriptSig;
+    fWitness = !sigdata.scriptWitness.IsNull();
+    return ::GetSerializeSize(txin, SER_NETWORK, PROTOCOL_VERSION) * WITNESS_SCALE_FACTOR +
+           (fWitness ? ::GetSerializeSize(sigdata.scriptWitness.stack, SER_NETWORK, PROTOCOL_VERSION) : 0);
+}
+
+namespace {
+/** An input of a batch transaction and, once signed, its signature data */
+struct CBatchInput
+{
+    size_t nTx;
+    unsigned int nIn;
+    const CTxOut* pprevout;
+    SignatureData sigdata;
+    bool fSigned;
+
+    CBatchInput(size_t nTxIn, unsigned int nInIn, const CTxOut* pprevoutIn) : nTx(nTxIn), nIn(nInIn), pprevout(pprevoutIn), fSigned(false) {}
+};
+
+void SignBatchInput(const CKeyStore& keystore, const std::vector<CTransaction>& vtx, CBatchInput& input)
+{
+    input.fSigned = ProduceSignature(TransactionSignatureCreator(&keystore, &vtx[input.nTx], input.nIn, input.pprevout->nValue, SIGHASH_ALL),
+                                     input.pprevout->scriptPubKey, input.sigdata);
+}
+}
+
+bool CWallet::CreateTransactions(const std::vector<CRecipient>& vecSend, unsigned int nMaxOutputs, std::vector<CWalletTx>& vwtxNew,
+                                 std::vector<std::unique_ptr<CReserveKey> >& vReserveKeys, std::string& strFailReason)
+{
+    vwtxNew.clear();
+    vReserveKeys.clear();
+    if (vecSend.empty())
+    {
+        strFailReason = _("Transaction must have at least one recipient");
+        return false;
+    }
+    nMaxOutputs = std::max(nMaxOutputs, 1U);
+    for (const auto& recipient : vecSend)
+    {
+        if (recipient.nAmount < 0)
+        {
+            strFailReason = _("Transaction amounts must not be negative");
+            return false;
+        }
+        if (CTxOut(recipient.nAmount, recipient.scriptPubKey).IsDust(dustRelayFee))
+        {
+            strFailReason = _("Transaction amount too small");
+            return false;
+        }
+    }
+
+    // Change goes to a key from the pool, as in CreateTransaction
+    const CTxOut changeDummy(0, GetScriptForDestination(CKeyID()));
+    std::vector<CMutableTransaction> vtxNew;
+    std::vector<CBatchInput> vInputs;
+
+    LOCK2(cs_main, cs_wallet);
+    std::vector<COutput> vAvailableCoins;
+    AvailableCoins(vAvailableCoins, true);
+
+    for (size_t nStart = 0; nStart < vecSend.size(); nStart += nMaxOutputs)
+    {
+        CMutableTransaction txNew;
+        txNew.nLockTime = GetLocktimeForNewTransaction();
+
+        CAmount nValue = 0;
+        int64_t nOutputsSize = ::GetSerializeSize(changeDummy, SER_NETWORK, PROTOCOL_VERSION);
+        for (size_t i = nStart; i < std::min(vecSend.size(), nStart + nMaxOutputs); i++)
+        {
+            txNew.vout.push_back(CTxOut(vecSend[i].nAmount, vecSend[i].scriptPubKey));
+            nValue += vecSend[i].nAmount;
+            nOutputsSize += ::GetSerializeSize(txNew.vout.back(), SER_NETWORK, PROTOCOL_VERSION);
+        }
+        if (!MoneyRange(nValue))
+        {
+            strFailReason = _("Transaction amounts must not be negative");
+            return false;
+        }
+
+        // Select coins until they cover the fee for the size the signed
+        // transaction will have, which is estimated from the input scripts.
+        set<pair<const CWalletTx*,unsigned int> > setCoins;
+        CAmount nValueIn = 0;
+        CAmount nFeeRet = 0;
+        CAmount nFeeNeeded = 0;
+        while (true)
+        {
+            setCoins.clear();
+            if (!SelectCoins(vAvailableCoins, nValue + nFeeRet, setCoins, nValueIn))
+            {
+                strFailReason = _("Insufficient funds");
+                return false;
+            }
+
+            int64_t nWeight = 0;
+            size_t nNonWitnessInputs = 0;
+            for (const auto& coin : setCoins)
+            {
+                bool fWitness;
+                int64_t nInputWeight = EstimateSignedInputWeight(coin.first->tx->vout[coin.second].scriptPubKey, fWitness);
+                if (nInputWeight < 0)
+                {
+                    strFailReason = _("Signing transaction failed");
+                    return false;
+                }
+                nWeight += nInputWeight;
+                if (!fWitness)
+                    nNonWitnessInputs++;
+            }
+            // Marker, flag and an empty witness for every other input
+            if (nNonWitnessInputs < setCoins.size())
+                nWeight += 2 + nNonWitnessInputs;
+            nWeight += (4 + 4 + GetSizeOfCompactSize(setCoins.size()) + GetSizeOfCompactSize(txNew.vout.size() + 1) + nOutputsSize) * WITNESS_SCALE_FACTOR;
+            if (nWeight >= MAX_STANDARD_TX_WEIGHT)
+            {
+                strFailReason = _("Transaction too large");
+                return false;
+            }
+
+            unsigned int nBytes = (nWeight + WITNESS_SCALE_FACTOR - 1) / WITNESS_SCALE_FACTOR;
+            nFeeNeeded = GetMinimumFee(nBytes, nTxConfirmTarget, mempool);
+            if (nFeeNeeded < ::minRelayTxFee.GetFee(nBytes))
+            {
+                strFailReason = _("Transaction too large for fee policy");
+                return false;
+            }
+            if (nFeeRet >= nFeeNeeded)
+                break;
+            nFeeRet = nFeeNeeded;
+        }
+
+        vReserveKeys.emplace_back(new CReserveKey(this));
+        const CAmount nChange = nValueIn - nValue - nFeeNeeded;
+        if (nChange > 0)
+        {
+            CPubKey vchPubKey;
+            if (!vReserveKeys.back()->GetReservedKey(vchPubKey))
+            {
+                strFailReason = _("Keypool ran out, please call keypoolrefill first");
+                return false;
+            }
+            CTxOut newTxOut(nChange, GetScriptForDestination(vchPubKey.GetID()));
+            // Never create dust outputs; leave the dust to the fee
+            if (newTxOut.IsDust(dustRelayFee))
+                vReserveKeys.back()->ReturnKey();
+            else
+                txNew.vout.insert(txNew.vout.begin() + GetRandInt(txNew.vout.size() + 1), newTxOut);
+        }
+
+        // See CreateTransaction for the choice of nSequence
+        for (const auto& coin : setCoins)
+        {
+            txNew.vin.push_back(CTxIn(coin.first->GetHash(), coin.second, CScript(),
+                                      std::numeric_limits<unsigned int>::max() - (fWalletRbf ? 2 : 1)));
+            vInputs.push_back(CBatchInput(vtxNew.size(), txNew.vin.size() - 1, &coin.first->tx->vout[coin.second]));
+        }
+        vtxNew.push_back(txNew);
+
+        // The following transactions must not spend the same coins
+        vAvailableCoins.erase(std::remove_if(vAvailableCoins.begin(), vAvailableCoins.end(), [&setCoins](const COutput& out) {
+            return setCoins.count(std::make_pair(out.tx, (unsigned int)out.i)) != 0;
+        }), vAvailableCoins.end());
+    }
+
+    // Sign all inputs of the batch at once, spread over several threads
+    std::vector<CTransaction> vtxConst;
+    vtxConst.reserve(vtxNew.size());
+    for (const CMutableTransaction& tx : vtxNew)
+        vtxConst.emplace_back(tx);
+
+    ParallelFor(vInputs.size(), [&](size_t i) {
+        SignBatchInput(*this, vtxConst, vInputs[i]);
+    });
+
+    for (const CBatchInput& input : vInputs)
+    {
+        if (!input.fSigned)
+        {
+            strFailReason = _("Signing transaction failed");
+            return false;
+        }
+        UpdateTransaction(vtxNew[input.nTx], input.nIn, input.sigdata);
+    }
+
+    vwtxNew.resize(vtxNew.size());
+    for (size_t i = 0; i < vtxNew.size(); i++)
+    {
+        vwtxNew[i].fTimeReceivedIsTxTime = true;
+        vwtxNew[i].fFromMe = true;
+        vwtxNew[i].BindWallet(this);
+        vwtxNew[i].SetTx(MakeTransactionRef(std::move(vtxNew[i])));
+        // As in CreateTransaction; the transactions of a batch never spend each other
+        if (!CheckMempoolChainLimits(vwtxNew[i].tx))
+        {
             strFailReason = _("Transaction has too long of a mempool chain");
             return false;
         }
@@ -2990,12 +3809,7 @@ bool CWallet::NewKeyPool()
             return false;
 
         int64_t nKeys = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
+        FillKeyPool(walletdb, nKeys);
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
     return true;
@@ -3018,18 +3832,34 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         else
             nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
 
-        while (setKeyPool.size() < (nTargetSize + 1))
+        FillKeyPool(walletdb, nTargetSize + 1);
+    }
+    return true;
+}
+
+void CWallet::FillKeyPool(CWalletDB& walletdb, size_t nTargetSize)
+{
+    AssertLockHeld(cs_wallet); // setKeyPool
+    while (setKeyPool.size() < nTargetSize)
+    {
+        // Generate the keys of a batch together and store them, with
+        // their pool entries, in one database transaction
+        unsigned int nKeys = std::min(nTargetSize - setKeyPool.size(), KEYPOOL_BATCH_SIZE);
+        if (!walletdb.TxnBegin())
+            throw runtime_error(std::string(__func__) + ": starting database transaction failed");
+        BOOST_FOREACH(const CPubKey& pubkey, GenerateNewKeys(walletdb, nKeys))
         {
             int64_t nEnd = 1;
             if (!setKeyPool.empty())
                 nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+            if (!walletdb.WritePool(nEnd, CKeyPool(pubkey)))
                 throw runtime_error(std::string(__func__) + ": writing generated key failed");
             setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
         }
+        if (!walletdb.TxnCommit())
+            throw runtime_error(std::string(__func__) + ": writing generated keys failed");
+        LogPrintf("keypool added %u keys, size=%u\n", nKeys, setKeyPool.size());
     }
-    return true;
 }
 
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
@@ -3569,6 +4399,9 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
         strUsage += HelpMessageOpt("-dblogsize=<n>", strprintf("Flush wallet database activity from memory to disk log every <n> megabytes (default: %u)", DEFAULT_WALLET_DBLOGSIZE));
         strUsage += HelpMessageOpt("-flushwallet", strprintf("Run a thread to flush wallet periodically (default: %u)", DEFAULT_FLUSHWALLET));
         strUsage += HelpMessageOpt("-privdb", strprintf("Sets the DB_PRIVATE flag in the wallet db environment (default: %u)", DEFAULT_WALLET_PRIVDB));
+        strUsage += HelpMessageOpt("-walletdbsync=<mode>", strprintf("How durable wallet database commits are: full, os or none (default: %s). "
+            "full syncs every commit to disk; os hands it to the operating system, which loses it only if the system crashes; "
+            "none keeps it in memory until the log is flushed, so it is lost if the process crashes", DEFAULT_WALLET_DBSYNC));
         strUsage += HelpMessageOpt("-walletrejectlongchains", strprintf(_("Wallet will not create transactions that violate mempool chain limits (default: %u)"), DEFAULT_WALLET_REJECT_LONG_CHAINS));
     }
 
@@ -3714,7 +4547,12 @@ CWallet* CWallet::CreateWalletFromFile(const std::string walletFile)
         uiInterface.InitMessage(_("Rescanning..."));
         LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
         nStart = GetTimeMillis();
-        walletInstance->ScanForWalletTransactions(pindexRescan, true);
+        {
+            CWalletRescanReserver reserver(walletInstance);
+            bool fReserved = reserver.Reserve();
+            assert(fReserved);
+            walletInstance->ScanForWalletTransactions(pindexRescan, reserver, true);
+        }
         LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
         walletInstance->SetBestChain(chainActive.GetLocator());
         CWalletDB::IncrementUpdateCounter();
@@ -3812,6 +4650,9 @@ bool CWallet::ParameterInteraction()
         return InitError("-sysperms is not allowed in combination with enabled wallet functionality");
     if (GetArg("-prune", 0) && GetBoolArg("-rescan", false))
         return InitError(_("Rescans are not possible in pruned mode. You will need to use -reindex which will download the whole blockchain again."));
+    std::string strDbSync = GetArg("-walletdbsync", DEFAULT_WALLET_DBSYNC);
+    if (strDbSync != "full" && strDbSync != "os" && strDbSync != "none")
+        return InitError(strprintf("Unknown -walletdbsync mode '%s' (use full, os or none)", strDbSync));
 
     if (::minRelayTxFee.GetFeePerK() > HIGH_TX_FEE_PER_KB)
         InitWarning(AmountHighWarn("-minrelaytxfee") + " " +
@@ -7,10 +7,12 @@
 #define BITCOIN_WALLET_WALLET_H
 
 #include "amount.h"
+#include "hash.h"
 #include "streams.h"
 #include "tinyformat.h"
 #include "ui_interface.h"
 #include "utilstrencodings.h"
+#include "utiltime.h"
 #include "validationinterface.h"
 #include "script/ismine.h"
 #include "script/sign.h"
@@ -21,10 +23,12 @@
 #include <algorithm>
 #include <atomic>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdexcept>
 #include <stdint.h>
 #include <string>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -69,6 +73,8 @@ static const bool DEFAULT_WALLET_RBF = false;
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
 static const bool DEFAULT_WALLETBROADCAST = true;
 static const bool DEFAULT_DISABLE_WALLET = false;
+//! Default for the maxoutputs argument of sendbatch
+static const unsigned int DEFAULT_BATCH_MAX_OUTPUTS = 500;
 //! if set, all keys will be derived by using BIP32
 static const bool DEFAULT_USE_HD_WALLET = true;
 
@@ -78,6 +84,7 @@ class CBlockIndex;
 class CCoinControl;
 class COutput;
 class CReserveKey;
+class CWalletRescanReserver;
 class CScript;
 class CTxMemPool;
 class CWalletTx;
@@ -562,6 +569,47 @@ private:
 };
 
 
+class SaltedScriptHasher
+{
+private:
+    /** Salt */
+    uint64_t k0, k1;
+
+public:
+    SaltedScriptHasher();
+
+    size_t operator()(const CScript& script) const {
+        return CSipHasher(k0, k1).Write(script.data(), script.size()).Finalize();
+    }
+};
+
+typedef std::unordered_set<CScript, SaltedScriptHasher> ScriptSet;
+
+/**
+ * Snapshot of the scriptPubKeys and key IDs of a wallet, taken when a rescan
+ * starts so that block outputs can be matched on worker threads without
+ * holding cs_wallet. It accepts every output IsMine accepts (and possibly a
+ * few more, which AddToWalletIfInvolvingMe then rejects).
+ */
+class CWalletScanFilter
+{
+private:
+    ScriptSet setScripts;
+    //! For bare multisig and non-minimal P2PK/P2PKH outputs, which are not in setScripts
+    std::set<CKeyID> setKeys;
+
+public:
+    CWalletScanFilter() {}
+    CWalletScanFilter(const ScriptSet& setScriptsIn, const std::set<CKeyID>& setKeysIn) : setScripts(setScriptsIn), setKeys(setKeysIn) {}
+
+    void AddScript(const CScript& script) { setScripts.insert(script); }
+    void AddKey(const CKeyID& keyID) { setKeys.insert(keyID); }
+
+    bool MatchesOutput(const CTxOut& txout) const;
+    bool MatchesAnyOutput(const CTransaction& tx) const;
+};
+
+
 /** 
  * A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
@@ -569,6 +617,8 @@ private:
 class CWallet : public CCryptoKeyStore, public CValidationInterface
 {
 private:
+    friend class CWalletRescanReserver;
+
     static std::atomic<bool> fFlushThreadRunning;
 
     /**
@@ -603,6 +653,51 @@ private:
     /* Mark a transaction (and its in-wallet descendants) as conflicting with a particular block. */
     void MarkConflicted(const uint256& hashBlock, const uint256& hashTx);
 
+    /* The outputs tx spends may have changed spent state: recompute their balances. */
+    void MarkInputsDirty(const CTransaction& tx);
+
+    /**
+     * Wallet transactions that may still have an unspent output of ours, so
+     * that balances and coin listing skip fully spent history. Transactions
+     * are added when they enter the wallet or when an output they fund may
+     * be unspent again (abandoned or conflicted spender), and are dropped
+     * once all our outputs are spent. A block disconnect or MarkDirty (for
+     * instance after an import) marks the index stale, and it is rebuilt
+     * from mapWallet on next use. Protected by cs_wallet.
+     */
+    mutable std::set<uint256> setUnspentTx;
+    mutable std::atomic<bool> fUnspentTxStale;
+    std::vector<const CWalletTx*> GetUnspentTxs() const;
+
+    /**
+     * While the transactions of a connected block (or a rescan batch) are
+     * being added, AddToWallet queues the changed transactions here instead
+     * of opening the database for each; WritePendingTxs then stores them and
+     * nOrderPosNext in one database transaction. A crash before that only
+     * loses writes for blocks past the wallet's best block locator, which
+     * are rescanned on startup. Protected by cs_wallet.
+     */
+    std::set<uint256> setPendingTxWrites;
+    bool fQueueTxWrites;
+    bool WritePendingTxs();
+
+    //! Generate keys in batches until setKeyPool holds nTargetSize of them
+    void FillKeyPool(CWalletDB& walletdb, size_t nTargetSize);
+
+    /**
+     * Indexes for listing the transactions since a block without visiting
+     * the whole wallet: confirmed transactions by the hash of their block,
+     * and those that may not be in the active chain (unconfirmed,
+     * conflicted, abandoned or in a disconnected block). Entries are added
+     * as transactions change and dropped lazily once they no longer match.
+     * The second set is rebuilt from mapWallet on first use after load.
+     * Protected by cs_wallet.
+     */
+    std::map<uint256, std::set<uint256> > mapTxsByBlock;
+    std::set<uint256> setTxsNotInChain;
+    bool fTxsNotInChainStale;
+    void IndexTxByBlock(const CWalletTx& wtx);
+
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
     /* the HD chain data model (external chain counters) */
@@ -625,6 +720,27 @@ private:
      */
     bool AddWatchOnly(const CScript& dest) override;
 
+    /**
+     * Every scriptPubKey that may be mine: the P2PK and P2PKH scripts of all
+     * keys, the P2SH script of every redeem script (and the script itself if
+     * it is a witness program) and all watch-only scripts. Lets IsMine reject
+     * unrelated outputs with one lookup. Only canonical scripts are listed:
+     * bare multisig outputs, and P2PK/P2PKH outputs written with non-minimal
+     * pushes, always take the full check. Entries are never removed, a stale one
+     * only costs a full check. Protected by cs_KeyStore.
+     */
+    ScriptSet setMineScripts;
+    void AddMineScriptsForKey(const CPubKey& pubkey);
+    void AddMineScriptsForScript(const CScript& redeemScript);
+
+    /* Rescan state, readable and abortable without cs_wallet while a rescan runs */
+    std::atomic<bool> fAbortRescan;
+    std::atomic<bool> fScanningWallet;
+    std::atomic<int64_t> nScanStartTime;
+    std::atomic<double> dScanProgress;
+
+    CWalletScanFilter GetScanFilter() const;
+
 public:
     /*
      * Main wallet lock.
@@ -686,6 +802,13 @@ public:
         nLastResend = 0;
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
+        fUnspentTxStale = true;
+        fQueueTxWrites = false;
+        fTxsNotInChainStale = true;
+        fAbortRescan = false;
+        fScanningWallet = false;
+        nScanStartTime = 0;
+        dScanProgress = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -735,11 +858,27 @@ public:
      * Generate a new key
      */
     CPubKey GenerateNewKey();
-    void DeriveNewChildKey(CKeyMetadata& metadata, CKey& secret);
+    /**
+     * Generate nKeys keys (HD derived when enabled), computing them on
+     * several threads, and save them through walletdb. Returns fewer keys
+     * when HD derivation skips keys the wallet already has.
+     */
+    std::vector<CPubKey> GenerateNewKeys(CWalletDB& walletdb, unsigned int nKeys);
+
+    /**
+     * Wallet transactions with fewer confirmations than one in pindex,
+     * which must be in the active chain, would have; all of them if pindex
+     * is NULL. Costs the number of blocks and transactions since pindex
+     * rather than the size of the wallet.
+     */
+    std::vector<const CWalletTx*> GetTxsSinceBlock(const CBlockIndex* pindex);
+
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey) override;
+    //! Adds a key to the store, and saves it through walletdb.
+    bool AddKeyPubKeyWithDB(CWalletDB& walletdb, const CKey& key, const CPubKey &pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    bool LoadKey(const CKey& key, const CPubKey &pubkey);
     //! Load metadata (used by LoadWallet)
     bool LoadKeyMetadata(const CTxDestination& pubKey, const CKeyMetadata &metadata);
 
@@ -765,6 +904,7 @@ public:
     //! Adds a watch-only address to the store, and saves it to disk.
     bool AddWatchOnly(const CScript& dest, int64_t nCreateTime);
     bool RemoveWatchOnly(const CScript &dest) override;
+    bool RemoveWatchOnlyWithDB(CWalletDB& walletdb, const CScript &dest);
     //! Adds a watch-only address to the store, without saving it to disk (used by LoadWallet)
     bool LoadWatchOnly(const CScript &dest);
 
@@ -788,7 +928,12 @@ public:
     bool LoadToWallet(const CWalletTx& wtxIn);
     void SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex, int posInBlock) override;
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlockIndex* pIndex, int posInBlock, bool fUpdate);
-    CBlockIndex* ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    CBlockIndex* ScanForWalletTransactions(CBlockIndex* pindexStart, const CWalletRescanReserver& reserver, bool fUpdate = false, bool* pfMissingBlocks = NULL);
+    void AbortRescan() { fAbortRescan = true; }
+    bool IsAbortingRescan() const { return fAbortRescan; }
+    bool IsScanning() const { return fScanningWallet; }
+    int64_t ScanningDuration() const { return fScanningWallet ? GetTimeMillis() - nScanStartTime : 0; }
+    double ScanningProgress() const { return fScanningWallet ? (double) dScanProgress : 0; }
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(int64_t nBestBlockTime, CConnman* connman) override;
     std::vector<uint256> ResendWalletTransactionsBefore(int64_t nTime, CConnman* connman);
@@ -812,8 +957,29 @@ public:
      */
     bool CreateTransaction(const std::vector<CRecipient>& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, int& nChangePosInOut,
                            std::string& strFailReason, const CCoinControl *coinControl = NULL, bool sign = true);
+
+    /**
+     * Create and sign transactions paying the recipients, at most
+     * nMaxOutputs of them per transaction, in order. Coins are listed once
+     * for the whole batch and none is used by two of the transactions. Fees
+     * are computed from the size each transaction will have once signed,
+     * estimated from its input scripts, and the wallet pays all of them
+     * (fSubtractFeeFromAmount is ignored). All inputs are signed at the end,
+     * in parallel. vReserveKeys holds the change key of each transaction,
+     * to pass to CommitTransaction along with it.
+     */
+    bool CreateTransactions(const std::vector<CRecipient>& vecSend, unsigned int nMaxOutputs, std::vector<CWalletTx>& vwtxNew,
+                            std::vector<std::unique_ptr<CReserveKey> >& vReserveKeys, std::string& strFailReason);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, CConnman* connman, CValidationState& state);
 
+    /**
+     * Upper bound on the weight an input spending scriptPubKey adds to a
+     * transaction once signed, or -1 if the wallet cannot sign it. fWitness
+     * is set if the input has witness data. Common script types are sized
+     * from their template, others by producing a dummy signature.
+     */
+    int64_t EstimateSignedInputWeight(const CScript& scriptPubKey, bool& fWitness) const;
+
     void ListAccountCreditDebit(const std::string& strAccount, std::list<CAccountingEntry>& entries);
     bool AddAccountingEntry(const CAccountingEntry&);
     bool AddAccountingEntry(const CAccountingEntry&, CWalletDB *pwalletdb);
@@ -861,6 +1027,8 @@ public:
      */
     CAmount GetDebit(const CTxIn& txin, const isminefilter& filter) const;
     isminetype IsMine(const CTxOut& txout) const;
+    /** False if scriptPubKey is certainly not mine; cheap, a single hash lookup */
+    bool MayBeMine(const CScript& scriptPubKey) const;
     CAmount GetCredit(const CTxOut& txout, const isminefilter& filter) const;
     bool IsChange(const CTxOut& txout) const;
     CAmount GetChange(const CTxOut& txout) const;
@@ -997,6 +1165,39 @@ public:
     static std::string GetWalletFileName();
 };
 
+/**
+ * Holds the wallet's only rescan slot from Reserve() until it goes out of
+ * scope, so that a caller can claim it together with its other checks under
+ * cs_wallet and run ScanForWalletTransactions after releasing the lock.
+ */
+class CWalletRescanReserver
+{
+private:
+    CWallet* pwallet;
+    bool fReserved;
+public:
+    explicit CWalletRescanReserver(CWallet* pwalletIn) : pwallet(pwalletIn), fReserved(false) {}
+
+    ~CWalletRescanReserver()
+    {
+        if (fReserved)
+            pwallet->fScanningWallet = false;
+    }
+
+    /** Claim the slot; false if another rescan holds it */
+    bool Reserve()
+    {
+        assert(!fReserved);
+        fReserved = !pwallet->fScanningWallet.exchange(true);
+        // abortrescan applies to this rescan from here on, before it starts
+        if (fReserved)
+            pwallet->fAbortRescan = false;
+        return fReserved;
+    }
+
+    bool IsReserved() const { return fReserved; }
+};
+
 /** A key allocated from the key pool. */
 class CReserveKey : public CReserveScript
 {
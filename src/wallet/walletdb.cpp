@@ -278,6 +278,53 @@ public:
     }
 };
 
+/**
+ * Parse a "tx" record whose key has been read up to the type. Uses no wallet
+ * state, so LoadWallet can run it on several threads.
+ */
+static bool ReadWalletTx(CDataStream& ssKey, CDataStream& ssValue, CWalletTx& wtx, bool& fUpgraded, string& strErr)
+{
+    uint256 hash;
+    ssKey >> hash;
+    ssValue >> wtx;
+    CValidationState state;
+    if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    // Undo serialize changes in 31600
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+
+    return true;
+}
+
+static void LoadWalletTx(CWallet* pwallet, CWalletScanState& wss, const CWalletTx& wtx, bool fUpgraded)
+{
+    if (fUpgraded)
+        wss.vWalletUpgrade.push_back(wtx.GetHash());
+
+    if (wtx.nOrderPos == -1)
+        wss.fAnyUnordered = true;
+
+    pwallet->LoadToWallet(wtx);
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              CWalletScanState &wss, string& strType, string& strErr)
@@ -301,38 +348,11 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "tx")
         {
-            uint256 hash;
-            ssKey >> hash;
             CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgraded = false;
+            if (!ReadWalletTx(ssKey, ssValue, wtx, fUpgraded, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            pwallet->LoadToWallet(wtx);
+            LoadWalletTx(pwallet, wss, wtx, fUpgraded);
         }
         else if (strType == "acentry")
         {
@@ -552,12 +572,71 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+namespace {
+/** Number of "tx" records LoadWallet reads before parsing them together */
+const size_t LOAD_TX_BATCH_SIZE = 1000;
+
+/** A "tx" record read from the cursor, and the transaction parsed from it */
+struct CWalletTxRecord
+{
+    CDataStream ssKey;
+    CDataStream ssValue;
+    CWalletTx wtx;
+    bool fOk;
+    bool fUpgraded;
+    string strErr;
+
+    CWalletTxRecord(const CDataStream& ssKeyIn, const CDataStream& ssValueIn) : ssKey(ssKeyIn), ssValue(ssValueIn), fOk(false), fUpgraded(false) {}
+};
+
+void ReadWalletTxRecord(CWalletTxRecord& rec)
+{
+    try {
+        string strType;
+        rec.ssKey >> strType;
+        rec.fOk = ReadWalletTx(rec.ssKey, rec.ssValue, rec.wtx, rec.fUpgraded, rec.strErr);
+    } catch (...) {
+        rec.fOk = false;
+    }
+}
+}
+
+/**
+ * Deserializing and hashing transactions dominates loading large wallets:
+ * parse a batch of records on several threads, then add them to the wallet
+ * in database order.
+ */
+static void LoadWalletTxRecords(CWallet* pwallet, std::vector<CWalletTxRecord>& vRecords, CWalletScanState& wss, bool& fNoncriticalErrors)
+{
+    if (vRecords.empty())
+        return;
+
+    ParallelFor(vRecords.size(), [&](size_t i) {
+        ReadWalletTxRecord(vRecords[i]);
+    });
+
+    for (const CWalletTxRecord& rec : vRecords) {
+        if (rec.fOk) {
+            LoadWalletTx(pwallet, wss, rec.wtx, rec.fUpgraded);
+        } else {
+            fNoncriticalErrors = true;
+            // Rescan if there is a bad transaction record:
+            SoftSetBoolArg("-rescan", true);
+        }
+        if (!rec.strErr.empty())
+            LogPrintf("%s\n", rec.strErr);
+    }
+    vRecords.clear();
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
     CWalletScanState wss;
     bool fNoncriticalErrors = false;
     DBErrors result = DB_LOAD_OK;
+    std::vector<CWalletTxRecord> vTxRecords;
+    vTxRecords.reserve(LOAD_TX_BATCH_SIZE);
 
     LOCK(pwallet->cs_wallet);
     try {
@@ -591,8 +670,21 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 return DB_CORRUPT;
             }
 
-            // Try to be tolerant of single corrupt records:
             string strType, strErr;
+            try {
+                CDataStream(ssKey) >> strType;
+            } catch (...) {}
+            if (strType == "tx")
+            {
+                vTxRecords.emplace_back(ssKey, ssValue);
+                if (vTxRecords.size() >= LOAD_TX_BATCH_SIZE)
+                    LoadWalletTxRecords(pwallet, vTxRecords, wss, fNoncriticalErrors);
+                continue;
+            }
+            // Later records (accounting entries) depend on the transactions
+            LoadWalletTxRecords(pwallet, vTxRecords, wss, fNoncriticalErrors);
+
+            // Try to be tolerant of single corrupt records:
             if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
             {
                 // losing keys is considered a catastrophic error, anything else
@@ -612,6 +704,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 LogPrintf("%s\n", strErr);
         }
         pcursor->close();
+        LoadWalletTxRecords(pwallet, vTxRecords, wss, fNoncriticalErrors);
     }
     catch (const boost::thread_interrupted&) {
         throw;